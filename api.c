@@ -16,6 +16,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,6 +25,11 @@
 #include <unistd.h>
 #include <sys/types.h>
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <fcntl.h>
+#include <sys/epoll.h>
+#endif
+
 #include "compat.h"
 #include "miner.h"
 #include "util.h"
@@ -51,6 +57,16 @@
 // However lots of PGA's may mean more
 #define QUEUE	100
 
+// Seconds to wait for a request on a new connection, or for the next one
+// on a keep-alive connection, before dropping it
+#define API_WAIT	5
+#define API_IDLE	60
+
+// Events waiting for the API thread to send them to subscribers, and how
+// much a subscriber can leave unread before it's dropped
+#define API_EVENTMAX	1024
+#define API_EVENTBUF	(1024 * 1024)
+
 #if defined WIN32
 static char WSAbuf[1024];
 
@@ -288,6 +304,7 @@ static const char ISJSON = '{';
 
 static const char *JSON_COMMAND = "command";
 static const char *JSON_PARAMETER = "parameter";
+static const char *JSON_KEEPALIVE = "keepalive";
 
 #define MSG_INVGPU 1
 #define MSG_ALRENA 2
@@ -408,6 +425,9 @@ static const char *JSON_PARAMETER = "parameter";
 #define MSG_DISHPLG 101
 #define MSG_NOHPLG 102
 #define MSG_MISHPLG 103
+#define MSG_SUBSCRIBE 104
+#define MSG_NOSUBSCRIBE 105
+#define MSG_GPUTUNE 106
 
 enum code_severity {
 	SEVERITY_ERR,
@@ -603,6 +623,11 @@ struct CODES {
  { SEVERITY_SUCC,  MSG_DISHPLG,	PARAM_NONE,	"Hotplug disabled" },
  { SEVERITY_WARN,  MSG_NOHPLG,	PARAM_NONE,	"Hotplug is not available" },
  { SEVERITY_ERR,   MSG_MISHPLG,	PARAM_NONE,	"Missing hotplug parameter" },
+ { SEVERITY_SUCC,  MSG_SUBSCRIBE,	PARAM_STR,	"Subscribed to %s events" },
+ { SEVERITY_WARN,  MSG_NOSUBSCRIBE, PARAM_NONE,	"Subscribe is not available" },
+#ifdef HAVE_OPENCL
+ { SEVERITY_INFO,  MSG_GPUTUNE,	PARAM_GPU,	"GPU %d autotune and restart attempted" },
+#endif
  { SEVERITY_FAIL, 0, 0, NULL }
 };
 
@@ -617,12 +642,6 @@ static bool do_a_restart;
 
 static time_t when = 0;	// when the request occurred
 
-struct IP4ACCESS {
-	in_addr_t ip;
-	in_addr_t mask;
-	char group;
-};
-
 #define GROUP(g) (toupper(g))
 #define PRIVGROUP GROUP('W')
 #define NOPRIVGROUP GROUP('R')
@@ -640,11 +659,18 @@ struct APIGROUPS {
 static struct IP4ACCESS *ipaccess = NULL;
 static int ips = 0;
 
+/*
+ * Replies are built straight into the io_data, a socket one is allocated
+ * once with room for the largest reply and its JSON ending so it never
+ * needs to grow or be copied before it's sent
+ * A fixed one uses a buffer supplied by the caller and never grows
+ */
 struct io_data {
 	size_t siz;
 	char *ptr;
 	char *cur;
 	bool sock;
+	bool fixed;
 	bool full;
 	bool close;
 };
@@ -658,7 +684,9 @@ struct io_list {
 static struct io_list *io_head = NULL;
 
 #define io_new(init) _io_new(init, false)
-#define sock_io_new() _io_new(SOCKBUFSIZ, true)
+#define sock_io_new() _io_new(RESULTBUFSIZ, true)
+
+#define RESULTBUFSIZ	(SOCKBUFSIZ + sizeof(JSON_CLOSE) + sizeof(JSON_END))
 
 static void io_reinit(struct io_data *io_data)
 {
@@ -677,6 +705,7 @@ static struct io_data *_io_new(size_t initial, bool socket_buf)
 	io_data->ptr = malloc(initial);
 	io_data->siz = initial;
 	io_data->sock = socket_buf;
+	io_data->fixed = false;
 	io_reinit(io_data);
 
 	io_list = malloc(sizeof(*io_list));
@@ -697,40 +726,103 @@ static struct io_data *_io_new(size_t initial, bool socket_buf)
 	return io_data;
 }
 
-static bool io_add(struct io_data *io_data, char *buf)
+static void io_fixed(struct io_data *io_data, char *buf, size_t siz)
+{
+	io_data->ptr = buf;
+	io_data->siz = siz;
+	io_data->sock = false;
+	io_data->fixed = true;
+	io_reinit(io_data);
+}
+
+// Make room to add len bytes and a '\0', or mark it full if there isn't
+static bool io_room(struct io_data *io_data, size_t len)
 {
-	size_t len, dif, tot;
+	size_t dif, tot;
 
 	if (io_data->full)
 		return false;
 
-	len = strlen(buf);
 	dif = io_data->cur - io_data->ptr;
 	tot = len + 1 + dif;
 
+	if (io_data->sock && tot > SOCKBUFSIZ) {
+		io_data->full = true;
+		return false;
+	}
+
 	if (tot > io_data->siz) {
 		size_t new = io_data->siz * 2;
 
+		if (io_data->fixed) {
+			io_data->full = true;
+			return false;
+		}
+
 		if (new < tot)
 			new = tot * 2;
 
-		if (io_data->sock) {
-			if (new > SOCKBUFSIZ) {
-				if (tot > SOCKBUFSIZ) {
-					io_data->full = true;
-					return false;
-				}
-
-				new = SOCKBUFSIZ;
-			}
-		}
+		if (io_data->sock && new > SOCKBUFSIZ)
+			new = SOCKBUFSIZ;
 
 		io_data->ptr = realloc(io_data->ptr, new);
+		if (unlikely(!io_data->ptr))
+			quit(1, "Failed to realloc API io_data");
 		io_data->cur = io_data->ptr + dif;
 		io_data->siz = new;
 	}
 
-	memcpy(io_data->cur, buf, len + 1);
+	return true;
+}
+
+static bool io_addn(struct io_data *io_data, const char *buf, size_t len)
+{
+	if (!io_room(io_data, len))
+		return false;
+
+	memcpy(io_data->cur, buf, len);
+	io_data->cur += len;
+	*(io_data->cur) = '\0';
+
+	return true;
+}
+
+static bool io_add(struct io_data *io_data, char *buf)
+{
+	return io_addn(io_data, buf, strlen(buf));
+}
+
+// Format directly onto the end of io_data
+static bool io_addf(struct io_data *io_data, const char *fmt, ...)
+{
+	va_list ap;
+	size_t room;
+	int len;
+
+	if (io_data->full)
+		return false;
+
+	room = io_data->siz - (io_data->cur - io_data->ptr);
+
+	va_start(ap, fmt);
+	len = vsnprintf(io_data->cur, room, fmt, ap);
+	va_end(ap);
+
+	if (len < 0) {
+		*(io_data->cur) = '\0';
+		return false;
+	}
+
+	if ((size_t)len >= room) {
+		*(io_data->cur) = '\0';
+		if (!io_room(io_data, len))
+			return false;
+
+		va_start(ap, fmt);
+		vsnprintf(io_data->cur, len + 1, fmt, ap);
+		va_end(ap);
+	}
+
 	io_data->cur += len;
 
 	return true;
@@ -768,9 +860,9 @@ static void io_free()
 
 // This is only called when expected to be needed (rarely)
 // i.e. strings outside of the codes control (input from the user)
-static char *escape_string(char *str, bool isjson)
+static int escape_count(char *str, bool isjson)
 {
-	char *buf, *ptr;
+	char *ptr;
 	int count;
 
 	count = 0;
@@ -792,12 +884,13 @@ static char *escape_string(char *str, bool isjson)
 		}
 	}
 
-	if (count == 0)
-		return str;
+	return count;
+}
 
-	buf = malloc(strlen(str) + count + 1);
-	if (unlikely(!buf))
-		quit(1, "Failed to malloc escape buf");
+// buf must have room for the escaped str and its '\0'
+static void escape_copy(char *buf, char *str, bool isjson)
+{
+	char *ptr;
 
 	ptr = buf;
 	while (*str)
@@ -824,10 +917,41 @@ static char *escape_string(char *str, bool isjson)
 		}
 
 	*ptr = '\0';
+}
+
+static char *escape_string(char *str, bool isjson)
+{
+	char *buf;
+	int count;
+
+	count = escape_count(str, isjson);
+	if (count == 0)
+		return str;
+
+	buf = malloc(strlen(str) + count + 1);
+	if (unlikely(!buf))
+		quit(1, "Failed to malloc escape buf");
+
+	escape_copy(buf, str, isjson);
 
 	return buf;
 }
 
+// Escape str straight onto the end of io_data
+static bool io_add_escape(struct io_data *io_data, char *str, bool isjson)
+{
+	size_t len;
+
+	len = strlen(str) + escape_count(str, isjson);
+	if (!io_room(io_data, len))
+		return false;
+
+	escape_copy(io_data->cur, str, isjson);
+	io_data->cur += len;
+
+	return true;
+}
+
 static struct api_data *api_add_extra(struct api_data *root, struct api_data *extra)
 {
 	struct api_data *tmp;
@@ -1050,106 +1174,101 @@ struct api_data *api_add_diff(struct api_data *root, char *name, double *data, b
 	return api_add_data_full(root, name, API_DIFF, (void *)data, copy_data);
 }
 
-static struct api_data *print_data(struct api_data *root, char *buf, bool isjson, bool precom)
+/*
+ * Add the root list to the end of io_data, freeing it as it goes
+ * If it doesn't all fit, none of it is added and io_data is left full
+ */
+static struct api_data *print_data(struct io_data *io_data, struct api_data *root, bool isjson, bool precom)
 {
 	struct api_data *tmp;
 	bool first = true;
-	char *original, *escape;
+	size_t start;
 	char *quote;
 
-	*buf = '\0';
+	start = io_data->cur - io_data->ptr;
 
-	if (precom) {
-		*(buf++) = *COMMA;
-		*buf = '\0';
-	}
+	if (precom)
+		io_addn(io_data, COMMA, 1);
 
 	if (isjson) {
-		strcpy(buf, JSON0);
-		buf = strchr(buf, '\0');
+		io_add(io_data, JSON0);
 		quote = JSON1;
 	} else
 		quote = (char *)BLANK;
 
 	while (root) {
 		if (!first)
-			*(buf++) = *COMMA;
+			io_addn(io_data, COMMA, 1);
 		else
 			first = false;
 
-		sprintf(buf, "%s%s%s%s", quote, root->name, quote, isjson ? ":" : "=");
-
-		buf = strchr(buf, '\0');
+		io_addf(io_data, "%s%s%s%s", quote, root->name, quote, isjson ? ":" : "=");
 
 		switch(root->type) {
 			case API_STRING:
 			case API_CONST:
-				sprintf(buf, "%s%s%s", quote, (char *)(root->data), quote);
+				io_addf(io_data, "%s%s%s", quote, (char *)(root->data), quote);
 				break;
 			case API_ESCAPE:
-				original = (char *)(root->data);
-				escape = escape_string((char *)(root->data), isjson);
-				sprintf(buf, "%s%s%s", quote, escape, quote);
-				if (escape != original)
-					free(escape);
+				io_add(io_data, quote);
+				io_add_escape(io_data, (char *)(root->data), isjson);
+				io_add(io_data, quote);
 				break;
 			case API_INT:
-				sprintf(buf, "%d", *((int *)(root->data)));
+				io_addf(io_data, "%d", *((int *)(root->data)));
 				break;
 			case API_UINT:
-				sprintf(buf, "%u", *((unsigned int *)(root->data)));
+				io_addf(io_data, "%u", *((unsigned int *)(root->data)));
 				break;
 			case API_UINT32:
-				sprintf(buf, "%"PRIu32, *((uint32_t *)(root->data)));
+				io_addf(io_data, "%"PRIu32, *((uint32_t *)(root->data)));
 				break;
 			case API_UINT64:
-				sprintf(buf, "%"PRIu64, *((uint64_t *)(root->data)));
+				io_addf(io_data, "%"PRIu64, *((uint64_t *)(root->data)));
 				break;
 			case API_TIME:
-				sprintf(buf, "%lu", *((unsigned long *)(root->data)));
+				io_addf(io_data, "%lu", *((unsigned long *)(root->data)));
 				break;
 			case API_DOUBLE:
-				sprintf(buf, "%f", *((double *)(root->data)));
+				io_addf(io_data, "%f", *((double *)(root->data)));
 				break;
 			case API_ELAPSED:
-				sprintf(buf, "%.0f", *((double *)(root->data)));
+				io_addf(io_data, "%.0f", *((double *)(root->data)));
 				break;
 			case API_UTILITY:
 			case API_FREQ:
 			case API_MHS:
-				sprintf(buf, "%.2f", *((double *)(root->data)));
+				io_addf(io_data, "%.2f", *((double *)(root->data)));
 				break;
 			case API_VOLTS:
-				sprintf(buf, "%.3f", *((float *)(root->data)));
+				io_addf(io_data, "%.3f", *((float *)(root->data)));
 				break;
 			case API_MHTOTAL:
-				sprintf(buf, "%.4f", *((double *)(root->data)));
+				io_addf(io_data, "%.4f", *((double *)(root->data)));
 				break;
 			case API_HS:
-				sprintf(buf, "%.15f", *((double *)(root->data)));
+				io_addf(io_data, "%.15f", *((double *)(root->data)));
 				break;
 			case API_DIFF:
-				sprintf(buf, "%.8f", *((double *)(root->data)));
+				io_addf(io_data, "%.8f", *((double *)(root->data)));
 				break;
 			case API_BOOL:
-				sprintf(buf, "%s", *((bool *)(root->data)) ? TRUESTR : FALSESTR);
+				io_addf(io_data, "%s", *((bool *)(root->data)) ? TRUESTR : FALSESTR);
 				break;
 			case API_TIMEVAL:
-				sprintf(buf, "%ld.%06ld",
+				io_addf(io_data, "%ld.%06ld",
 					((struct timeval *)(root->data))->tv_sec,
 					((struct timeval *)(root->data))->tv_usec);
 				break;
 			case API_TEMP:
-				sprintf(buf, "%.2f", *((float *)(root->data)));
+				io_addf(io_data, "%.2f", *((float *)(root->data)));
 				break;
 			default:
 				applog(LOG_ERR, "API: unknown2 data type %d ignored", root->type);
-				sprintf(buf, "%s%s%s", quote, UNKNOWN, quote);
+				io_addf(io_data, "%s%s%s", quote, UNKNOWN, quote);
 				break;
 		}
 
-		buf = strchr(buf, '\0');
-
 		if (root->data_was_malloc)
 			free(root->data);
 
@@ -1165,7 +1284,12 @@ static struct api_data *print_data(struct api_data *root, char *buf, bool isjson
 		}
 	}
 
-	strcpy(buf, isjson ? JSON5 : SEPSTR);
+	io_add(io_data, isjson ? JSON5 : SEPSTR);
+
+	if (io_data->full) {
+		io_data->cur = io_data->ptr + start;
+		*(io_data->cur) = '\0';
+	}
 
 	return root;
 }
@@ -1288,12 +1412,11 @@ foundit:
 
 // All replies (except BYE and RESTART) start with a message
 //  thus for JSON, message() inserts JSON_START at the front
-//  and send_result() adds JSON_END at the end
+//  and io_result() adds JSON_END at the end
 static void message(struct io_data *io_data, int messageid, int paramid, char *param2, bool isjson)
 {
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
-	char buf2[TMPBUFSIZ];
 	char severity[2];
 #ifdef HAVE_AN_ASIC
 	int asc;
@@ -1422,8 +1545,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 			root = api_add_escape(root, "Msg", buf, false);
 			root = api_add_escape(root, "Description", opt_api_description, false);
 
-			root = print_data(root, buf2, isjson, false);
-			io_add(io_data, buf2);
+			root = print_data(io_data, root, isjson, false);
 			if (isjson)
 				io_add(io_data, JSON_CLOSE);
 			return;
@@ -1438,8 +1560,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 	root = api_add_escape(root, "Msg", buf, false);
 	root = api_add_escape(root, "Description", opt_api_description, false);
 
-	root = print_data(root, buf2, isjson, false);
-	io_add(io_data, buf2);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson)
 		io_add(io_data, JSON_CLOSE);
 }
@@ -1447,7 +1568,6 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	message(io_data, MSG_VERSION, 0, NULL, isjson);
@@ -1456,8 +1576,7 @@ static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 	root = api_add_string(root, "CGMiner", VERSION, false);
 	root = api_add_const(root, "API", APIVERSION, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -1465,7 +1584,6 @@ static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int gpucount = 0;
 	int asccount = 0;
@@ -1529,8 +1647,7 @@ static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 	root = api_add_const(root, "Hotplug", NONE, false);
 #endif
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -1560,7 +1677,6 @@ static void gpustatus(struct io_data *io_data, int gpu, bool isjson, bool precom
 {
 	struct api_data *root = NULL;
 	char intensity[20];
-	char buf[TMPBUFSIZ];
 	char *enabled;
 	char *status;
 	float gt, gv;
@@ -1620,8 +1736,7 @@ static void gpustatus(struct io_data *io_data, int gpu, bool isjson, bool precom
 		root = api_add_diff(root, "Last Share Difficulty", &(cgpu->last_share_diff), false);
 		root = api_add_time(root, "Last Valid Work", &(cgpu->last_device_valid_work), false);
 
-		root = print_data(root, buf, isjson, precom);
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, precom);
 	}
 }
 #endif
@@ -1630,7 +1745,6 @@ static void gpustatus(struct io_data *io_data, int gpu, bool isjson, bool precom
 static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	char *enabled;
 	char *status;
 	int numasc = numascs();
@@ -1681,8 +1795,7 @@ static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom
 #endif
 		root = api_add_time(root, "Last Valid Work", &(cgpu->last_device_valid_work), false);
 
-		root = print_data(root, buf, isjson, precom);
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, precom);
 	}
 }
 #endif
@@ -1691,7 +1804,6 @@ static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom
 static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	char *enabled;
 	char *status;
 	int numpga = numpgas();
@@ -1753,8 +1865,7 @@ static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom
 #endif
 		root = api_add_time(root, "Last Valid Work", &(cgpu->last_device_valid_work), false);
 
-		root = print_data(root, buf, isjson, precom);
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, precom);
 	}
 }
 #endif
@@ -1763,7 +1874,6 @@ static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom
 static void cpustatus(struct io_data *io_data, int cpu, bool isjson, bool precom)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 
 	if (opt_n_threads > 0 && cpu >= 0 && cpu < num_processors) {
 		struct cgpu_info *cgpu = &cpus[cpu];
@@ -1790,8 +1900,7 @@ static void cpustatus(struct io_data *io_data, int cpu, bool isjson, bool precom
 		root = api_add_diff(root, "Last Share Difficulty", &(cgpu->last_share_diff), false);
 		root = api_add_time(root, "Last Valid Work", &(cgpu->last_device_valid_work), false);
 
-		root = print_data(root, buf, isjson, precom);
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, precom);
 	}
 }
 #endif
@@ -2125,7 +2234,6 @@ static void cpudev(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open = false;
 	char *status, *lp;
 	int i;
@@ -2204,8 +2312,7 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_bool(root, "Has GBT", &(pool->has_gbt), false);
 		root = api_add_uint64(root, "Best Share", &(pool->best_diff), true);
 
-		root = print_data(root, buf, isjson, isjson && (i > 0));
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, isjson && (i > 0));
 	}
 
 	if (isjson && io_open)
@@ -2215,7 +2322,6 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	double utility, mhs, work_utility;
 
@@ -2261,8 +2367,7 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 
 	mutex_unlock(&hash_lock);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2373,12 +2478,37 @@ static void gpurestart(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 
 	message(io_data, MSG_GPUREI, id, NULL, isjson);
 }
+
+static void gputune(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	int id;
+
+	if (nDevs == 0) {
+		message(io_data, MSG_GPUNON, 0, NULL, isjson);
+		return;
+	}
+
+	if (param == NULL || *param == '\0') {
+		message(io_data, MSG_MISID, 0, NULL, isjson);
+		return;
+	}
+
+	id = atoi(param);
+	if (id < 0 || id >= nDevs) {
+		message(io_data, MSG_INVGPU, id, NULL, isjson);
+		return;
+	}
+
+	gpus[id].autotune = true;
+	reinit_device(&gpus[id]);
+
+	message(io_data, MSG_GPUTUNE, id, NULL, isjson);
+}
 #endif
 
 static void gpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int numgpu = 0;
 
@@ -2391,8 +2521,7 @@ static void gpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 
 	root = api_add_int(root, "Count", &numgpu, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2400,7 +2529,6 @@ static void gpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 static void pgacount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int count = 0;
 
@@ -2413,8 +2541,7 @@ static void pgacount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 
 	root = api_add_int(root, "Count", &count, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2422,7 +2549,6 @@ static void pgacount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 static void cpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int count = 0;
 
@@ -2435,8 +2561,7 @@ static void cpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 
 	root = api_add_int(root, "Count", &count, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2918,6 +3043,9 @@ void dorestart(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unu
 
 	bye = true;
 	do_a_restart = true;
+
+	if (api_subscribers)
+		api_event("restart", NULL);
 }
 
 void privileged(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
@@ -2928,7 +3056,6 @@ void privileged(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_un
 void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	char *reason;
 
 	if (cgpu->device_last_not_well == 0)
@@ -2986,8 +3113,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	root = api_add_int(root, "*Dev Comms Error", &(cgpu->dev_comms_error_count), false);
 	root = api_add_int(root, "*Dev Throttle", &(cgpu->dev_throttle_count), false);
 
-	root = print_data(root, buf, isjson, isjson && (device > 0));
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, isjson && (device > 0));
 }
 
 static void notify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, char group)
@@ -3018,7 +3144,6 @@ static void notify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe
 static void devdetails(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open = false;
 	struct cgpu_info *cgpu;
 	int i;
@@ -3044,8 +3169,7 @@ static void devdetails(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_const(root, "Model", cgpu->name ? : BLANK, false);
 		root = api_add_const(root, "Device Path", cgpu->device_path ? : BLANK, false);
 
-		root = print_data(root, buf, isjson, isjson && (i > 0));
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, isjson && (i > 0));
 	}
 
 	if (isjson && io_open)
@@ -3086,7 +3210,6 @@ void dosave(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, b
 static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_stats *stats, struct cgminer_pool_stats *pool_stats, struct api_data *extra, bool isjson)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 
 	root = api_add_int(root, "STATS", &i, false);
 	root = api_add_string(root, "ID", id, false);
@@ -3118,13 +3241,15 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 		root = api_add_uint64(root, "Bytes Recv", &(pool_stats->bytes_received), false);
 		root = api_add_uint64(root, "Net Bytes Sent", &(pool_stats->net_bytes_sent), false);
 		root = api_add_uint64(root, "Net Bytes Recv", &(pool_stats->net_bytes_received), false);
+		root = api_add_double(root, "Submit RTT", &(pool_stats->submit_rtt), false);
+		root = api_add_double(root, "Submit RTT Max", &(pool_stats->submit_rtt_max), false);
+		root = api_add_double(root, "Submit RTT Av", &(pool_stats->submit_rtt_rolling), false);
 	}
 
 	if (extra)
 		root = api_add_extra(root, extra);
 
-	root = print_data(root, buf, isjson, isjson && (i > 0));
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, isjson && (i > 0));
 
 	return ++i;
 }
@@ -3192,7 +3317,6 @@ static void failoveronly(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
 static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	message(io_data, MSG_MINECOIN, 0, NULL, isjson);
@@ -3219,8 +3343,7 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 	root = api_add_bool(root, "LP", &have_longpoll, false);
 	root = api_add_diff(root, "Network Difficulty", &current_diff, true);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3228,7 +3351,6 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	if (param == NULL)
@@ -3298,8 +3420,7 @@ static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 	root = api_add_bool(root, "PerDevice", &want_per_device_stats, false);
 	root = api_add_bool(root, "WorkTime", &opt_worktime, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3346,7 +3467,6 @@ static void usbstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 	struct api_data *root = NULL;
 
 #ifdef USE_USBUTILS
-	char buf[TMPBUFSIZ];
 	bool io_open = false;
 	int count = 0;
 
@@ -3364,16 +3484,14 @@ static void usbstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 	if (isjson)
 		io_open = io_add(io_data, COMSTR JSON_USBSTATS);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 
 	while (42) {
 		root = api_usb_stats(&count);
 		if (!root)
 			break;
 
-		root = print_data(root, buf, isjson, isjson);
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, isjson);
 	}
 
 	if (isjson && io_open)
@@ -3517,6 +3635,21 @@ static void dohotplug(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __ma
 #endif
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+static bool api_conn_subscribe(SOCKETTYPE c, char *param);
+#endif
+
+static void subscribe(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	if (api_conn_subscribe(c, param)) {
+		message(io_data, MSG_SUBSCRIBE, 0, (param && *param) ? param : "all", isjson);
+		return;
+	}
+#endif
+	message(io_data, MSG_NOSUBSCRIBE, 0, NULL, isjson);
+}
+
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group);
 
 struct CMDS {
@@ -3533,6 +3666,7 @@ struct CMDS {
 	{ "gpuenable",		gpuenable,	true },
 	{ "gpudisable",		gpudisable,	true },
 	{ "gpurestart",		gpurestart,	true },
+	{ "gputune",		gputune,	true },
 	{ "gpu",		gpudev,		false },
 #endif
 #ifdef HAVE_AN_FPGA
@@ -3578,13 +3712,13 @@ struct CMDS {
 #endif
 	{ "zero",		dozero,		true },
 	{ "hotplug",		dohotplug,	true },
+	{ "subscribe",		subscribe,	false },
 	{ NULL,			NULL,		false }
 };
 
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	char cmdbuf[100];
 	bool found, access;
@@ -3615,31 +3749,158 @@ static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
 	root = api_add_const(root, "Exists", found ? YES : NO, false);
 	root = api_add_const(root, "Access", access ? YES : NO, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
 
-static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+/*
+ * The reply to a report command is kept as a snapshot and the same reply is
+ * given again for the next --api-snapshot ms, so monitors polling often, or
+ * many monitors polling at once, don't rebuild it from the live device and
+ * pool data each time
+ * Snapshots are built on demand, so a miner that isn't polled does no work,
+ * and are all discarded by any privileged command since it may change them
+ */
+#define SNAPSHOTCMDS "|version|config|devs|pools|summary|gpu|pga|cpu|gpucount|pgacount|cpucount|notify|devdetails|stats|coin|usbstats|"
+#define SNAPSHOTMAX 64
+
+struct api_snapshot {
+	char key[128];
+	char *data;
+	size_t len;
+	bool full;
+	bool close;
+	struct timeval built;
+	UT_hash_handle hh;
+};
+
+static struct api_snapshot *snapshots = NULL;
+
+static void snapshot_free()
 {
-	char buf[SOCKBUFSIZ + sizeof(JSON_CLOSE) + sizeof(JSON_END)];
-	int count, res, tosend, len, n;
+	struct api_snapshot *snap, *tmp;
+
+	HASH_ITER(hh, snapshots, snap, tmp) {
+		HASH_DEL(snapshots, snap);
+		free(snap->data);
+		free(snap);
+	}
+}
+
+/*
+ * Once the table is full an expired snapshot (the oldest) is reused for a
+ * new key, so a stream of distinct params can't stop new replies caching
+ */
+static struct api_snapshot *snapshot_expired(struct timeval *now)
+{
+	struct api_snapshot *snap, *tmp, *oldest = NULL;
+
+	HASH_ITER(hh, snapshots, snap, tmp) {
+		if (tdiff(now, &snap->built) * 1000 < opt_api_snapshot)
+			continue;
+		if (!oldest || tdiff(&oldest->built, &snap->built) > 0)
+			oldest = snap;
+	}
+
+	return oldest;
+}
+
+static void snapshot_command(struct io_data *io_data, int i, SOCKETTYPE c, char *param, bool isjson, char group)
+{
+	struct api_snapshot *snap;
+	struct timeval now;
+	char key[128];
+	char cmdbuf[100];
+	int len;
+
+	sprintf(cmdbuf, "|%s|", cmds[i].name);
+	if (cmds[i].iswritemode || !opt_api_snapshot || !strstr(SNAPSHOTCMDS, cmdbuf)) {
+		(cmds[i].func)(io_data, c, param, isjson, group);
+		if (cmds[i].iswritemode)
+			snapshot_free();
+		return;
+	}
+
+	len = snprintf(key, sizeof(key), "%c%c%s|%s", group, isjson ? 'J' : 'T', cmds[i].name, param ? param : BLANK);
+	if (len >= (int)sizeof(key)) {
+		(cmds[i].func)(io_data, c, param, isjson, group);
+		return;
+	}
+
+	cgtime(&now);
+	HASH_FIND_STR(snapshots, key, snap);
+	if (snap && tdiff(&now, &snap->built) * 1000 < opt_api_snapshot) {
+		memcpy(io_data->ptr, snap->data, snap->len + 1);
+		io_data->cur = io_data->ptr + snap->len;
+		io_data->full = snap->full;
+		io_data->close = snap->close;
+		return;
+	}
+
+	(cmds[i].func)(io_data, c, param, isjson, group);
+
+	if (!snap) {
+		if (HASH_COUNT(snapshots) >= SNAPSHOTMAX) {
+			snap = snapshot_expired(&now);
+			if (!snap)
+				return;
+			HASH_DEL(snapshots, snap);
+		} else {
+			snap = calloc(sizeof(*snap), 1);
+			if (unlikely(!snap))
+				quit(1, "Failed to calloc API snapshot");
+		}
+		strcpy(snap->key, key);
+		HASH_ADD_STR(snapshots, key, snap);
+	}
+
+	snap->len = io_data->cur - io_data->ptr;
+	snap->data = realloc(snap->data, snap->len + 1);
+	if (unlikely(!snap->data))
+		quit(1, "Failed to realloc API snapshot");
+	memcpy(snap->data, io_data->ptr, snap->len + 1);
+	snap->full = io_data->full;
+	snap->close = io_data->close;
+	copy_time(&snap->built, &now);
+}
 
-	strcpy(buf, io_data->ptr);
+/*
+ * Finish the reply in place at the end of the socket io_data, which always
+ * has room for it, returning the length to send which includes the
+ * terminating '\0'
+ */
+static int io_result(struct io_data *io_data, bool isjson)
+{
+	char *end = io_data->cur;
 
-	if (io_data->close)
-		strcat(buf, JSON_CLOSE);
+	if (io_data->close) {
+		strcpy(end, JSON_CLOSE);
+		end += sizeof(JSON_CLOSE) - 1;
+	}
 
 	if (isjson) {
 		if (io_data->full)
-			strcat(buf, JSON_END_TRUNCATED);
+			strcpy(end, JSON_END_TRUNCATED);
 		else
-			strcat(buf, JSON_END);
+			strcpy(end, JSON_END);
+		end += sizeof(JSON_END) - 1;
 	}
 
-	len = strlen(buf);
-	tosend = len+1;
+	*end = '\0';
+
+	return end - io_data->ptr + 1;
+}
+
+#ifndef HAVE_SYS_EPOLL_H
+static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+{
+	char *buf;
+	int count, res, tosend, len, n;
+
+	tosend = io_result(io_data, isjson);
+	buf = io_data->ptr;
+	len = tosend - 1;
 
 	applog(LOG_DEBUG, "API: send reply: (%d) '%.10s%s'", tosend, buf, len > 10 ? "..." : BLANK);
 
@@ -3682,6 +3943,11 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 		}
 	}
 }
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+static void api_conns_free();
+#endif
 
 static void tidyup(__maybe_unused void *arg)
 {
@@ -3703,6 +3969,11 @@ static void tidyup(__maybe_unused void *arg)
 	}
 
 	io_free();
+	snapshot_free();
+
+#ifdef HAVE_SYS_EPOLL_H
+	api_conns_free();
+#endif
 
 	mutex_unlock(&quit_restart_lock);
 }
@@ -3861,17 +4132,23 @@ static void setup_groups()
 /*
  * N.B. IP4 addresses are by Definition 32bit big endian on all platforms
  */
-static void setup_ipaccess()
+/*
+ * Parse an --api-allow style list of [G:]IP[/Prefix] into a new *access
+ * array, returning how many valid entries it has
+ * Also used for --stratum-server-allow where the group is ignored
+ */
+int setup_ip4access(const char *allow, struct IP4ACCESS **access)
 {
+	struct IP4ACCESS *ipaccess;
 	char *buf, *ptr, *comma, *slash, *dot;
-	int ipcount, mask, octet, i;
+	int ipcount, mask, octet, i, ips;
 	char group;
 
-	buf = malloc(strlen(opt_api_allow) + 1);
+	buf = malloc(strlen(allow) + 1);
 	if (unlikely(!buf))
 		quit(1, "Failed to malloc ipaccess buf");
 
-	strcpy(buf, opt_api_allow);
+	strcpy(buf, allow);
 
 	ipcount = 1;
 	ptr = buf;
@@ -3953,6 +4230,33 @@ popipo:
 	}
 
 	free(buf);
+
+	*access = ipaccess;
+	return ips;
+}
+
+/*
+ * Is the address in the list, if so set group (if not NULL) to its group
+ */
+bool ip4access_allowed(struct IP4ACCESS *access, int count, struct sockaddr_in *cli, char *group)
+{
+	int client_ip = htonl(cli->sin_addr.s_addr);
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if ((client_ip & access[i].mask) == access[i].ip) {
+			if (group)
+				*group = access[i].group;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void setup_ipaccess()
+{
+	ips = setup_ip4access(opt_api_allow, &ipaccess);
 }
 
 static void *quit_thread(__maybe_unused void *userdata)
@@ -3983,35 +4287,1235 @@ static void *restart_thread(__maybe_unused void *userdata)
 	return NULL;
 }
 
-void api(int api_thr_id)
+static const char *localaddr = "127.0.0.1";
+
+/*
+ * Check the connecting address is allowed to use the API and find its group
+ */
+static bool check_connect(struct sockaddr_in *cli, char **connectaddr, char *group)
+{
+	bool addrok = false;
+
+	*connectaddr = inet_ntoa(cli->sin_addr);
+
+	*group = NOPRIVGROUP;
+	if (opt_api_allow)
+		addrok = ip4access_allowed(ipaccess, ips, cli, group);
+	else {
+		if (opt_api_network)
+			addrok = true;
+		else
+			addrok = (strcmp(*connectaddr, localaddr) == 0);
+	}
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "API: connection from %s - %s", *connectaddr, addrok ? "Accepted" : "Ignored");
+
+	return addrok;
+}
+
+/*
+ * Run the text or JSON request in buf leaving the reply in io_data
+ * Returns if the reply is JSON and sets keepalive if a JSON request asked
+ * to keep the connection open
+ */
+static bool do_command(struct io_data *io_data, SOCKETTYPE c, char *buf, int n, char group, char *connectaddr, bool *keepalive)
 {
-	struct io_data *io_data;
-	struct thr_info bye_thr;
-	char buf[TMPBUFSIZ];
 	char param_buf[TMPBUFSIZ];
-	const char *localaddr = "127.0.0.1";
-	SOCKETTYPE c;
-	int n, bound;
-	char *connectaddr;
-	char *binderror;
-	time_t bindstart;
-	short int port = opt_api_port;
-	struct sockaddr_in serv;
-	struct sockaddr_in cli;
-	socklen_t clisiz;
+	json_error_t json_err;
+	json_t *json_config = NULL;
+	json_t *json_val;
 	char cmdbuf[100];
 	char *cmd;
 	char *param;
-	bool addrok;
-	char group;
-	json_error_t json_err;
-	json_t *json_config;
-	json_t *json_val;
 	bool isjson;
-	bool did;
 	int i;
 
-	SOCKETTYPE *apisock;
+	// the time of the request in now
+	when = time(NULL);
+	io_reinit(io_data);
+
+	if (*buf != ISJSON) {
+		isjson = false;
+
+		param = strchr(buf, SEPARATOR);
+		if (param != NULL)
+			*(param++) = '\0';
+
+		cmd = buf;
+	}
+	else {
+		isjson = true;
+
+		param = NULL;
+
+#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
+		json_config = json_loadb(buf, n, 0, &json_err);
+#elif JANSSON_MAJOR_VERSION > 1
+		json_config = json_loads(buf, 0, &json_err);
+#else
+		json_config = json_loads(buf, &json_err);
+#endif
+
+		if (!json_is_object(json_config)) {
+			message(io_data, MSG_INVJSON, 0, NULL, isjson);
+			goto out;
+		}
+
+		json_val = json_object_get(json_config, JSON_COMMAND);
+		if (json_val == NULL) {
+			message(io_data, MSG_MISCMD, 0, NULL, isjson);
+			goto out;
+		}
+
+		if (!json_is_string(json_val)) {
+			message(io_data, MSG_INVCMD, 0, NULL, isjson);
+			goto out;
+		}
+
+		cmd = (char *)json_string_value(json_val);
+		json_val = json_object_get(json_config, JSON_PARAMETER);
+		if (json_is_string(json_val))
+			param = (char *)json_string_value(json_val);
+		else if (json_is_integer(json_val)) {
+			sprintf(param_buf, "%d", (int)json_integer_value(json_val));
+			param = param_buf;
+		} else if (json_is_real(json_val)) {
+			sprintf(param_buf, "%f", (double)json_real_value(json_val));
+			param = param_buf;
+		}
+
+		if (keepalive && json_is_true(json_object_get(json_config, JSON_KEEPALIVE)))
+			*keepalive = true;
+	}
+
+	for (i = 0; cmds[i].name != NULL; i++) {
+		if (strcmp(cmd, cmds[i].name) == 0) {
+			sprintf(cmdbuf, "|%s|", cmd);
+			if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
+				snapshot_command(io_data, i, c, param, isjson, group);
+			else {
+				message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+				applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
+			}
+			goto out;
+		}
+	}
+
+	message(io_data, MSG_INVCMD, 0, NULL, isjson);
+out:
+	if (json_config)
+		json_decref(json_config);
+
+	return isjson;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * Every API connection is non-blocking and served from one epoll loop so a
+ * slow or stuck client can't hold up anyone else
+ * Requests end with a '\n' (or '\0') and are answered in order, each reply
+ * ending with a '\0' as always
+ * A connection is closed once its requests are answered unless a JSON
+ * request included "keepalive":true, then it stays open for more requests
+ * until it's idle for API_IDLE seconds
+ * A request with no ending is answered once nothing more has arrived
+ * (as older clients expect) unless the connection is keepalive
+ */
+struct api_conn {
+	struct list_head list;
+	SOCKETTYPE fd;
+	char connectaddr[INET_ADDRSTRLEN];
+	char group;
+	bool http;
+	bool keepalive;
+	bool done;
+	bool subscribed;
+	char filter[128];
+	uint32_t events;
+	time_t last;
+	int inlen;
+	char in[TMPBUFSIZ];
+	char *out;
+	int outlen;
+	int outsent;
+};
+
+static LIST_HEAD(api_conns);
+static int api_conncount;
+static int api_epfd = -1;
+static SOCKETTYPE api_metricsock = INVSOCK;
+
+/*
+ * Events from the mining threads wait here, each already a line of JSON,
+ * and the pipe wakes the API thread to send them to the subscribers
+ */
+struct api_event {
+	struct list_head list;
+	char type[16];
+	char *line;
+	int len;
+};
+
+static LIST_HEAD(api_events);
+static int api_eventcount;
+static pthread_mutex_t api_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static int api_eventpipe[2] = { -1, -1 };
+
+static void api_conn_close(struct api_conn *conn)
+{
+	epoll_ctl(api_epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	CLOSESOCKET(conn->fd);
+	list_del(&conn->list);
+	api_conncount--;
+	if (conn->subscribed)
+		api_subscribers--;
+	free(conn->out);
+	free(conn);
+}
+
+// Send what we can of the pending replies, false if the connection failed
+static bool api_conn_flush(struct api_conn *conn)
+{
+	int n;
+
+	while (conn->outsent < conn->outlen) {
+		n = send(conn->fd, conn->out + conn->outsent, conn->outlen - conn->outsent, MSG_NOSIGNAL);
+		if (SOCKETFAIL(n)) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+
+			applog(LOG_DEBUG, "API: send to %s failed: %s", conn->connectaddr, SOCKERRMSG);
+			return false;
+		}
+		conn->outsent += n;
+		conn->last = time(NULL);
+	}
+
+	conn->outlen = conn->outsent = 0;
+	return true;
+}
+
+/*
+ * Before quit or restart closes the connections, give any replies still
+ * waiting to go (e.g. the reply to the quit or restart itself) the same
+ * 5 x 50ms send_result() would have allowed
+ */
+static void api_conns_drain()
+{
+	struct api_conn *conn, *tmp;
+	struct timeval timeout;
+	int count, maxfd;
+	fd_set wd;
+
+	count = 0;
+	while (count++ < 5) {
+		FD_ZERO(&wd);
+		maxfd = -1;
+		list_for_each_entry_safe(conn, tmp, &api_conns, list) {
+			if (conn->outlen == 0 || conn->fd >= FD_SETSIZE)
+				continue;
+			if (!api_conn_flush(conn)) {
+				api_conn_close(conn);
+				continue;
+			}
+			if (conn->outlen) {
+				FD_SET(conn->fd, &wd);
+				if (conn->fd > maxfd)
+					maxfd = conn->fd;
+			}
+		}
+
+		if (maxfd < 0)
+			break;
+
+		// allow 50ms per attempt
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 50000;
+		if (select(maxfd + 1, NULL, &wd, NULL, &timeout) < 0)
+			break;
+	}
+}
+
+static void api_conns_free()
+{
+	struct api_conn *conn, *tmp;
+	struct api_event *ev, *evtmp;
+
+	api_conns_drain();
+
+	list_for_each_entry_safe(conn, tmp, &api_conns, list)
+		api_conn_close(conn);
+
+	mutex_lock(&api_event_lock);
+	list_for_each_entry_safe(ev, evtmp, &api_events, list) {
+		list_del(&ev->list);
+		free(ev->line);
+		free(ev);
+	}
+	api_eventcount = 0;
+	if (api_eventpipe[0] != -1) {
+		close(api_eventpipe[0]);
+		close(api_eventpipe[1]);
+		api_eventpipe[0] = api_eventpipe[1] = -1;
+	}
+	mutex_unlock(&api_event_lock);
+
+	if (api_metricsock != INVSOCK) {
+		CLOSESOCKET(api_metricsock);
+		api_metricsock = INVSOCK;
+	}
+
+	if (api_epfd != -1) {
+		close(api_epfd);
+		api_epfd = -1;
+	}
+}
+
+static void api_conn_add(struct api_conn *conn, char *buf, int len)
+{
+	conn->out = realloc(conn->out, conn->outlen + len);
+	if (unlikely(!conn->out))
+		quit(1, "Failed to realloc API reply buffer");
+	memcpy(conn->out + conn->outlen, buf, len);
+	conn->outlen += len;
+}
+
+static bool api_conn_reply(struct api_conn *conn, struct io_data *io_data, bool isjson)
+{
+	int len, n;
+
+	len = io_result(io_data, isjson);
+
+	applog(LOG_DEBUG, "API: send reply: (%d) '%.10s%s'", len, io_data->ptr, len > 11 ? "..." : BLANK);
+
+	if (conn->outlen) {
+		api_conn_add(conn, io_data->ptr, len);
+		return api_conn_flush(conn);
+	}
+
+	// Usually it all goes straight from io_data, only keep what doesn't
+	n = send(conn->fd, io_data->ptr, len, MSG_NOSIGNAL);
+	if (SOCKETFAIL(n)) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			applog(LOG_DEBUG, "API: send to %s failed: %s", conn->connectaddr, SOCKERRMSG);
+			return false;
+		}
+		n = 0;
+	} else
+		conn->last = time(NULL);
+
+	if (n < len)
+		api_conn_add(conn, io_data->ptr + n, len - n);
+
+	return true;
+}
+
+/*
+ * Make the connection that sent "subscribe" a subscriber, to the comma
+ * separated event types in param or to them all
+ */
+static bool api_conn_subscribe(SOCKETTYPE c, char *param)
+{
+	struct api_conn *conn;
+	char *ptr;
+
+	list_for_each_entry(conn, &api_conns, list) {
+		if (conn->fd != c)
+			continue;
+
+		conn->filter[0] = '\0';
+		if (param && *param) {
+			snprintf(conn->filter, sizeof(conn->filter), "|%s|", param);
+			for (ptr = conn->filter; *ptr; ptr++)
+				if (*ptr == ',')
+					*ptr = '|';
+		}
+
+		if (!conn->subscribed) {
+			conn->subscribed = true;
+			api_subscribers++;
+		}
+		conn->keepalive = true;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Prometheus metrics are served as HTTP on --api-metrics-port from this
+ * same loop, read straight from the device, pool and summary counters
+ * rather than formatted by the API commands
+ * A scraper that asks for OpenMetrics gets it, anything else gets the
+ * Prometheus text format
+ */
+#define METRICS_PATH "/metrics"
+#define METRICS_TEXT "text/plain; version=0.0.4; charset=utf-8"
+#define METRICS_OPENMETRICS "application/openmetrics-text; version=1.0.0; charset=utf-8"
+#define METRICS_SIZE 16384
+
+struct metrics {
+	char *buf;
+	size_t len;
+	size_t siz;
+	bool om;
+};
+
+struct metric_desc {
+	const char *name;
+	bool counter;
+	const char *help;
+};
+
+enum summary_metric {
+	SUM_ELAPSED,
+	SUM_HASHES,
+	SUM_ACCEPTED,
+	SUM_REJECTED,
+	SUM_STALE,
+	SUM_HW_ERRORS,
+	SUM_DIFF1,
+	SUM_DIFF_ACCEPTED,
+	SUM_DIFF_REJECTED,
+	SUM_DIFF_STALE,
+	SUM_GETWORKS,
+	SUM_DISCARDED,
+	SUM_FOUND_BLOCKS,
+	SUM_NEW_BLOCKS,
+	SUM_NETWORK_DIFF,
+	SUM_STAGED,
+	SUM_METRICS
+};
+
+static const struct metric_desc summary_metrics[SUM_METRICS] = {
+	{ "cgminer_elapsed_seconds", false, "Seconds since mining started" },
+	{ "cgminer_hashes", true, "Hashes done by all devices" },
+	{ "cgminer_accepted", true, "Shares accepted" },
+	{ "cgminer_rejected", true, "Shares rejected" },
+	{ "cgminer_stale", true, "Shares found stale" },
+	{ "cgminer_hardware_errors", true, "Hardware errors" },
+	{ "cgminer_diff1_work", true, "Difficulty 1 work done" },
+	{ "cgminer_difficulty_accepted", true, "Difficulty of shares accepted" },
+	{ "cgminer_difficulty_rejected", true, "Difficulty of shares rejected" },
+	{ "cgminer_difficulty_stale", true, "Difficulty of shares found stale" },
+	{ "cgminer_getworks", true, "Work items fetched from pools" },
+	{ "cgminer_discarded_work", true, "Work items discarded" },
+	{ "cgminer_found_blocks", true, "Blocks found" },
+	{ "cgminer_network_blocks", true, "New network blocks seen" },
+	{ "cgminer_network_difficulty", false, "Current network difficulty" },
+	{ "cgminer_staged_work", false, "Work items staged ready for the devices" },
+};
+
+enum dev_metric {
+	DEV_HASH_RATE,
+	DEV_HASHES,
+	DEV_ACCEPTED,
+	DEV_REJECTED,
+	DEV_HW_ERRORS,
+	DEV_DIFF1,
+	DEV_DIFF_ACCEPTED,
+	DEV_DIFF_REJECTED,
+	DEV_TEMP,
+	DEV_QUEUED,
+	DEV_METRICS
+};
+
+static const struct metric_desc dev_metrics[DEV_METRICS] = {
+	{ "cgminer_device_hash_rate", false, "Rolling hash rate in hashes per second" },
+	{ "cgminer_device_hashes", true, "Hashes done" },
+	{ "cgminer_device_accepted", true, "Shares accepted" },
+	{ "cgminer_device_rejected", true, "Shares rejected" },
+	{ "cgminer_device_hardware_errors", true, "Hardware errors" },
+	{ "cgminer_device_diff1_work", true, "Difficulty 1 work done" },
+	{ "cgminer_device_difficulty_accepted", true, "Difficulty of shares accepted" },
+	{ "cgminer_device_difficulty_rejected", true, "Difficulty of shares rejected" },
+	{ "cgminer_device_temperature_celsius", false, "Temperature, 0 if the device has no sensor" },
+	{ "cgminer_device_queued_work", false, "Work items queued on the device" },
+};
+
+enum pool_metric {
+	POOL_UP,
+	POOL_ACCEPTED,
+	POOL_REJECTED,
+	POOL_STALE,
+	POOL_DIFF_ACCEPTED,
+	POOL_DIFF_REJECTED,
+	POOL_DIFF_STALE,
+	POOL_GETWORKS,
+	POOL_DISCARDED,
+	POOL_GET_FAILURES,
+	POOL_REMOTE_FAILURES,
+	POOL_NET_GETWORKS,
+	POOL_GETWORK_WAIT,
+	POOL_SENDS,
+	POOL_RECEIVES,
+	POOL_SENT_BYTES,
+	POOL_RECEIVED_BYTES,
+	POOL_NET_SENT_BYTES,
+	POOL_NET_RECEIVED_BYTES,
+	POOL_LAST_DIFF,
+	POOL_SUBMIT_RTT,
+	POOL_SUBMIT_RTT_AVG,
+	POOL_SUBMIT_RTT_MAX,
+	POOL_METRICS
+};
+
+static const struct metric_desc pool_metrics[POOL_METRICS] = {
+	{ "cgminer_pool_up", false, "1 if the pool is enabled and alive" },
+	{ "cgminer_pool_accepted", true, "Shares accepted" },
+	{ "cgminer_pool_rejected", true, "Shares rejected" },
+	{ "cgminer_pool_stale", true, "Shares found stale" },
+	{ "cgminer_pool_difficulty_accepted", true, "Difficulty of shares accepted" },
+	{ "cgminer_pool_difficulty_rejected", true, "Difficulty of shares rejected" },
+	{ "cgminer_pool_difficulty_stale", true, "Difficulty of shares found stale" },
+	{ "cgminer_pool_getworks", true, "Work items fetched" },
+	{ "cgminer_pool_discarded_work", true, "Work items discarded" },
+	{ "cgminer_pool_get_failures", true, "Failures getting work" },
+	{ "cgminer_pool_remote_failures", true, "Failures reported by the pool" },
+	{ "cgminer_pool_network_getworks", true, "Getwork requests sent over the network" },
+	{ "cgminer_pool_getwork_wait_seconds", false, "Rolling average getwork wait" },
+	{ "cgminer_pool_sends", true, "Messages sent" },
+	{ "cgminer_pool_receives", true, "Messages received" },
+	{ "cgminer_pool_sent_bytes", true, "Message bytes sent" },
+	{ "cgminer_pool_received_bytes", true, "Message bytes received" },
+	{ "cgminer_pool_network_sent_bytes", true, "Network bytes sent including protocol overhead" },
+	{ "cgminer_pool_network_received_bytes", true, "Network bytes received including protocol overhead" },
+	{ "cgminer_pool_last_difficulty", false, "Difficulty of the last work" },
+	{ "cgminer_pool_submit_rtt_seconds", false, "Round trip time of the last share submitted" },
+	{ "cgminer_pool_submit_rtt_average_seconds", false, "Rolling average share submit round trip time" },
+	{ "cgminer_pool_submit_rtt_max_seconds", false, "Longest share submit round trip time" },
+};
+
+static void metrics_add(struct metrics *m, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	while (42) {
+		va_start(ap, fmt);
+		n = vsnprintf(m->buf + m->len, m->siz - m->len, fmt, ap);
+		va_end(ap);
+
+		if (n < 0)
+			return;
+
+		if (m->len + n < m->siz) {
+			m->len += n;
+			return;
+		}
+
+		m->siz = (m->len + n) * 2;
+		m->buf = realloc(m->buf, m->siz);
+		if (unlikely(!m->buf))
+			quit(1, "Failed to realloc API metrics buffer");
+	}
+}
+
+// Counter samples are named with _total and so are their families, except in OpenMetrics
+static void metrics_family(struct metrics *m, const struct metric_desc *desc)
+{
+	const char *suffix = (desc->counter && !m->om) ? "_total" : BLANK;
+
+	metrics_add(m, "# HELP %s%s %s\n", desc->name, suffix, desc->help);
+	metrics_add(m, "# TYPE %s%s %s\n", desc->name, suffix, desc->counter ? "counter" : "gauge");
+}
+
+static void metrics_sample(struct metrics *m, const struct metric_desc *desc, char *labels, double value)
+{
+	const char *suffix = desc->counter ? "_total" : BLANK;
+
+	if (labels)
+		metrics_add(m, "%s%s{%s} %.15g\n", desc->name, suffix, labels, value);
+	else
+		metrics_add(m, "%s%s %.15g\n", desc->name, suffix, value);
+}
+
+// Escape a label value, truncating it if it doesn't fit
+static void metrics_escape(char *buf, size_t siz, const char *str)
+{
+	size_t len = 0;
+
+	while (str && *str && len + 2 < siz) {
+		switch (*str) {
+			case '\\':
+			case '"':
+				buf[len++] = '\\';
+				buf[len++] = *str;
+				break;
+			case '\n':
+				buf[len++] = '\\';
+				buf[len++] = 'n';
+				break;
+			default:
+				buf[len++] = *str;
+				break;
+		}
+		str++;
+	}
+	buf[len] = '\0';
+}
+
+static void metrics_summary(struct metrics *m)
+{
+	double value[SUM_METRICS];
+	int i;
+
+	value[SUM_STAGED] = total_staged();
+
+	// stop hashmeter() changing some while copying
+	mutex_lock(&hash_lock);
+	value[SUM_ELAPSED] = total_secs;
+	value[SUM_HASHES] = total_mhashes_done * 1000000.0;
+	value[SUM_ACCEPTED] = total_accepted;
+	value[SUM_REJECTED] = total_rejected;
+	value[SUM_STALE] = total_stale;
+	value[SUM_HW_ERRORS] = hw_errors;
+	value[SUM_DIFF1] = total_diff1;
+	value[SUM_DIFF_ACCEPTED] = total_diff_accepted;
+	value[SUM_DIFF_REJECTED] = total_diff_rejected;
+	value[SUM_DIFF_STALE] = total_diff_stale;
+	value[SUM_GETWORKS] = total_getworks;
+	value[SUM_DISCARDED] = total_discarded;
+	value[SUM_FOUND_BLOCKS] = found_blocks;
+	value[SUM_NEW_BLOCKS] = new_blocks;
+	value[SUM_NETWORK_DIFF] = current_diff;
+	mutex_unlock(&hash_lock);
+
+	for (i = 0; i < SUM_METRICS; i++) {
+		metrics_family(m, &summary_metrics[i]);
+		metrics_sample(m, &summary_metrics[i], NULL, value[i]);
+	}
+}
+
+static double dev_value(struct cgpu_info *cgpu, enum dev_metric metric)
+{
+	switch (metric) {
+		case DEV_HASH_RATE:
+			return cgpu->rolling * 1000000.0;
+		case DEV_HASHES:
+			return cgpu->total_mhashes * 1000000.0;
+		case DEV_ACCEPTED:
+			return cgpu->accepted;
+		case DEV_REJECTED:
+			return cgpu->rejected;
+		case DEV_HW_ERRORS:
+			return cgpu->hw_errors;
+		case DEV_DIFF1:
+			return cgpu->diff1;
+		case DEV_DIFF_ACCEPTED:
+			return cgpu->diff_accepted;
+		case DEV_DIFF_REJECTED:
+			return cgpu->diff_rejected;
+		case DEV_TEMP:
+			return cgpu->temp;
+		case DEV_QUEUED:
+			return cgpu->queued_count;
+		default:
+			return 0;
+	}
+}
+
+static void metrics_devices(struct metrics *m)
+{
+	struct cgpu_info *cgpu;
+	char labels[64];
+	int count, i, j;
+
+	rd_lock(&devices_lock);
+	count = total_devices;
+	rd_unlock(&devices_lock);
+
+	for (j = 0; j < DEV_METRICS; j++) {
+		metrics_family(m, &dev_metrics[j]);
+		for (i = 0; i < count; i++) {
+			cgpu = get_devices(i);
+			snprintf(labels, sizeof(labels), "name=\"%s\",id=\"%d\"", cgpu->drv->name, cgpu->device_id);
+			metrics_sample(m, &dev_metrics[j], labels, dev_value(cgpu, j));
+		}
+	}
+}
+
+static double pool_value(struct pool *pool, enum pool_metric metric)
+{
+	struct cgminer_pool_stats *pool_stats = &(pool->cgminer_pool_stats);
+
+	switch (metric) {
+		case POOL_UP:
+			return (pool->enabled == POOL_ENABLED && !pool->idle) ? 1 : 0;
+		case POOL_ACCEPTED:
+			return pool->accepted;
+		case POOL_REJECTED:
+			return pool->rejected;
+		case POOL_STALE:
+			return pool->stale_shares;
+		case POOL_DIFF_ACCEPTED:
+			return pool->diff_accepted;
+		case POOL_DIFF_REJECTED:
+			return pool->diff_rejected;
+		case POOL_DIFF_STALE:
+			return pool->diff_stale;
+		case POOL_GETWORKS:
+			return pool->getwork_requested;
+		case POOL_DISCARDED:
+			return pool->discarded_work;
+		case POOL_GET_FAILURES:
+			return pool->getfail_occasions;
+		case POOL_REMOTE_FAILURES:
+			return pool->remotefail_occasions;
+		case POOL_NET_GETWORKS:
+			return pool_stats->getwork_calls;
+		case POOL_GETWORK_WAIT:
+			return pool_stats->getwork_wait_rolling;
+		case POOL_SENDS:
+			return pool_stats->times_sent;
+		case POOL_RECEIVES:
+			return pool_stats->times_received;
+		case POOL_SENT_BYTES:
+			return pool_stats->bytes_sent;
+		case POOL_RECEIVED_BYTES:
+			return pool_stats->bytes_received;
+		case POOL_NET_SENT_BYTES:
+			return pool_stats->net_bytes_sent;
+		case POOL_NET_RECEIVED_BYTES:
+			return pool_stats->net_bytes_received;
+		case POOL_LAST_DIFF:
+			return pool_stats->last_diff;
+		case POOL_SUBMIT_RTT:
+			return pool_stats->submit_rtt;
+		case POOL_SUBMIT_RTT_AVG:
+			return pool_stats->submit_rtt_rolling;
+		case POOL_SUBMIT_RTT_MAX:
+			return pool_stats->submit_rtt_max;
+		default:
+			return 0;
+	}
+}
+
+static void metrics_pools(struct metrics *m)
+{
+	struct pool *pool;
+	char labels[TMPBUFSIZ];
+	char url[TMPBUFSIZ - 32];
+	int i, j;
+
+	for (j = 0; j < POOL_METRICS; j++) {
+		metrics_family(m, &pool_metrics[j]);
+		for (i = 0; i < total_pools; i++) {
+			pool = pools[i];
+			if (pool->removed)
+				continue;
+
+			metrics_escape(url, sizeof(url), pool->rpc_url);
+			snprintf(labels, sizeof(labels), "pool=\"%d\",url=\"%s\"", i, url);
+			metrics_sample(m, &pool_metrics[j], labels, pool_value(pool, j));
+		}
+	}
+}
+
+/*
+ * Answer the HTTP request once its headers have all arrived, then close
+ */
+static bool api_conn_http(struct api_conn *conn)
+{
+	const char *status, *type;
+	struct metrics m;
+	char head[256];
+	size_t pathlen = 0;
+	bool isget;
+	int len;
+
+	if (conn->outlen || conn->inlen == 0)
+		return true;
+
+	conn->in[conn->inlen] = '\0';
+	if (!conn->done && conn->inlen < TMPBUFSIZ - 1 &&
+	    !strstr(conn->in, "\r\n\r\n") && !strstr(conn->in, "\n\n"))
+		return true;
+
+	m.siz = METRICS_SIZE;
+	m.len = 0;
+	m.buf = malloc(m.siz);
+	if (unlikely(!m.buf))
+		quit(1, "Failed to malloc API metrics buffer");
+	m.om = (strstr(conn->in, "application/openmetrics-text") != NULL);
+
+	isget = (strncmp(conn->in, "GET ", 4) == 0);
+	if (isget)
+		pathlen = strcspn(conn->in + 4, " ?\r\n");
+
+	if (!isget) {
+		status = "405 Method Not Allowed";
+		type = METRICS_TEXT;
+		metrics_add(&m, "%s\n", status);
+	} else if (pathlen != strlen(METRICS_PATH) || strncmp(conn->in + 4, METRICS_PATH, pathlen) != 0) {
+		status = "404 Not Found";
+		type = METRICS_TEXT;
+		metrics_add(&m, "%s\n", status);
+	} else {
+		status = "200 OK";
+		type = m.om ? METRICS_OPENMETRICS : METRICS_TEXT;
+		metrics_summary(&m);
+		metrics_devices(&m);
+		metrics_pools(&m);
+		if (m.om)
+			metrics_add(&m, "# EOF\n");
+	}
+
+	applog(LOG_DEBUG, "API: metrics reply to %s: %s (%d)", conn->connectaddr, status, (int)m.len);
+
+	len = snprintf(head, sizeof(head),
+			"HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+			status, type, (int)m.len);
+
+	conn->out = realloc(conn->out, len + m.len);
+	if (unlikely(!conn->out))
+		quit(1, "Failed to realloc API reply buffer");
+	memcpy(conn->out, head, len);
+	memcpy(conn->out + len, m.buf, m.len);
+	conn->outlen = len + m.len;
+	free(m.buf);
+
+	conn->inlen = 0;
+	conn->done = true;
+	conn->keepalive = false;
+
+	return api_conn_flush(conn);
+}
+
+/*
+ * Answer the complete requests read so far, stopping if a reply has to wait
+ * for the client to read, so a client that doesn't read can't grow its
+ * buffer without limit
+ */
+static bool api_conn_requests(struct api_conn *conn, struct io_data *io_data)
+{
+	char *end, *nul;
+	bool isjson;
+	int len;
+
+	if (conn->http)
+		return api_conn_http(conn);
+
+	while (conn->outlen == 0 && conn->inlen > 0) {
+		end = memchr(conn->in, '\n', conn->inlen);
+		nul = memchr(conn->in, '\0', conn->inlen);
+		if (nul && (!end || nul < end))
+			end = nul;
+		if (!end) {
+			if (conn->keepalive && !conn->done && conn->inlen < TMPBUFSIZ - 1)
+				break;
+			end = conn->in + conn->inlen;
+		}
+
+		*end = '\0';
+		len = end - conn->in;
+		if (len > 0 && conn->in[len - 1] == '\r')
+			conn->in[--len] = '\0';
+
+		if (len > 0) {
+			if (opt_debug)
+				applog(LOG_DEBUG, "API: recv command: (%d) '%s'", len, conn->in);
+
+			isjson = do_command(io_data, conn->fd, conn->in, len, conn->group, conn->connectaddr, &conn->keepalive);
+			if (!conn->keepalive)
+				conn->done = true;
+			if (!api_conn_reply(conn, io_data, isjson))
+				return false;
+		}
+
+		if (end < conn->in + conn->inlen)
+			end++;
+		conn->inlen -= end - conn->in;
+		memmove(conn->in, end, conn->inlen);
+	}
+
+	return true;
+}
+
+static bool api_conn_read(struct api_conn *conn, struct io_data *io_data)
+{
+	int n;
+
+	while (conn->inlen < TMPBUFSIZ - 1) {
+		n = recv(conn->fd, conn->in + conn->inlen, TMPBUFSIZ - 1 - conn->inlen, 0);
+		if (n == 0) {
+			// Answer what's left then close
+			conn->done = true;
+			conn->keepalive = false;
+			break;
+		}
+		if (SOCKETFAIL(n)) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			applog(LOG_DEBUG, "API: recv from %s failed: %s", conn->connectaddr, SOCKERRMSG);
+			return false;
+		}
+		conn->inlen += n;
+		conn->last = time(NULL);
+	}
+
+	return api_conn_requests(conn, io_data);
+}
+
+/*
+ * Close the connection once it's finished, otherwise only wait to read
+ * more requests once every waiting reply has gone
+ */
+static void api_conn_update(struct api_conn *conn)
+{
+	struct epoll_event ev;
+	uint32_t events;
+
+	if (conn->done && !conn->keepalive && conn->outlen == 0) {
+		api_conn_close(conn);
+		return;
+	}
+
+	events = conn->outlen ? EPOLLOUT : EPOLLIN;
+	if (events != conn->events) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = conn->events = events;
+		ev.data.ptr = conn;
+		epoll_ctl(api_epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+	}
+}
+
+static void api_conn_accept(SOCKETTYPE apisock, bool http)
+{
+	struct epoll_event ev;
+	struct api_conn *conn;
+	struct sockaddr_in cli;
+	socklen_t clisiz;
+	char *connectaddr;
+	char group;
+	SOCKETTYPE c;
+
+	while (42) {
+		clisiz = sizeof(cli);
+		c = accept(apisock, (struct sockaddr *)(&cli), &clisiz);
+		if (SOCKETFAIL(c)) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				applog(LOG_DEBUG, "API accept failed (%s)", SOCKERRMSG);
+			return;
+		}
+
+		if (!check_connect(&cli, &connectaddr, &group)) {
+			CLOSESOCKET(c);
+			continue;
+		}
+
+		if (api_conncount >= opt_api_clients) {
+			applog(LOG_DEBUG, "API: dropped connection from %s - already have %d", connectaddr, api_conncount);
+			CLOSESOCKET(c);
+			continue;
+		}
+
+		conn = calloc(sizeof(*conn), 1);
+		if (unlikely(!conn))
+			quit(1, "Failed to calloc API conn");
+		conn->fd = c;
+		strncpy(conn->connectaddr, connectaddr, sizeof(conn->connectaddr) - 1);
+		conn->group = group;
+		conn->http = http;
+		conn->last = time(NULL);
+
+		fcntl(c, F_SETFL, O_NONBLOCK | fcntl(c, F_GETFL, 0));
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = conn->events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(api_epfd, EPOLL_CTL_ADD, c, &ev)) {
+			applog(LOG_DEBUG, "API epoll_ctl failed (%s)", SOCKERRMSG);
+			CLOSESOCKET(c);
+			free(conn);
+			continue;
+		}
+
+		list_add_tail(&conn->list, &api_conns);
+		api_conncount++;
+	}
+}
+
+static void api_conns_idle(time_t now)
+{
+	struct api_conn *conn, *tmp;
+
+	list_for_each_entry_safe(conn, tmp, &api_conns, list) {
+		if (conn->subscribed)
+			continue;
+
+		if (now - conn->last > (conn->keepalive ? API_IDLE : API_WAIT)) {
+			applog(LOG_DEBUG, "API: dropped idle connection from %s", conn->connectaddr);
+			api_conn_close(conn);
+		}
+	}
+}
+
+/*
+ * Send the waiting events to each subscriber that wants them, dropping any
+ * subscriber that has stopped reading
+ */
+static void api_events_send(struct io_data *io_data)
+{
+	struct api_conn *conn, *tmp;
+	struct api_event *ev, *evtmp;
+	LIST_HEAD(events);
+	char drain[64];
+	bool ok;
+
+	while (read(api_eventpipe[0], drain, sizeof(drain)) > 0)
+		;
+
+	mutex_lock(&api_event_lock);
+	list_splice_init(&api_events, &events);
+	api_eventcount = 0;
+	mutex_unlock(&api_event_lock);
+
+	if (list_empty(&events))
+		return;
+
+	list_for_each_entry_safe(ev, evtmp, &events, list) {
+		list_for_each_entry(conn, &api_conns, list) {
+			if (conn->subscribed && (!*conn->filter || strstr(conn->filter, ev->type)))
+				api_conn_add(conn, ev->line, ev->len);
+		}
+		list_del(&ev->list);
+		free(ev->line);
+		free(ev);
+	}
+
+	list_for_each_entry_safe(conn, tmp, &api_conns, list) {
+		if (!conn->subscribed)
+			continue;
+
+		if (conn->outlen - conn->outsent > API_EVENTBUF) {
+			applog(LOG_DEBUG, "API: dropped subscriber %s - not reading events", conn->connectaddr);
+			api_conn_close(conn);
+			continue;
+		}
+
+		ok = api_conn_flush(conn);
+		if (ok && conn->outlen == 0)
+			ok = api_conn_requests(conn, io_data);
+
+		if (ok)
+			api_conn_update(conn);
+		else
+			api_conn_close(conn);
+	}
+}
+
+static void metrics_listen(struct sockaddr_in *serv)
+{
+	struct sockaddr_in addr;
+	int optval = 1;
+
+	api_metricsock = socket(AF_INET, SOCK_STREAM, 0);
+	if (api_metricsock == INVSOCK) {
+		applog(LOG_ERR, "API metrics initialisation failed (%s)", SOCKERRMSG);
+		return;
+	}
+
+	if (SOCKETFAIL(setsockopt(api_metricsock, SOL_SOCKET, SO_REUSEADDR, (void *)(&optval), sizeof(optval))))
+		applog(LOG_DEBUG, "API metrics setsockopt SO_REUSEADDR failed (ignored): %s", SOCKERRMSG);
+
+	memcpy(&addr, serv, sizeof(addr));
+	addr.sin_port = htons(opt_api_metrics_port);
+
+	if (SOCKETFAIL(bind(api_metricsock, (struct sockaddr *)(&addr), sizeof(addr))) ||
+	    SOCKETFAIL(listen(api_metricsock, QUEUE))) {
+		applog(LOG_ERR, "API metrics on port %d failed (%s)", opt_api_metrics_port, SOCKERRMSG);
+		CLOSESOCKET(api_metricsock);
+		api_metricsock = INVSOCK;
+		return;
+	}
+
+	applog(LOG_WARNING, "API metrics running on port %d (%d)", opt_api_metrics_port, api_metricsock);
+}
+
+static void api_loop(SOCKETTYPE apisock, struct io_data *io_data)
+{
+	struct epoll_event ev, events[64];
+	struct api_conn *conn;
+	time_t now, checked;
+	int i, nfds;
+	bool ok, events_waiting;
+
+	api_epfd = epoll_create(64);
+	if (api_epfd == -1) {
+		applog(LOG_ERR, "API epoll_create failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
+		return;
+	}
+
+	fcntl(apisock, F_SETFL, O_NONBLOCK | fcntl(apisock, F_GETFL, 0));
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(api_epfd, EPOLL_CTL_ADD, apisock, &ev)) {
+		applog(LOG_ERR, "API epoll_ctl failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
+		return;
+	}
+
+	if (api_metricsock != INVSOCK) {
+		fcntl(api_metricsock, F_SETFL, O_NONBLOCK | fcntl(api_metricsock, F_GETFL, 0));
+
+		ev.data.ptr = &api_metricsock;
+		if (epoll_ctl(api_epfd, EPOLL_CTL_ADD, api_metricsock, &ev)) {
+			applog(LOG_ERR, "API metrics epoll_ctl failed (%s)", SOCKERRMSG);
+			CLOSESOCKET(api_metricsock);
+			api_metricsock = INVSOCK;
+		}
+	}
+
+	if (pipe(api_eventpipe)) {
+		applog(LOG_ERR, "API event pipe failed (%s)%s", strerror(errno), UNAVAILABLE);
+		api_eventpipe[0] = api_eventpipe[1] = -1;
+		return;
+	}
+	fcntl(api_eventpipe[0], F_SETFL, O_NONBLOCK | fcntl(api_eventpipe[0], F_GETFL, 0));
+	fcntl(api_eventpipe[1], F_SETFL, O_NONBLOCK | fcntl(api_eventpipe[1], F_GETFL, 0));
+
+	ev.data.ptr = &api_eventpipe;
+	if (epoll_ctl(api_epfd, EPOLL_CTL_ADD, api_eventpipe[0], &ev)) {
+		applog(LOG_ERR, "API epoll_ctl failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
+		return;
+	}
+
+	checked = time(NULL);
+	while (!bye) {
+		nfds = epoll_wait(api_epfd, events, 64, 1000);
+		if (nfds == -1 && errno != EINTR) {
+			applog(LOG_ERR, "API epoll_wait failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
+			return;
+		}
+
+		events_waiting = false;
+		for (i = 0; i < nfds && !bye; i++) {
+			if (events[i].data.ptr == &api_eventpipe) {
+				events_waiting = true;
+				continue;
+			}
+
+			if (events[i].data.ptr == &api_metricsock) {
+				api_conn_accept(api_metricsock, true);
+				continue;
+			}
+
+			conn = events[i].data.ptr;
+			if (!conn) {
+				api_conn_accept(apisock, false);
+				continue;
+			}
+
+			if (events[i].events & EPOLLOUT) {
+				ok = api_conn_flush(conn);
+				if (ok && conn->outlen == 0)
+					ok = api_conn_requests(conn, io_data);
+			} else
+				ok = api_conn_read(conn, io_data);
+
+			if (ok)
+				api_conn_update(conn);
+			else
+				api_conn_close(conn);
+		}
+
+		// Also send any queued by the last command before quit or restart
+		if (events_waiting || bye)
+			api_events_send(io_data);
+
+		now = time(NULL);
+		if (now != checked) {
+			api_conns_idle(now);
+			checked = now;
+		}
+	}
+}
+#endif
+
+int api_subscribers;
+
+/*
+ * Queue an event for the API "subscribe" connections as a line of JSON
+ * with the EVENT name, the When time and the fields in root, which is
+ * always freed
+ * Callers can check api_subscribers first to skip building root when
+ * there's no one to send it to
+ */
+void api_event(const char *event, struct api_data *root)
+{
+	struct io_data io_data;
+	char buf[TMPBUFSIZ];
+#ifdef HAVE_SYS_EPOLL_H
+	struct api_event *ev;
+	bool more = (root != NULL);
+	bool wake = false;
+	char line[TMPBUFSIZ + 64];
+	int len;
+#endif
+
+	io_fixed(&io_data, buf, sizeof(buf));
+	root = print_data(&io_data, root, true, false);
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (!api_subscribers || io_data.full)
+		return;
+
+	len = snprintf(line, sizeof(line), JSON0 "\"EVENT\":\"%s\",\"When\":%lu%s%s\n",
+			event, (unsigned long)time(NULL), more ? COMMA : BLANK, buf + 1);
+	if (len >= (int)sizeof(line))
+		return;
+
+	ev = calloc(sizeof(*ev), 1);
+	if (unlikely(!ev))
+		quit(1, "Failed to calloc API event");
+	snprintf(ev->type, sizeof(ev->type), "|%s|", event);
+	ev->line = strdup(line);
+	if (unlikely(!ev->line))
+		quit(1, "Failed to strdup API event");
+	ev->len = len;
+
+	mutex_lock(&api_event_lock);
+	if (api_eventpipe[1] != -1 && api_eventcount < API_EVENTMAX) {
+		list_add_tail(&ev->list, &api_events);
+		wake = (++api_eventcount == 1);
+		ev = NULL;
+		if (wake && write(api_eventpipe[1], "", 1) < 0)
+			applog(LOG_DEBUG, "API: event wake failed: %s", strerror(errno));
+	}
+	mutex_unlock(&api_event_lock);
+
+	if (ev) {
+		free(ev->line);
+		free(ev);
+	}
+#endif
+}
+
+void api(int api_thr_id)
+{
+	struct io_data *io_data;
+	struct thr_info bye_thr;
+	int bound;
+	char *binderror;
+	time_t bindstart;
+	short int port = opt_api_port;
+	struct sockaddr_in serv;
+#ifndef HAVE_SYS_EPOLL_H
+	char buf[TMPBUFSIZ];
+	struct sockaddr_in cli;
+	socklen_t clisiz;
+	char *connectaddr;
+	SOCKETTYPE c;
+	char group;
+	bool isjson;
+	int n;
+#endif
+
+	SOCKETTYPE *apisock;
 
 	apisock = malloc(sizeof(*apisock));
 	*apisock = INVSOCK;
@@ -4113,6 +5617,15 @@ void api(int api_thr_id)
 			applog(LOG_WARNING, "API running in local read access mode on port %d (%d)", port, *apisock);
 	}
 
+#ifdef HAVE_SYS_EPOLL_H
+	if (opt_api_metrics_port)
+		metrics_listen(&serv);
+
+	api_loop(*apisock, io_data);
+#else
+	if (opt_api_metrics_port)
+		applog(LOG_WARNING, "API metrics not available on this platform");
+
 	while (!bye) {
 		clisiz = sizeof(cli);
 		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
@@ -4120,30 +5633,7 @@ void api(int api_thr_id)
 			goto die;
 		}
 
-		connectaddr = inet_ntoa(cli.sin_addr);
-
-		addrok = false;
-		group = NOPRIVGROUP;
-		if (opt_api_allow) {
-			int client_ip = htonl(cli.sin_addr.s_addr);
-			for (i = 0; i < ips; i++) {
-				if ((client_ip & ipaccess[i].mask) == ipaccess[i].ip) {
-					addrok = true;
-					group = ipaccess[i].group;
-					break;
-				}
-			}
-		} else {
-			if (opt_api_network)
-				addrok = true;
-			else
-				addrok = (strcmp(connectaddr, localaddr) == 0);
-		}
-
-		if (opt_debug)
-			applog(LOG_DEBUG, "API: connection from %s - %s", connectaddr, addrok ? "Accepted" : "Ignored");
-
-		if (addrok) {
+		if (check_connect(&cli, &connectaddr, &group)) {
 			n = recv(c, &buf[0], TMPBUFSIZ-1, 0);
 			if (SOCKETFAIL(n))
 				buf[0] = '\0';
@@ -4158,95 +5648,14 @@ void api(int api_thr_id)
 			}
 
 			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
-				io_reinit(io_data);
-
-				did = false;
-
-				if (*buf != ISJSON) {
-					isjson = false;
-
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
-
-					cmd = buf;
-				}
-				else {
-					isjson = true;
-
-					param = NULL;
-
-#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
-					json_config = json_loadb(buf, n, 0, &json_err);
-#elif JANSSON_MAJOR_VERSION > 1
-					json_config = json_loads(buf, 0, &json_err);
-#else
-					json_config = json_loads(buf, &json_err);
-#endif
-
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					}
-					else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						}
-						else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							}
-							else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									sprintf(param_buf, "%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									sprintf(param_buf, "%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
-
-				if (!did)
-					for (i = 0; cmds[i].name != NULL; i++) {
-						if (strcmp(cmd, cmds[i].name) == 0) {
-							sprintf(cmdbuf, "|%s|", cmd);
-							if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-								(cmds[i].func)(io_data, c, param, isjson, group);
-							else {
-								message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-								applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-							}
-
-							send_result(io_data, c, isjson);
-							did = true;
-							break;
-						}
-					}
-
-				if (!did) {
-					message(io_data, MSG_INVCMD, 0, NULL, isjson);
-					send_result(io_data, c, isjson);
-				}
+				isjson = do_command(io_data, c, buf, n, group, connectaddr, NULL);
+				send_result(io_data, c, isjson);
 			}
 		}
 		CLOSESOCKET(c);
 	}
 die:
+#endif
 	/* Blank line fix for older compilers since pthread_cleanup_pop is a
 	 * macro that gets confused by a label existing immediately before it
 	 */
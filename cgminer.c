@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
@@ -62,6 +63,10 @@
 #include <sys/wait.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #if defined(USE_BITFORCE) || defined(USE_ICARUS) || defined(USE_AVALON) || defined(USE_MODMINER)
 #	define USE_FPGA
 #if defined(USE_ICARUS) || defined(USE_AVALON)
@@ -71,6 +76,10 @@
 #	define USE_FPGA
 #endif
 
+#ifdef USE_FPGA_SERIAL
+#include "fpgautils.h"
+#endif
+
 struct strategies strategies[] = { { "Failover" }, { "Round Robin" },
 		{ "Rotate" }, { "Load Balance" }, { "Balance" }, };
 
@@ -102,6 +111,8 @@ int nDevs;
 #endif
 #ifdef HAVE_OPENCL
 int opt_dynamic_interval = 7;
+bool opt_gpu_pipeline;
+bool opt_gpu_autotune;
 int opt_g_threads = -1;
 int gpu_threads;
 #ifdef USE_SCRYPT
@@ -135,6 +146,9 @@ bool opt_noadl;
 char *opt_api_allow = NULL;
 char *opt_api_groups;
 char *opt_api_description = PACKAGE_STRING;
+int opt_api_clients = 64;
+int opt_api_metrics_port;
+int opt_api_snapshot = 1000;
 int opt_api_port = 4028;
 bool opt_api_listen;
 bool opt_api_network;
@@ -142,6 +156,7 @@ bool opt_delaynet;
 bool opt_disable_pool;
 char *opt_icarus_options = NULL;
 char *opt_icarus_timing = NULL;
+bool opt_serial_async;
 bool opt_worktime;
 #ifdef USE_AVALON
 char *opt_avalon_options = NULL;
@@ -150,6 +165,8 @@ char *opt_avalon_options = NULL;
 char *opt_usb_select = NULL;
 int opt_usbdump = -1;
 bool opt_usb_list_all;
+bool opt_usb_async;
+char *opt_usb_sim;
 #endif
 
 char *opt_kernel_path;
@@ -184,6 +201,11 @@ int hotplug_time = 5;
 #ifdef USE_USBUTILS
 pthread_mutex_t cgusb_lock;
 #endif
+#ifdef HAVE_LIBUSB
+/* libusb_init() failed, which is only allowed when all the USB devices
+ * are virtual ones from --usb-sim */
+bool usb_unavailable;
+#endif
 
 pthread_mutex_t hash_lock;
 static pthread_mutex_t *stgd_lock;
@@ -236,7 +258,12 @@ const
 #endif
 bool curses_active;
 
-static char current_block[40];
+/* The previous block hash of the current block and a ring of the last few
+ * seen, compared raw from work data. Protected by blk_lock */
+#define BLOCK_RING 8
+static unsigned char current_block[32];
+static unsigned char block_ring[BLOCK_RING][32];
+static int block_ring_next;
 
 /* Protected by ch_lock */
 static char *current_hash;
@@ -250,14 +277,6 @@ double current_diff = 0xFFFFFFFFFFFFFFFFULL;
 static char block_diff[8];
 uint64_t best_diff = 0;
 
-struct block {
-	char hash[40];
-	UT_hash_handle hh;
-	int block_no;
-};
-
-static struct block *blocks = NULL;
-
 int swork_id;
 
 /* For creating a hash database of stratum shares submitted that have not had
@@ -268,10 +287,45 @@ struct stratum_share {
 	struct work *work;
 	int id;
 	time_t sshare_time;
+	char *req; /* The mining.submit line, kept for resubmitting */
+	bool sent;
+	struct timeval tv_sent;
+	time_t expires;
+	bool retry; /* A send failed or timed out, resend only in the same session */
+	/* On the pool's sshare_pending list until sent, then on the timer
+	 * wheel until answered or timed out */
+	struct list_head sq_node;
 };
 
 static struct stratum_share *stratum_shares = NULL;
 
+/* Shares awaiting a response are bucketed by the second they time out in so
+ * the submit thread only ever looks at the shares that are due. */
+#define SSHARE_TIMEOUT 30
+#define SSHARE_WHEEL_SLOTS 64
+static struct list_head sshare_wheel[SSHARE_WHEEL_SLOTS];
+static pthread_cond_t sshare_cond;
+int opt_stratum_window = 32;
+#ifdef HAVE_SYS_EPOLL_H
+int opt_sserver_port;
+float opt_sserver_diff = 1.0;
+char *opt_sserver_allow;
+static struct IP4ACCESS *sserver_access;
+static int sserver_ips;
+
+/* Shares the stratum server forwards belong to no mining thread and are
+ * accounted to this pseudo device instead */
+#define SSERVER_THR_ID -1
+static struct device_drv sserver_drv = {
+	.drv_id = DRIVER_MAX,
+	.dname = "stratum server",
+	.name = "SRV",
+};
+static struct cgpu_info sserver_cgpu = {
+	.drv = &sserver_drv,
+};
+#endif
+
 char *opt_socks_proxy = NULL;
 
 static const char def_conf[] = "cgminer.conf";
@@ -392,7 +446,13 @@ struct thr_info *get_thread(int thr_id) {
 }
 
 static struct cgpu_info *get_thr_cgpu(int thr_id) {
-	struct thr_info *thr = get_thread(thr_id);
+	struct thr_info *thr;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (thr_id == SSERVER_THR_ID)
+		return &sserver_cgpu;
+#endif
+	thr = get_thread(thr_id);
 
 	return thr->cgpu;
 }
@@ -473,6 +533,7 @@ struct pool *add_pool(void) {
 	mutex_init(&pool->stratum_lock);
 	cglock_init(&pool->gbt_lock);
 	INIT_LIST_HEAD(&pool->curlring);
+	INIT_LIST_HEAD(&pool->sshare_pending);
 
 	/* Make sure the pool doesn't think we've been idle since time 0 */
 	pool->tv_idle.tv_sec = ~0UL;
@@ -532,6 +593,10 @@ static char *set_int_0_to_9999(const char *arg, int *i) {
 	return set_int_range(arg, i, 0, 9999);
 }
 
+static char *set_int_0_to_65535(const char *arg, int *i) {
+	return set_int_range(arg, i, 0, 65535);
+}
+
 static char *set_int_1_to_65535(const char *arg, int *i) {
 	return set_int_range(arg, i, 1, 65535);
 }
@@ -867,6 +932,9 @@ static struct opt_table opt_config_table[] =
 						OPT_WITH_ARG("--api-allow",
 								set_api_allow, NULL, NULL,
 								"Allow API access only to the given list of [G:]IP[/Prefix] addresses[/subnets]"),
+						OPT_WITH_ARG("--api-clients",
+								set_int_1_to_65535, opt_show_intval, &opt_api_clients,
+								"Maximum number of API connections open at once"),
 						OPT_WITH_ARG("--api-description",
 								set_api_description, NULL, NULL,
 								"Description placed in the API status header, default: cgminer version"),
@@ -876,12 +944,18 @@ static struct opt_table opt_config_table[] =
 				OPT_WITHOUT_ARG("--api-listen",
 						opt_set_bool, &opt_api_listen,
 						"Enable API, default: disabled"),
+						OPT_WITH_ARG("--api-metrics-port",
+								set_int_0_to_65535, opt_show_intval, &opt_api_metrics_port,
+								"Port number of the API's Prometheus /metrics page, 0 to disable"),
 						OPT_WITHOUT_ARG("--api-network",
 								opt_set_bool, &opt_api_network,
 								"Allow API (if enabled) to listen on/for any address, default: only 127.0.0.1"),
 				OPT_WITH_ARG("--api-port",
 						set_int_1_to_65535, opt_show_intval, &opt_api_port,
 						"Port number of miner API"),
+				OPT_WITH_ARG("--api-snapshot",
+						set_int_0_to_9999, opt_show_intval, &opt_api_snapshot,
+						"Milliseconds the API reuses a report reply for, 0 to always rebuild it"),
 #ifdef HAVE_ADL
 				OPT_WITHOUT_ARG("--auto-fan",
 						opt_set_bool, &opt_autofan,
@@ -951,6 +1025,12 @@ static struct opt_table opt_config_table[] =
 						OPT_WITH_ARG("--gpu-dyninterval",
 								set_int_1_to_65535, opt_show_intval, &opt_dynamic_interval,
 								"Set the refresh interval in ms for GPUs using dynamic intensity"),
+				OPT_WITHOUT_ARG("--gpu-autotune",
+						opt_set_bool, &opt_gpu_autotune,
+						"Benchmark every kernel, vector width, worksize and intensity on each GPU at startup and use the fastest"),
+				OPT_WITHOUT_ARG("--gpu-pipeline",
+						opt_set_bool, &opt_gpu_pipeline,
+						"Queue each GPU kernel run before reading the results of the previous one"),
 				OPT_WITH_ARG("--gpu-platform",
 						set_int_0_to_9999, opt_show_intval, &opt_platform_id,
 						"Select OpenCL platform ID to use for GPU mining"),
@@ -1092,6 +1172,11 @@ static struct opt_table opt_config_table[] =
 				OPT_WITH_ARG("--scan-serial|-S",
 						add_serial, NULL, NULL,
 						"Serial port to probe for Icarus FPGA Mining device"),
+#ifdef HAVE_SYS_EPOLL_H
+				OPT_WITHOUT_ARG("--serial-async",
+						opt_set_bool, &opt_serial_async,
+						"Read serial device replies on a single epoll thread instead of polling in each device thread"),
+#endif
 #endif
 						OPT_WITH_ARG("--scan-time|-s",
 								set_int_0_to_9999, opt_show_intval, &opt_scantime,
@@ -1118,6 +1203,20 @@ static struct opt_table opt_config_table[] =
 				OPT_WITH_ARG("--socks-proxy",
 						opt_set_charp, NULL, &opt_socks_proxy,
 						"Set socks4 proxy (host:port)"),
+#ifdef HAVE_SYS_EPOLL_H
+				OPT_WITH_ARG("--stratum-server-allow",
+						opt_set_charp, NULL, &opt_sserver_allow,
+						"Allow stratum server clients only from the given list of IP[/Prefix] addresses[/subnets] (default: localhost only)"),
+				OPT_WITH_ARG("--stratum-server-diff",
+						opt_set_floatval, opt_show_floatval, &opt_sserver_diff,
+						"Share difficulty asked of downstream stratum server miners"),
+				OPT_WITH_ARG("--stratum-server-port",
+						set_int_1_to_65535, opt_show_intval, &opt_sserver_port,
+						"Serve downstream stratum miners from the current pool on this port"),
+#endif
+				OPT_WITH_ARG("--stratum-window",
+						set_int_1_to_65535, opt_show_intval, &opt_stratum_window,
+						"Maximum stratum shares per pool awaiting a response before further submits are queued"),
 #ifdef HAVE_SYSLOG_H
 						OPT_WITHOUT_ARG("--syslog",
 								opt_set_bool, &use_syslog,
@@ -1162,6 +1261,12 @@ static struct opt_table opt_config_table[] =
 				OPT_WITH_ARG("--usb",
 						set_usb_select, NULL, NULL,
 						"USB device selection"),
+				OPT_WITHOUT_ARG("--usb-async",
+						opt_set_bool, &opt_usb_async,
+						"Service USB reads from pre-submitted transfers on a single event thread"),
+				OPT_WITH_ARG("--usb-sim",
+						opt_set_charp, NULL, &opt_usb_sim,
+						"Add virtual USB devices for testing without the hardware (See README)"),
 				OPT_WITH_ARG("--usb-dump",
 						set_int_0_to_10, opt_show_intval, &opt_usbdump,
 						opt_hidden),
@@ -1491,81 +1596,256 @@ static void __build_gbt_coinbase(struct pool *pool) {
 
 static void gen_hash(unsigned char *data, unsigned char *hash, int len);
 
-/* Process transactions with GBT by storing the binary value of the first
- * transaction, and the hashes of the remaining transactions since these
- * remain constant with an altered coinbase when generating work. Must be
- * entered under gbt_lock */
-static bool __build_gbt_txns(struct pool *pool, json_t *res_val) {
-	json_t *txn_array;
-	bool ret = false;
-	size_t cal_len;
+/* Folds the coinbase hash through a merkle branch, the sibling it is hashed
+ * with at each level of the tree, giving the root as it is stored in the
+ * block header */
+static void gen_merkle_root(unsigned char *coinbase, size_t cb_len,
+		const unsigned char *merkle_bin, int merkles, unsigned char *merkle_root) {
+	unsigned char merkle_sha[64];
+	uint32_t *data32, *swap32;
 	int i;
 
-	free(pool->txn_hashes);
-	pool->txn_hashes = NULL;
-	pool->gbt_txns = 0;
+	gen_hash(coinbase, merkle_root, cb_len);
+	memcpy(merkle_sha, merkle_root, 32);
+	for (i = 0; i < merkles; i++) {
+		memcpy(merkle_sha + 32, merkle_bin + (i * 32), 32);
+		gen_hash(merkle_sha, merkle_root, 64);
+		memcpy(merkle_sha, merkle_root, 32);
+	}
+	data32 = (uint32_t *) merkle_sha;
+	swap32 = (uint32_t *) merkle_root;
+	flip32(swap32, data32);
+}
 
-	txn_array = json_object_get(res_val, "transactions");
-	if (!json_is_array(txn_array))
-		goto out;
+/* Only the coinbase changes from one GBT work item to the next so the merkle
+ * branch it is folded through is built once per template. Must be entered
+ * under gbt_lock */
+static void __build_gbt_merkles(struct pool *pool) {
+	unsigned char *merkle_hash;
+	int i, txns;
 
-	ret = true;
-	pool->gbt_txns = json_array_size(txn_array);
-	if (!pool->gbt_txns)
-		goto out;
+	txns = pool->gbt_txns + 1;
+	while (txns > 1) {
+		pool->gbt_merkles++;
+		txns = (txns + 1) / 2;
+	}
+	if (!pool->gbt_merkles)
+		return;
 
-	pool->txn_hashes = calloc(32 * (pool->gbt_txns + 1), 1);
-	if (unlikely(!pool->txn_hashes))
-		quit(1, "Failed to calloc txn_hashes in __build_gbt_txns");
+	pool->gbt_merkle_bin = calloc(32 * pool->gbt_merkles, 1);
+	merkle_hash = calloc(32 * (pool->gbt_txns + 2), 1);
+	if (unlikely(!pool->gbt_merkle_bin || !merkle_hash))
+		quit(1, "Failed to calloc merkle_hash in __build_gbt_merkles");
 
-	for (i = 0; i < pool->gbt_txns; i++) {
-		json_t *txn_val = json_object_get(json_array_get(txn_array, i), "data");
+	/* Slot 0 stands in for the coinbase and is never hashed */
+	memcpy(merkle_hash + 32, pool->txn_hashes, pool->gbt_txns * 32);
+	txns = pool->gbt_txns + 1;
+	for (i = 0; txns > 1; i++) {
+		int j;
+
+		memcpy(pool->gbt_merkle_bin + (i * 32), merkle_hash + 32, 32);
+		if (txns % 2) {
+			memcpy(&merkle_hash[txns * 32], &merkle_hash[(txns - 1) * 32], 32);
+			txns++;
+		}
+		for (j = 2; j < txns; j += 2) {
+			unsigned char hashout[32];
+
+			gen_hash(merkle_hash + (j * 32), hashout, 64);
+			memcpy(merkle_hash + (j / 2 * 32), hashout, 32);
+		}
+		txns /= 2;
+	}
+	free(merkle_hash);
+}
+
+/* Templates are hashed by up to this many threads, each taking at least
+ * GBT_HASH_BATCH transactions. The caller is one of them, the others are
+ * long lived workers fed through gbt_hash_q and started on first use, and
+ * gbt_hash_lock keeps two pools' templates from sharing them at once */
+#define GBT_HASH_THREADS 4
+#define GBT_HASH_BATCH 64
+
+static pthread_mutex_t gbt_hash_lock;
+static struct thread_q *gbt_hash_q, *gbt_hash_done;
+
+struct gbt_hash_job {
+	json_t *txn_array;
+	int *todo;
+	int ntodo;
+	int thread;
+	int threads;
+	unsigned char *txn_hashes;
+};
+
+static void gbt_hash_txns(struct gbt_hash_job *job) {
+	int i;
+
+	for (i = job->thread; i < job->ntodo; i += job->threads) {
+		int txn_no = job->todo[i];
+		json_t *txn_val = json_object_get(json_array_get(job->txn_array, txn_no), "data");
 		const char *txn = json_string_value(txn_val);
 		int txn_len = strlen(txn);
 		unsigned char *txn_bin;
+		size_t cal_len;
 
 		cal_len = txn_len;
 		align_len(&cal_len);
 		txn_bin = calloc(cal_len, 1);
 		if (unlikely(!txn_bin))
-			quit(1, "Failed to calloc txn_bin in __build_gbt_txns");
+			quit(1, "Failed to calloc txn_bin in gbt_hash_txns");
 		if (unlikely(!hex2bin(txn_bin, txn, txn_len / 2)))
 			quit(1, "Failed to hex2bin txn_bin");
 
-		gen_hash(txn_bin, pool->txn_hashes + (32 * i), txn_len / 2);
+		gen_hash(txn_bin, job->txn_hashes + (32 * txn_no), txn_len / 2);
 		free(txn_bin);
 	}
-	out: return ret;
 }
 
-static unsigned char *__gbt_merkleroot(struct pool *pool) {
-	unsigned char *merkle_hash;
-	int i, txns;
+static void *gbt_hash_thread(void __maybe_unused *userdata) {
+	struct gbt_hash_job *job;
 
-	merkle_hash = calloc(32 * (pool->gbt_txns + 2), 1);
-	if (unlikely(!merkle_hash))
-		quit(1, "Failed to calloc merkle_hash in __gbt_merkleroot");
+	pthread_detach(pthread_self());
+	RenameThread("gbthash");
 
-	gen_hash(pool->gbt_coinbase, merkle_hash, pool->coinbase_len);
+	while (42) {
+		job = tq_pop(gbt_hash_q, NULL);
+		if (!job)
+			continue;
+		gbt_hash_txns(job);
+		tq_push(gbt_hash_done, job);
+	}
+	return NULL;
+}
 
-	if (pool->gbt_txns)
-		memcpy(merkle_hash + 32, pool->txn_hashes, pool->gbt_txns * 32);
+/* Must be entered under gbt_hash_lock */
+static void gbt_hash_start(void) {
+	pthread_t pth;
+	int i;
 
-	txns = pool->gbt_txns + 1;
-	while (txns > 1) {
-		if (txns % 2) {
-			memcpy(&merkle_hash[txns * 32], &merkle_hash[(txns - 1) * 32], 32);
-			txns++;
-		}
-		for (i = 0; i < txns; i += 2) {
-			unsigned char hashout[32];
+	if (gbt_hash_q)
+		return;
+
+	gbt_hash_q = tq_new();
+	gbt_hash_done = tq_new();
+	if (unlikely(!gbt_hash_q || !gbt_hash_done))
+		quit(1, "Failed to tq_new in gbt_hash_start");
+	for (i = 1; i < GBT_HASH_THREADS; i++) {
+		if (unlikely(pthread_create(&pth, NULL, gbt_hash_thread, NULL)))
+			quit(1, "Failed to create gbt_hash_thread");
+	}
+}
+
+/* Process transactions with GBT by storing the binary value of the first
+ * transaction, and the hashes of the remaining transactions since these
+ * remain constant with an altered coinbase when generating work. Hashes are
+ * remembered by the txid bitcoind gives so only transactions new to this
+ * template need hashing, and those are shared out between threads. Must be
+ * entered under gbt_lock */
+static bool __build_gbt_txns(struct pool *pool, json_t *res_val) {
+	struct gbt_hash_job jobs[GBT_HASH_THREADS];
+	struct gbt_txn *gtxn, *tmp;
+	int i, ntodo = 0, threads;
+	json_t *txn_array;
+	bool ret = false;
+	int *todo;
+
+	free(pool->txn_hashes);
+	pool->txn_hashes = NULL;
+	pool->gbt_txns = 0;
+	free(pool->gbt_merkle_bin);
+	pool->gbt_merkle_bin = NULL;
+	pool->gbt_merkles = 0;
+
+	txn_array = json_object_get(res_val, "transactions");
+	if (!json_is_array(txn_array))
+		goto out;
+
+	ret = true;
+	pool->gbt_txns = json_array_size(txn_array);
+	if (!pool->gbt_txns)
+		goto out;
 
-			gen_hash(merkle_hash + (i * 32), hashout, 64);
-			memcpy(merkle_hash + (i / 2 * 32), hashout, 32);
+	pool->txn_hashes = calloc(32 * (pool->gbt_txns + 1), 1);
+	todo = malloc(sizeof(int) * pool->gbt_txns);
+	if (unlikely(!pool->txn_hashes || !todo))
+		quit(1, "Failed to calloc txn_hashes in __build_gbt_txns");
+
+	for (i = 0; i < pool->gbt_txns; i++) {
+		const char *txid = json_string_value(json_object_get(
+				json_array_get(txn_array, i), "hash"));
+		unsigned char key[32];
+
+		gtxn = NULL;
+		if (txid && strlen(txid) == 64 && hex2bin(key, txid, 32))
+			HASH_FIND(hh, pool->gbt_txn_cache, key, 32, gtxn);
+		if (gtxn) {
+			memcpy(pool->txn_hashes + (32 * i), gtxn->hash, 32);
+			gtxn->seen = true;
+		} else
+			todo[ntodo++] = i;
+	}
+
+	threads = ntodo / GBT_HASH_BATCH + 1;
+	if (threads > GBT_HASH_THREADS)
+		threads = GBT_HASH_THREADS;
+	for (i = 0; i < threads; i++) {
+		jobs[i].txn_array = txn_array;
+		jobs[i].todo = todo;
+		jobs[i].ntodo = ntodo;
+		jobs[i].thread = i;
+		jobs[i].threads = threads;
+		jobs[i].txn_hashes = pool->txn_hashes;
+	}
+	if (threads > 1) {
+		mutex_lock(&gbt_hash_lock);
+		gbt_hash_start();
+		for (i = 1; i < threads; i++) {
+			if (unlikely(!tq_push(gbt_hash_q, &jobs[i])))
+				quit(1, "Failed to tq_push in __build_gbt_txns");
 		}
-		txns /= 2;
+		gbt_hash_txns(&jobs[0]);
+		for (i = 1; i < threads; ) {
+			if (tq_pop(gbt_hash_done, NULL))
+				i++;
+		}
+		mutex_unlock(&gbt_hash_lock);
+	} else
+		gbt_hash_txns(&jobs[0]);
+
+	for (i = 0; i < ntodo; i++) {
+		const char *txid = json_string_value(json_object_get(
+				json_array_get(txn_array, todo[i]), "hash"));
+		unsigned char key[32];
+
+		if (!txid || strlen(txid) != 64 || !hex2bin(key, txid, 32))
+			continue;
+		HASH_FIND(hh, pool->gbt_txn_cache, key, 32, gtxn);
+		if (gtxn)
+			continue;
+		gtxn = calloc(sizeof(struct gbt_txn), 1);
+		if (unlikely(!gtxn))
+			quit(1, "Failed to calloc gtxn in __build_gbt_txns");
+		memcpy(gtxn->txid, key, 32);
+		memcpy(gtxn->hash, pool->txn_hashes + (32 * todo[i]), 32);
+		gtxn->seen = true;
+		HASH_ADD(hh, pool->gbt_txn_cache, txid, 32, gtxn);
+	}
+	applog(LOG_DEBUG, "Pool %d GBT template %d transactions, %d hashed",
+			pool->pool_no, pool->gbt_txns, ntodo);
+	free(todo);
+
+	__build_gbt_merkles(pool);
+out:
+	/* Forget transactions that have left the template */
+	HASH_ITER(hh, pool->gbt_txn_cache, gtxn, tmp) {
+		if (!gtxn->seen) {
+			HASH_DEL(pool->gbt_txn_cache, gtxn);
+			free(gtxn);
+		} else
+			gtxn->seen = false;
 	}
-	return merkle_hash;
+	return ret;
 }
 
 static void calc_diff(struct work *work, int known);
@@ -1608,11 +1888,11 @@ static void update_gbt(struct pool *pool) {
 	curl_easy_cleanup(curl);
 }
 
-static char *workpadding =
+const char *workpadding =
 		"000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000";
 
 static void gen_gbt_work(struct pool *pool, struct work *work) {
-	unsigned char *merkleroot;
+	unsigned char merkleroot[32];
 	struct timeval now;
 
 	cgtime(&now);
@@ -1622,7 +1902,8 @@ static void gen_gbt_work(struct pool *pool, struct work *work) {
 	cg_ilock(&pool->gbt_lock);
 	__build_gbt_coinbase(pool);
 	cg_dlock(&pool->gbt_lock);
-	merkleroot = __gbt_merkleroot(pool);
+	gen_merkle_root(pool->gbt_coinbase, pool->coinbase_len, pool->gbt_merkle_bin,
+			pool->gbt_merkles, merkleroot);
 
 	memcpy(work->data, &pool->gbt_version, 4);
 	memcpy(work->data + 4, pool->previousblockhash, 32);
@@ -1641,8 +1922,6 @@ static void gen_gbt_work(struct pool *pool, struct work *work) {
 	cg_runlock(&pool->gbt_lock);
 
 	memcpy(work->data + 4 + 32, merkleroot, 32);
-	flip32(work->data + 4 + 32, merkleroot);
-	free(merkleroot);
 	memset(work->data + 4 + 32 + 32 + 4 + 4, 0, 4); /* nonce */
 
 	hex2bin(work->data + 4 + 32 + 32 + 4 + 4 + 4, workpadding, 48);
@@ -1818,7 +2097,7 @@ static int __total_staged(void) {
 	return HASH_COUNT(staged_work);
 }
 
-static int total_staged(void) {
+int total_staged(void) {
 	int ret;
 
 	mutex_lock(stgd_lock);
@@ -2255,8 +2534,34 @@ static void restart_threads(void);
 /* Theoretically threads could race when modifying accepted and
  * rejected values but the chance of two submits completing at the
  * same time is zero so there is no point adding extra locking */
+/* Tell any API subscribers the share's result and how long the pool took
+ * to reply, if known */
+static void share_event(const struct work *work, struct cgpu_info *cgpu,
+		bool accepted, double rtt) {
+	struct api_data *root = NULL;
+	int pool_no = work->pool->pool_no;
+	double diff = work->work_difficulty;
+	uint64_t share_diff = work->share_diff;
+	bool block = work->block;
+
+	if (!api_subscribers)
+		return;
+
+	root = api_add_const(root, "Name", cgpu->drv->name, false);
+	root = api_add_int(root, "ID", &(cgpu->device_id), false);
+	root = api_add_int(root, "Pool", &pool_no, false);
+	root = api_add_bool(root, "Accepted", &accepted, false);
+	root = api_add_diff(root, "Difficulty", &diff, false);
+	root = api_add_uint64(root, "Share Difficulty", &share_diff, false);
+	root = api_add_bool(root, "Block", &block, false);
+	if (rtt >= 0)
+		root = api_add_double(root, "Latency", &rtt, false);
+	api_event("share", root);
+}
+
 static void share_result(json_t *val, json_t *res, json_t *err,
-		const struct work *work, char *hashshow, bool resubmit, char *worktime) {
+		const struct work *work, char *hashshow, bool resubmit, char *worktime,
+		double rtt) {
 	struct pool *pool = work->pool;
 	struct cgpu_info *cgpu;
 
@@ -2271,6 +2576,7 @@ static void share_result(json_t *val, json_t *res, json_t *err,
 		total_diff_accepted += work->work_difficulty;
 		pool->diff_accepted += work->work_difficulty;
 		mutex_unlock(&stats_lock);
+		share_event(work, cgpu, true, rtt);
 
 		pool->seq_rejects = 0;
 		cgpu->last_share_pool = pool->pool_no;
@@ -2323,6 +2629,7 @@ static void share_result(json_t *val, json_t *res, json_t *err,
 		pool->diff_rejected += work->work_difficulty;
 		pool->seq_rejects++;
 		mutex_unlock(&stats_lock);
+		share_event(work, cgpu, false, rtt);
 
 		applog(LOG_DEBUG, "PROOF OF WORK RESULT: false (booooo)");
 		if (!QUIET) {
@@ -2542,7 +2849,8 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit) {
 		}
 	}
 
-	share_result(val, res, err, work, hashshow, resubmit, worktime);
+	share_result(val, res, err, work, hashshow, resubmit, worktime,
+			tdiff(&tv_submit_reply, &tv_submit));
 
 	cgpu->utility = cgpu->accepted / total_secs * 60;
 
@@ -2871,6 +3179,9 @@ static void clean_up(void);
 void app_restart(void) {
 	applog(LOG_WARNING, "Attempting to restart %s", packagename);
 
+	if (api_subscribers)
+		api_event("restart", NULL);
+
 	__kill_work();
 	clean_up();
 
@@ -3219,6 +3530,276 @@ static void rebuild_hash(struct work *work) {
 
 static bool cnx_needed(struct pool *pool);
 
+/* Stratum shares are not sent by the thread that found them. They are
+ * queued on their pool's sshare_pending list, already tracked in the
+ * stratum_shares hash so a response can never beat its record, and the
+ * single stratum submit thread sends as many as each pool's window allows,
+ * coalesced into one send per pool. Shares that get no response within
+ * SSHARE_TIMEOUT are resubmitted as long as the session is still resumable
+ * and the share is less than 2 minutes old. */
+static void stratum_submit(struct work *work) {
+	struct stratum_share *sshare = calloc(sizeof(struct stratum_share), 1);
+	uint32_t *hash32 = (uint32_t *) work->hash, nonce;
+	struct pool *pool = work->pool;
+	char *noncehex;
+	char s[1024];
+
+	if (unlikely(!sshare))
+		quit(1, "Failed to calloc sshare in stratum_submit");
+	sshare->sshare_time = time(NULL );
+	/* This work item is freed in parse_stratum_response */
+	sshare->work = work;
+	nonce = *((uint32_t *) (work->data + 76));
+	noncehex = bin2hex((const unsigned char *) &nonce, 4);
+
+	mutex_lock(&sshare_lock);
+	/* Give the stratum share a unique id */
+	sshare->id = swork_id++;
+	mutex_unlock(&sshare_lock);
+
+	snprintf(s, sizeof(s),
+			"{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+			pool->rpc_user, work->job_id, work->nonce2, work->ntime,
+			noncehex, sshare->id);
+	free(noncehex);
+	sshare->req = strdup(s);
+	if (unlikely(!sshare->req))
+		quit(1, "Failed to strdup sshare req in stratum_submit");
+
+	applog(LOG_INFO, "Submitting share %08lx to pool %d", htole32(hash32[6]),pool->pool_no);
+
+	mutex_lock(&sshare_lock);
+	HASH_ADD_INT(stratum_shares, id, sshare);
+	pool->sshares++;
+	list_add_tail(&sshare->sq_node, &pool->sshare_pending);
+	pthread_cond_signal(&sshare_cond);
+	mutex_unlock(&sshare_lock);
+}
+
+/* Must be called under sshare_lock */
+static void __sshare_untrack(struct pool *pool, struct stratum_share *sshare) {
+	HASH_DEL(stratum_shares, sshare);
+	list_del(&sshare->sq_node);
+	if (sshare->sent)
+		pool->sshares_sent--;
+	pool->sshares--;
+}
+
+static void free_sshare(struct stratum_share *sshare) {
+	free_work(sshare->work);
+	free(sshare->req);
+	free(sshare);
+}
+
+/* Account for and free a share already untracked under sshare_lock, nothing
+ * else can find it once it is out of stratum_shares */
+static void sshare_discard(struct stratum_share *sshare, const char *reason) {
+	struct work *work = sshare->work;
+	struct pool *pool = work->pool;
+
+	applog(LOG_DEBUG, "%s, discarding stratum share %d", reason, sshare->id);
+
+	mutex_lock(&stats_lock);
+	total_stale++;
+	pool->stale_shares++;
+	total_diff_stale += work->work_difficulty;
+	pool->diff_stale += work->work_difficulty;
+	mutex_unlock(&stats_lock);
+
+	free_sshare(sshare);
+}
+
+/* Send everything the pool's window allows in one go. The lines are copied
+ * and the shares moved onto the timer wheel under sshare_lock, since a
+ * response or clear_stratum_shares can free a share as soon as the lock is
+ * dropped. If the send fails only the shares still tracked are put back.
+ * The socket is never waited on: whatever it doesn't take now is kept by
+ * stratum_send_queued and pushed out on later ticks, so one stalled pool
+ * doesn't hold up submissions to the others. */
+static void stratum_flush(struct pool *pool) {
+	struct stratum_share *sshare, *tmp;
+	size_t len = 0, off = 0;
+	struct timeval now;
+	int *ids = NULL, count = 0, i;
+	char *buf = NULL;
+
+	/* A response can arrive as soon as the send is done so everything
+	 * parse_stratum_response looks at is set up beforehand */
+	cgtime(&now);
+	mutex_lock(&sshare_lock);
+	list_for_each_entry(sshare, &pool->sshare_pending, sq_node) {
+		if (pool->sshares_sent + count >= opt_stratum_window)
+			break;
+		len += strlen(sshare->req) + 1;
+		count++;
+	}
+	if (count) {
+		buf = malloc(len);
+		if (unlikely(!buf))
+			quit(1, "Failed to malloc buf in stratum_flush");
+		ids = malloc(sizeof(*ids) * count);
+		if (unlikely(!ids))
+			quit(1, "Failed to malloc ids in stratum_flush");
+		i = 0;
+		list_for_each_entry_safe(sshare, tmp, &pool->sshare_pending, sq_node) {
+			size_t rlen = strlen(sshare->req);
+
+			if (i >= count)
+				break;
+			memcpy(buf + off, sshare->req, rlen);
+			off += rlen;
+			buf[off++] = '\n';
+			ids[i++] = sshare->id;
+
+			sshare->sent = true;
+			copy_time(&sshare->tv_sent, &now);
+			sshare->expires = now.tv_sec + SSHARE_TIMEOUT;
+			pool->sshares_sent++;
+			list_move_tail(&sshare->sq_node,
+					&sshare_wheel[sshare->expires % SSHARE_WHEEL_SLOTS]);
+		}
+	}
+	mutex_unlock(&sshare_lock);
+
+	if (!count) {
+		/* Push out what an earlier tick couldn't, a failure there is
+		 * left to the shares' timeouts and the receive side */
+		if (pool->stratum_active)
+			stratum_send_queued(pool, NULL, 0);
+		return;
+	}
+
+	if (likely(pool->stratum_active && stratum_send_queued(pool, buf, off))) {
+		if (pool_tclear(pool, &pool->submit_fail))
+			applog(LOG_WARNING, "Pool %d communication resumed, submitting work",
+					pool->pool_no);
+		applog(LOG_DEBUG, "Successfully submitted to pool %d", pool->pool_no);
+	} else {
+		if (!pool_tset(pool, &pool->submit_fail) && cnx_needed(pool)) {
+			applog(LOG_WARNING, "Pool %d stratum share submission failure",
+					pool->pool_no);
+			total_ro++;
+			pool->remotefail_occasions++;
+		}
+
+		/* Put back, in order, those not answered or cleared meanwhile, to
+		 * be retried on the next tick if the session still matches */
+		mutex_lock(&sshare_lock);
+		for (i = count - 1; i >= 0; i--) {
+			HASH_FIND_INT(stratum_shares, &ids[i], sshare);
+			if (!sshare || !sshare->sent)
+				continue;
+			sshare->sent = false;
+			sshare->retry = true;
+			pool->sshares_sent--;
+			list_move(&sshare->sq_node, &pool->sshare_pending);
+		}
+		mutex_unlock(&sshare_lock);
+	}
+	free(buf);
+	free(ids);
+}
+
+/* Put the shares that have timed out since the last tick back at the head of
+ * their pool's pending list to be resubmitted. Must be called under
+ * sshare_lock */
+static void __sshare_expire(time_t last, time_t now) {
+	struct stratum_share *sshare, *tmp;
+	time_t t;
+
+	if (now - last > SSHARE_WHEEL_SLOTS)
+		last = now - SSHARE_WHEEL_SLOTS;
+
+	for (t = last + 1; t <= now; t++) {
+		struct list_head *bucket = &sshare_wheel[t % SSHARE_WHEEL_SLOTS];
+
+		list_for_each_entry_safe(sshare, tmp, bucket, sq_node) {
+			struct pool *pool = sshare->work->pool;
+
+			if (sshare->expires > now)
+				continue;
+			applog(LOG_INFO, "No response to share %d from pool %d, resubmitting",
+					sshare->id, pool->pool_no);
+			sshare->sent = false;
+			sshare->retry = true;
+			pool->sshares_sent--;
+			list_move(&sshare->sq_node, &pool->sshare_pending);
+		}
+	}
+}
+
+/* Untrack onto discard the pool's pending shares that can't be sent: any
+ * more than 2 minutes old and any being retried whose session is no longer
+ * the pool's. Must be called under sshare_lock */
+static void __sshare_prune(struct pool *pool, const char *nonce1,
+		time_t now, struct list_head *discard) {
+	struct stratum_share *sshare, *tmp;
+
+	list_for_each_entry_safe(sshare, tmp, &pool->sshare_pending, sq_node) {
+		if (now < sshare->sshare_time + 120 && (!sshare->retry ||
+				(nonce1 && !strcmp(sshare->work->nonce1, nonce1))))
+			continue;
+		__sshare_untrack(pool, sshare);
+		list_add_tail(&sshare->sq_node, discard);
+	}
+}
+
+static void *stratum_submit_thread(void __maybe_unused *userdata) {
+	struct timeval now, last;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("stratum_submit");
+
+	cgtime(&last);
+	while (42) {
+		struct timespec abstime;
+		int i;
+
+		cgtime(&now);
+		abstime.tv_sec = now.tv_sec + 1;
+		abstime.tv_nsec = now.tv_usec * 1000;
+		mutex_lock(&sshare_lock);
+		pthread_cond_timedwait(&sshare_cond, &sshare_lock, &abstime);
+		cgtime(&now);
+		if (now.tv_sec != last.tv_sec) {
+			__sshare_expire(last.tv_sec, now.tv_sec);
+			copy_time(&last, &now);
+		}
+		mutex_unlock(&sshare_lock);
+
+		for (i = 0; i < total_pools; i++) {
+			struct pool *pool = pools[i];
+			struct stratum_share *sshare, *tmp;
+			struct list_head discard;
+			char *nonce1 = NULL;
+
+			/* Compare against a copy so data_lock isn't nested */
+			cg_rlock(&pool->data_lock);
+			if (pool->nonce1)
+				nonce1 = strdup(pool->nonce1);
+			cg_runlock(&pool->data_lock);
+
+			INIT_LIST_HEAD(&discard);
+			mutex_lock(&sshare_lock);
+			__sshare_prune(pool, nonce1, now.tv_sec, &discard);
+			mutex_unlock(&sshare_lock);
+			free(nonce1);
+
+			list_for_each_entry_safe(sshare, tmp, &discard, sq_node) {
+				if (now.tv_sec >= sshare->sshare_time + 120)
+					sshare_discard(sshare, "Failed to submit stratum share");
+				else
+					sshare_discard(sshare, "No matching session id for resubmitting stratum share");
+			}
+
+			stratum_flush(pool);
+		}
+	}
+
+	return NULL ;
+}
+
 static void *submit_work_thread(void *userdata) {
 	struct work *work = (struct work *) userdata;
 	struct pool *pool = work->pool;
@@ -3260,93 +3841,18 @@ static void *submit_work_thread(void *userdata) {
 	}
 
 	if (work->stratum) {
-		struct stratum_share *sshare = calloc(sizeof(struct stratum_share), 1);
-		uint32_t *hash32 = (uint32_t *) work->hash, nonce;
-		bool submitted = false;
-		char *noncehex;
-		char s[1024];
-
-		sshare->sshare_time = time(NULL );
-		/* This work item is freed in parse_stratum_response */
-		sshare->work = work;
-		nonce = *((uint32_t *) (work->data + 76));
-		noncehex = bin2hex((const unsigned char *) &nonce, 4);
-		memset(s, 0, 1024);
-
-		mutex_lock(&sshare_lock);
-		/* Give the stratum share a unique id */
-		sshare->id = swork_id++;
-		mutex_unlock(&sshare_lock);
+		stratum_submit(work);
+		goto out;
+	}
 
-		sprintf(s,
-				"{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-				pool->rpc_user, work->job_id, work->nonce2, work->ntime,
-				noncehex, sshare->id);
-		free(noncehex);
-
-		applog(LOG_INFO, "Submitting share %08lx to pool %d", htole32(hash32[6]),pool->pool_no);
-
-		/* Try resubmitting for up to 2 minutes if we fail to submit
-		 * once and the stratum pool nonce1 still matches suggesting
-		 * we may be able to resume. */
-		while (time(NULL ) < sshare->sshare_time + 120) {
-			bool sessionid_match;
-
-			if (likely(stratum_send(pool, s, strlen(s)))) {
-				if (pool_tclear(pool, &pool->submit_fail))
-					applog(LOG_WARNING,
-							"Pool %d communication resumed, submitting work",
-							pool->pool_no);
-
-				mutex_lock(&sshare_lock);
-				HASH_ADD_INT(stratum_shares, id, sshare);
-				pool->sshares++;
-				mutex_unlock(&sshare_lock);
-
-				applog(LOG_DEBUG,
-						"Successfully submitted, adding to stratum_shares db");
-				submitted = true;
-				break;
-			}
-			if (!pool_tset(pool, &pool->submit_fail) && cnx_needed(pool)) {
-				applog(LOG_WARNING, "Pool %d stratum share submission failure",
-						pool->pool_no);
-				total_ro++;
-				pool->remotefail_occasions++;
-			}
-
-			cg_rlock(&pool->data_lock);
-			sessionid_match = (pool->nonce1
-					&& !strcmp(work->nonce1, pool->nonce1));
-			cg_runlock(&pool->data_lock);
-
-			if (!sessionid_match) {
-				applog(LOG_DEBUG,
-						"No matching session id for resubmitting stratum share");
-				break;
-			}
-			/* Retry every 5 seconds */
-			sleep(5);
-		}
-
-		if (unlikely(!submitted)) {
-			applog(LOG_DEBUG, "Failed to submit stratum share, discarding");
-			free_work(work);
-			free(sshare);
-			pool->stale_shares++;
-			total_stale++;
-		}
-		goto out;
-	}
-
-	ce = pop_curl_entry(pool);
-	/* submit solution to bitcoin via JSON-RPC */
-	while (!submit_upstream_work(work, ce->curl, resubmit)) {
-		resubmit = true;
-		if (stale_work(work, true)) {
-			applog(LOG_NOTICE,
-					"Pool %d share became stale while retrying submit, discarding",
-					pool->pool_no);
+	ce = pop_curl_entry(pool);
+	/* submit solution to bitcoin via JSON-RPC */
+	while (!submit_upstream_work(work, ce->curl, resubmit)) {
+		resubmit = true;
+		if (stale_work(work, true)) {
+			applog(LOG_NOTICE,
+					"Pool %d share became stale while retrying submit, discarding",
+					pool->pool_no);
 
 			mutex_lock(&stats_lock);
 			total_stale++;
@@ -3397,6 +3903,19 @@ static bool pool_unusable(struct pool *pool) {
 	return false;
 }
 
+/* Tell any API subscribers the current pool changed */
+static void pool_event(struct pool *pool, struct pool *last_pool) {
+	struct api_data *root = NULL;
+
+	if (!api_subscribers)
+		return;
+
+	root = api_add_int(root, "Pool", &(pool->pool_no), false);
+	root = api_add_escape(root, "URL", pool->rpc_url, false);
+	root = api_add_int(root, "Last Pool", &(last_pool->pool_no), false);
+	api_event("pool", root);
+}
+
 void switch_pools(struct pool *selected) {
 	struct pool *pool, *last_pool;
 	int i, pool_no, next_pool;
@@ -3470,6 +3989,7 @@ void switch_pools(struct pool *selected) {
 				pool->rpc_url);
 		if (pool->has_gbt || pool->has_stratum || opt_fail_only)
 			clear_pool_work(last_pool);
+		pool_event(pool, last_pool);
 	}
 
 	mutex_lock(&lp_lock);
@@ -3559,13 +4079,32 @@ static void restart_threads(void) {
 	mutex_lock(&restart_lock);
 	pthread_cond_broadcast(&restart_cond);
 	mutex_unlock(&restart_lock);
+
+#ifdef USE_FPGA_SERIAL
+	serial_io_restart();
+#endif
+}
+
+/* Tell any API subscribers about a new block on the network */
+static void block_event(struct work *work) {
+	struct api_data *root = NULL;
+
+	if (!api_subscribers)
+		return;
+
+	cg_rlock(&ch_lock);
+	root = api_add_string(root, "Hash", current_fullhash, true);
+	cg_runlock(&ch_lock);
+	root = api_add_int(root, "Pool", &(work->pool->pool_no), false);
+	root = api_add_uint(root, "Network Blocks", &new_blocks, false);
+	root = api_add_diff(root, "Network Difficulty", &current_diff, false);
+	api_event("block", root);
 }
 
-static void set_curblock(char *hexstr, unsigned char *hash) {
+static void set_curblock(unsigned char *hash) {
 	unsigned char hash_swap[32];
 	unsigned char block_hash_swap[32];
 
-	strcpy(current_block, hexstr);
 	swap256(hash_swap, hash);
 	swap256(block_hash_swap, hash + 4);
 
@@ -3581,31 +4120,28 @@ static void set_curblock(char *hexstr, unsigned char *hash) {
 	applog(LOG_INFO, "New block: %s... diff %s", current_hash, block_diff);
 }
 
-/* Search to see if this string is from a block that has been seen before */
-static bool block_exists(char *hexstr) {
-	struct block *s;
-
-	rd_lock(&blk_lock);
-	HASH_FIND_STR(blocks, hexstr, s);
-	rd_unlock(&blk_lock);
+/* Search to see if this previous block hash has been seen before. Must be
+ * called under blk_lock */
+static bool __block_exists(const unsigned char *prev_hash) {
+	int i;
 
-	if (s)
+	if (!memcmp(prev_hash, current_block, 32))
 		return true;
+	for (i = 0; i < BLOCK_RING; i++) {
+		if (!memcmp(prev_hash, block_ring[i], 32))
+			return true;
+	}
 	return false;
 }
 
-/* Tests if this work is from a block that has been seen before */
-static inline bool from_existing_block(struct work *work) {
-	char *hexstr = bin2hex(work->data + 8, 18);
+static bool block_exists(const unsigned char *prev_hash) {
 	bool ret;
 
-	ret = block_exists(hexstr);
-	free(hexstr);
-	return ret;
-}
+	rd_lock(&blk_lock);
+	ret = __block_exists(prev_hash);
+	rd_unlock(&blk_lock);
 
-static int block_sort(struct block *blocka, struct block *blockb) {
-	return blocka->block_no - blockb->block_no;
+	return ret;
 }
 
 static void set_blockdiff(const struct work *work) {
@@ -3655,51 +4191,41 @@ static void set_blockdiff(const struct work *work) {
 }
 
 static bool test_work_current(struct work *work) {
+	static const unsigned char dud_hash[32];
+	unsigned char *prev_hash = work->data + 4;
 	bool ret = true;
-	char *hexstr;
 
 	if (work->mandatory)
 		return ret;
 
 	/* Hack to work around dud work sneaking into test */
-	hexstr = bin2hex(work->data + 8, 18);
-	if (!strncmp(hexstr, "000000000000000000000000000000000000", 36))
-		goto out_free;
+	if (!memcmp(prev_hash, dud_hash, 32))
+		return ret;
 
 	/* Search to see if this block exists yet and if not, consider it a
 	 * new block and set the current block details to this one */
-	if (!block_exists(hexstr)) {
-		struct block *s = calloc(sizeof(struct block), 1);
-		int deleted_block = 0;
-		ret = false;
-
-		if (unlikely(!s))
-			quit(1, "test_work_current OOM");
-		strcpy(s->hash, hexstr);
-		s->block_no = new_blocks++;
-
+	if (!block_exists(prev_hash)) {
 		wr_lock(&blk_lock);
-		/* Only keep the last hour's worth of blocks in memory since
-		 * work from blocks before this is virtually impossible and we
-		 * want to prevent memory usage from continually rising */
-		if (HASH_COUNT(blocks) > 6) {
-			struct block *oldblock;
-
-			HASH_SORT(blocks, block_sort);
-			oldblock = blocks;
-			deleted_block = oldblock->block_no;
-			HASH_DEL(blocks, oldblock);
-			free(oldblock);
-		}
-		HASH_ADD_STR(blocks, hash, s);
+		/* Another thread may have got here first with the same block */
+		if (__block_exists(prev_hash)) {
+			wr_unlock(&blk_lock);
+			goto out;
+		}
+		ret = false;
+		new_blocks++;
+		/* Only keep the last hour's worth of blocks since work from
+		 * blocks before this is virtually impossible */
+		memcpy(block_ring[block_ring_next], current_block, 32);
+		block_ring_next = (block_ring_next + 1) % BLOCK_RING;
+		memcpy(current_block, prev_hash, 32);
 		set_blockdiff(work);
 		wr_unlock(&blk_lock);
 
-		if (deleted_block)
-			applog(LOG_DEBUG, "Deleted block %d from database", deleted_block);
-		set_curblock(hexstr, work->data);
+		set_curblock(work->data);
 		if (unlikely(new_blocks == 1))
-			goto out_free;
+			return ret;
+
+		block_event(work);
 
 		work->work_block = ++work_block;
 
@@ -3722,8 +4248,8 @@ static bool test_work_current(struct work *work) {
 			restart_threads();
 		}
 	}
+out:
 	work->longpoll = false;
-	out_free: free(hexstr);
 	return ret;
 }
 
@@ -4692,7 +5218,7 @@ static void hashmeter(int thr_id, struct timeval *diff, uint64_t hashes_done) {
 }
 
 static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
-		struct stratum_share *sshare) {
+		struct stratum_share *sshare, double rtt) {
 	struct work *work = sshare->work;
 	char hashshow[65];
 	uint32_t *hash32;
@@ -4704,7 +5230,7 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 	suffix_string(work->share_diff, diffdisp, 0);
 	sprintf(hashshow, "%08lx Diff %s/%d%s", (unsigned long) htole32(hash32[6]),diffdisp, intdiff,
 		work->block? " BLOCK!" : "");
-	share_result(val, res_val, err_val, work, hashshow, false, "");
+	share_result(val, res_val, err_val, work, hashshow, false, "", rtt);
 }
 
 /* Parses stratum json responses and tries to find the id that the request
@@ -4712,10 +5238,20 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 static bool parse_stratum_response(struct pool *pool, char *s) {
 	json_t *val = NULL, *err_val, *res_val, *id_val;
 	struct stratum_share *sshare;
+	struct timeval tv_reply;
 	json_error_t err;
 	bool ret = false;
+	double rtt = -1;
 	int id;
 
+	/* Accepted shares need nothing more than their id so skip building a
+	 * json tree for them */
+	if (stratum_result_accepted(s, &id)) {
+		res_val = json_true();
+		err_val = json_null();
+		goto found;
+	}
+
 	val = JSON_LOADS(s, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
@@ -4742,12 +5278,19 @@ static bool parse_stratum_response(struct pool *pool, char *s) {
 	}
 
 	id = json_integer_value(id_val);
+	found:
 
 	mutex_lock(&sshare_lock);
 	HASH_FIND_INT(stratum_shares, &id, sshare);
 	if (sshare) {
-		HASH_DEL(stratum_shares, sshare);
-		pool->sshares--;
+		if (sshare->sent) {
+			cgtime(&tv_reply);
+			rtt = tdiff(&tv_reply, &sshare->tv_sent);
+		}
+		__sshare_untrack(pool, sshare);
+		/* A slot in the window just came free */
+		if (!list_empty(&pool->sshare_pending))
+			pthread_cond_signal(&sshare_cond);
 	}
 	mutex_unlock(&sshare_lock);
 
@@ -4760,9 +5303,19 @@ static bool parse_stratum_response(struct pool *pool, char *s) {
 					pool->pool_no);
 		goto out;
 	}
-	stratum_share_result(val, res_val, err_val, sshare);
-	free_work(sshare->work);
-	free(sshare);
+	if (rtt >= 0) {
+		struct cgminer_pool_stats *pool_stats = &pool->cgminer_pool_stats;
+
+		pool_stats->submit_rtt = rtt;
+		if (rtt > pool_stats->submit_rtt_max)
+			pool_stats->submit_rtt_max = rtt;
+		pool_stats->submit_rtt_rolling += rtt * 0.63;
+		pool_stats->submit_rtt_rolling /= 1.63;
+		applog(LOG_DEBUG, "Pool %d share %d response in %.0fms",
+				pool->pool_no, id, rtt * 1000);
+	}
+	stratum_share_result(val, res_val, err_val, sshare, rtt);
+	free_sshare(sshare);
 
 	ret = true;
 	out: if (val)
@@ -4780,11 +5333,9 @@ void clear_stratum_shares(struct pool *pool) {
 	HASH_ITER(hh, stratum_shares, sshare, tmpshare)
 	{
 		if (sshare->work->pool == pool) {
-			HASH_DEL(stratum_shares, sshare);
+			__sshare_untrack(pool, sshare);
 			diff_cleared += sshare->work->work_difficulty;
-			free_work(sshare->work);
-			pool->sshares--;
-			free(sshare);
+			free_sshare(sshare);
 			cleared++;
 		}
 	}
@@ -4866,6 +5417,9 @@ static bool cnx_needed(struct pool *pool) {
 static void wait_lpcurrent(struct pool *pool);
 static void pool_resus(struct pool *pool);
 static void gen_stratum_work(struct pool *pool, struct work *work);
+#ifdef HAVE_SYS_EPOLL_H
+static void sserver_update(struct pool *pool);
+#endif
 
 static void stratum_resumed(struct pool *pool) {
 	if (!pool->stratum_notify)
@@ -4887,6 +5441,41 @@ static bool supports_resume(struct pool *pool) {
 	return ret;
 }
 
+/* Handle a single line received from a stratum pool */
+static void stratum_line(struct pool *pool, char *s) {
+	/* Check this pool hasn't died while being a backup pool and
+	 * has not had its idle flag cleared */
+	stratum_resumed(pool);
+
+	if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
+		applog(LOG_INFO, "Unknown stratum msg: %s", s);
+#ifdef HAVE_SYS_EPOLL_H
+	sserver_update(pool);
+#endif
+	if (pool->swork.clean) {
+		struct work *work = make_work();
+
+		/* Generate a single work item to update the current
+		 * block database */
+		pool->swork.clean = false;
+		gen_stratum_work(pool, work);
+		if (test_work_current(work)) {
+			/* Only accept a work restart if this stratum
+			 * connection is from the current pool */
+			if (pool == current_pool()) {
+				restart_threads();
+				applog(LOG_NOTICE,
+						"Stratum from pool %d requested work restart",
+						pool->pool_no);
+			}
+		} else
+			applog(LOG_NOTICE, "Stratum from pool %d detected new block",
+					pool->pool_no);
+		free_work(work);
+	}
+}
+
+#ifndef HAVE_SYS_EPOLL_H
 /* One stratum thread per pool that has stratum waits on the socket checking
  * for new messages and for the integrity of the socket connection. We reset
  * the connection based on the integrity of the receive side only as the send
@@ -4973,43 +5562,275 @@ static void *stratum_thread(void *userdata) {
 			continue;
 		}
 
-		/* Check this pool hasn't died while being a backup pool and
-		 * has not had its idle flag cleared */
-		stratum_resumed(pool);
+		stratum_line(pool, s);
+	}
+
+	out: return NULL ;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Instead of one stratum thread per pool, a single network thread waits on
+ * the sockets of every connected stratum pool with epoll and dispatches each
+ * line received to stratum_line. Establishing a connection goes through curl
+ * and blocks, so (re)connects are handed to a small set of connect threads
+ * and a pool that is timing out never delays messages from the others.
+ * Failed connects are retried with an exponential backoff.
+ *
+ * A pool is owned by exactly one of: the event loop while its socket is
+ * polled, the connect threads while stratum_queued is set, or the loop's
+ * timer while it is parked or waiting out its backoff. */
+#define STRATUM_CNX_THREADS 4
+#define STRATUM_BACKOFF_MAX 30
+#define STRATUM_EVENTS 64
+
+static int stratum_epfd = -1;
+static struct thread_q *stratum_cnxq;
+static pthread_mutex_t stratum_loop_lock;
+static bool stratum_loop_started;
+
+static void stratum_poll_add(struct pool *pool) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = pool;
+	cgtime(&pool->tv_stratum_rx);
+	pool->polled_sock = pool->sock;
+	pool->stratum_polled = true;
+	if (unlikely(epoll_ctl(stratum_epfd, EPOLL_CTL_ADD, pool->sock, &ev)))
+		applog(LOG_ERR, "Failed to add pool %d socket to stratum epoll: %s",
+				pool->pool_no, strerror(errno));
+}
+
+static void stratum_poll_del(struct pool *pool) {
+	struct epoll_event ev;
+
+	if (!pool->stratum_polled)
+		return;
+	pool->stratum_polled = false;
+	/* The socket may already be closed and hence gone from the set */
+	epoll_ctl(stratum_epfd, EPOLL_CTL_DEL, pool->polled_sock, &ev);
+}
+
+/* Hand the pool over to the connect threads */
+static void stratum_queue_cnx(struct pool *pool) {
+	stratum_poll_del(pool);
+	pool_tset(pool, &pool->stratum_queued);
+	tq_push(stratum_cnxq, pool);
+}
+
+/* The receive side of the connection to the pool has gone */
+static void stratum_lost(struct pool *pool) {
+	applog(LOG_NOTICE, "Stratum connection to pool %d interrupted",
+			pool->pool_no);
+	pool->getfail_occasions++;
+	total_go++;
+
+	stratum_poll_del(pool);
+	/* If the socket to our stratum pool disconnects, all tracked
+	 * submitted shares are lost and we will leak the memory if we don't
+	 * discard their records. */
+	if (!supports_resume(pool))
+		clear_stratum_shares(pool);
+	clear_pool_work(pool);
+	if (pool == current_pool())
+		restart_threads();
 
-		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
-			applog(LOG_INFO, "Unknown stratum msg: %s", s);
-		free(s);
-		if (pool->swork.clean) {
-			struct work *work = make_work();
+	pool->stratum_backoff = 0;
+	stratum_queue_cnx(pool);
+}
 
-			/* Generate a single work item to update the current
-			 * block database */
-			pool->swork.clean = false;
-			gen_stratum_work(pool, work);
-			if (test_work_current(work)) {
-				/* Only accept a work restart if this stratum
-				 * connection is from the current pool */
-				if (pool == current_pool()) {
-					restart_threads();
-					applog(LOG_NOTICE,
-							"Stratum from pool %d requested work restart",
-							pool->pool_no);
-				}
-			} else
-				applog(LOG_NOTICE, "Stratum from pool %d detected new block",
-						pool->pool_no);
-			free_work(work);
+/* Dispatch every complete line buffered for the pool, following the socket
+ * across any reconnect a client.reconnect message caused. */
+static void stratum_drain(struct pool *pool) {
+	char *s;
+
+	while (pool->stratum_polled && (s = buffered_line(pool))) {
+		cgtime(&pool->tv_stratum_rx);
+		stratum_line(pool, s);
+		if (!pool->stratum_active) {
+			stratum_lost(pool);
+			return;
+		}
+		if (pool->sock != pool->polled_sock) {
+			stratum_poll_del(pool);
+			stratum_poll_add(pool);
 		}
 	}
+}
 
-	out: return NULL ;
+/* Timer side of the loop, run for every pool about once a second */
+static void stratum_tick(struct pool *pool, struct timeval *now) {
+	if (!pool->has_stratum || !pool->stratum_init || pool->stratum_queued)
+		return;
+
+	if (unlikely(pool->removed)) {
+		if (pool->stratum_polled) {
+			stratum_poll_del(pool);
+			suspend_stratum(pool);
+		}
+		return;
+	}
+
+	if (pool->stratum_polled) {
+		stratum_drain(pool);
+		if (!pool->stratum_polled)
+			return;
+
+		/* Check to see whether we need to maintain this connection
+		 * indefinitely or just bring it up when we switch to this
+		 * pool */
+		if (!cnx_needed(pool)
+				&& pool->sockbuf_end == pool->sockbuf_start) {
+			stratum_poll_del(pool);
+			suspend_stratum(pool);
+			clear_stratum_shares(pool);
+			clear_pool_work(pool);
+			pool->stratum_parked = true;
+			return;
+		}
+
+		/* The protocol specifies that notify messages should be sent
+		 * every minute so if we fail to receive any for 90 seconds we
+		 * assume the connection has been dropped and treat this pool
+		 * as dead */
+		if (tdiff(now, &pool->tv_stratum_rx) > 90)
+			stratum_lost(pool);
+		return;
+	}
+
+	if (pool->stratum_parked) {
+		if (cnx_needed(pool) || pool == current_pool()) {
+			pool->stratum_parked = false;
+			pool->stratum_backoff = 0;
+			stratum_queue_cnx(pool);
+		}
+		return;
+	}
+
+	if (!time_less(now, &pool->tv_stratum_retry))
+		stratum_queue_cnx(pool);
+}
+
+static void *stratum_cnx_thread(void __maybe_unused *userdata) {
+	pthread_detach(pthread_self());
+
+	RenameThread("stratum_cnx");
+
+	while (42) {
+		struct pool *pool = tq_pop(stratum_cnxq, NULL );
+
+		if (unlikely(!pool))
+			continue;
+
+		if (pool->removed) {
+			pool_tclear(pool, &pool->stratum_queued);
+			continue;
+		}
+
+		if (restart_stratum(pool)) {
+			pool->stratum_backoff = 0;
+			stratum_resumed(pool);
+			stratum_poll_add(pool);
+		} else {
+			struct timeval backoff;
+
+			pool_died(pool);
+			if (pool->stratum_backoff < 1)
+				pool->stratum_backoff = 1;
+			else if ((pool->stratum_backoff *= 2) > STRATUM_BACKOFF_MAX)
+				pool->stratum_backoff = STRATUM_BACKOFF_MAX;
+			applog(LOG_DEBUG, "Retrying stratum pool %d in %d seconds",
+					pool->pool_no, pool->stratum_backoff);
+			cgtime(&pool->tv_stratum_retry);
+			backoff.tv_sec = pool->stratum_backoff;
+			backoff.tv_usec = 0;
+			addtime(&backoff, &pool->tv_stratum_retry);
+		}
+		pool_tclear(pool, &pool->stratum_queued);
+	}
+
+	return NULL ;
+}
+
+static void *stratum_loop_thread(void __maybe_unused *userdata) {
+	struct epoll_event events[STRATUM_EVENTS];
+	struct timeval now, last_tick;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("stratum");
+
+	cgtime(&last_tick);
+	while (42) {
+		int i, n;
+
+		n = epoll_wait(stratum_epfd, events, STRATUM_EVENTS, 1000);
+		if (unlikely(n < 0 && errno != EINTR)) {
+			applog(LOG_ERR, "Stratum epoll_wait failed: %s", strerror(errno));
+			nmsleep(1000);
+		}
+
+		for (i = 0; i < n; i++) {
+			struct pool *pool = events[i].data.ptr;
+
+			if (!pool->stratum_polled)
+				continue;
+			if (!recv_sock(pool)) {
+				stratum_lost(pool);
+				continue;
+			}
+			stratum_drain(pool);
+		}
+
+		cgtime(&now);
+		if (n > 0 && tdiff(&now, &last_tick) < 1)
+			continue;
+		copy_time(&last_tick, &now);
+		for (i = 0; i < total_pools; i++)
+			stratum_tick(pools[i], &now);
+	}
+
+	return NULL ;
+}
+
+static void stratum_loop_start(void) {
+	pthread_t pth;
+	int i;
+
+	mutex_lock(&stratum_loop_lock);
+	if (stratum_loop_started)
+		goto out;
+
+	stratum_epfd = epoll_create(STRATUM_EVENTS);
+	if (unlikely(stratum_epfd < 0))
+		quit(1, "Failed to epoll_create for stratum");
+	stratum_cnxq = tq_new();
+	if (unlikely(!stratum_cnxq))
+		quit(1, "Failed to tq_new stratum_cnxq");
+
+	for (i = 0; i < STRATUM_CNX_THREADS; i++) {
+		if (unlikely(pthread_create(&pth, NULL, stratum_cnx_thread, NULL)))
+			quit(1, "Failed to create stratum connect thread");
+	}
+	if (unlikely(pthread_create(&pth, NULL, stratum_loop_thread, NULL)))
+		quit(1, "Failed to create stratum thread");
+	stratum_loop_started = true;
+out:
+	mutex_unlock(&stratum_loop_lock);
 }
 
+static void init_stratum_thread(struct pool *pool) {
+	stratum_loop_start();
+	stratum_poll_add(pool);
+}
+#else /* HAVE_SYS_EPOLL_H */
 static void init_stratum_thread(struct pool *pool) {
 	if (unlikely(pthread_create(&pool->stratum_thread, NULL, stratum_thread, (void *)pool)))
 		quit(1, "Failed to create stratum thread");
 }
+#endif /* HAVE_SYS_EPOLL_H */
 
 static void *longpoll_thread(void *userdata);
 
@@ -5337,22 +6158,43 @@ static void set_work_target(struct work *work, double diff) {
 	memcpy(work->target, target, 32);
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+/* Bytes at the front of a pool's extranonce2 given over to the prefixes that
+ * tell downstream stratum server clients apart */
+static int sserver_prefix_len(int n2size) {
+	return n2size >= 4 ? 2 : n2size / 2;
+}
+#endif
+
 /* Generates stratum based work based on the most recent notify information
  * from the pool. This will keep generating work while a pool is down so we use
  * other means to detect when the pool has died in stratum_thread */
 static void gen_stratum_work(struct pool *pool, struct work *work) {
-	unsigned char *coinbase, merkle_root[32], merkle_sha[64];
-	char *header, *merkle_hash;
-	uint32_t *data32, *swap32;
+	unsigned char *coinbase, *nonce2bin, merkle_root[32];
+	int i, prefix_len = 0;
 	size_t alloc_len;
-	int i;
+	uint32_t nonce2;
 
 	/* Use intermediate lock to update the one pool variable */
 	cg_ilock(&pool->data_lock);
 
 	/* Generate coinbase */
-	work->nonce2 = bin2hex((const unsigned char *) &pool->nonce2, pool->n2size);
-	pool->nonce2++;
+	nonce2 = pool->nonce2++;
+#ifdef HAVE_SYS_EPOLL_H
+	/* Extranonce2 values with a zero prefix are ours when serving
+	 * downstream miners from this pool */
+	if (opt_sserver_port)
+		prefix_len = sserver_prefix_len(pool->n2size);
+#endif
+	/* The counter goes little endian after the prefix, zero padded out
+	 * to whatever extranonce2 size the pool asked for */
+	nonce2bin = calloc(pool->n2size, 1);
+	if (unlikely(!nonce2bin))
+		quit(1, "Failed to calloc nonce2bin in gen_stratum_work");
+	for (i = 0; i < 4 && prefix_len + i < pool->n2size; i++)
+		nonce2bin[prefix_len + i] = nonce2 >> (8 * i);
+	work->nonce2 = bin2hex(nonce2bin, pool->n2size);
+	free(nonce2bin);
 
 	/* Downgrade to a read lock to read off the pool variables */
 	cg_dlock(&pool->data_lock);
@@ -5361,37 +6203,20 @@ static void gen_stratum_work(struct pool *pool, struct work *work) {
 	coinbase = calloc(alloc_len, 1);
 	if (unlikely(!coinbase))
 		quit(1, "Failed to calloc coinbase in gen_stratum_work");
-	hex2bin(coinbase, pool->swork.coinbase1, pool->swork.cb1_len);
+	memcpy(coinbase, pool->swork.coinbase, pool->swork.cb1_len);
 	hex2bin(coinbase + pool->swork.cb1_len, pool->nonce1, pool->n1_len);
 	hex2bin(coinbase + pool->swork.cb1_len + pool->n1_len, work->nonce2,
 			pool->n2size);
-	hex2bin(coinbase + pool->swork.cb1_len + pool->n1_len + pool->n2size,
-			pool->swork.coinbase2, pool->swork.cb2_len);
+	memcpy(coinbase + pool->swork.cb1_len + pool->n1_len + pool->n2size,
+			pool->swork.coinbase + pool->swork.cb1_len, pool->swork.cb2_len);
 
-	/* Generate merkle root */
-	gen_hash(coinbase, merkle_root, pool->swork.cb_len);
+	gen_merkle_root(coinbase, pool->swork.cb_len, pool->swork.merkle_bin[0],
+			pool->swork.merkles, merkle_root);
 	free(coinbase);
-	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < pool->swork.merkles; i++) {
-		unsigned char merkle_bin[32];
 
-		hex2bin(merkle_bin, pool->swork.merkle[i], 32);
-		memcpy(merkle_sha + 32, merkle_bin, 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
-	data32 = (uint32_t *) merkle_sha;
-	swap32 = (uint32_t *) merkle_root;
-	flip32(swap32, data32);
-	merkle_hash = bin2hex((const unsigned char *) merkle_root, 32);
-
-	header = calloc(pool->swork.header_len, 1);
-	if (unlikely(!header))
-		quit(1, "Failed to calloc header in gen_stratum_work");
-	sprintf(header, "%s%s%s%s%s%s%s", pool->swork.bbversion,
-			pool->swork.prev_hash, merkle_hash, pool->swork.ntime,
-			pool->swork.nbit, "00000000", /* nonce */
-			workpadding);
+	/* The header template already holds everything but the merkle root */
+	memcpy(work->data, pool->swork.header_bin, 128);
+	memcpy(work->data + 4 + 32, merkle_root, 32);
 
 	/* Store the stratum work diff to check it still matches the pool's
 	 * stratum diff when submitting shares */
@@ -5403,17 +6228,19 @@ static void gen_stratum_work(struct pool *pool, struct work *work) {
 	work->ntime = strdup(pool->swork.ntime);
 	cg_runlock(&pool->data_lock);
 
-	applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
-	applog(LOG_DEBUG, "Generated stratum header %s", header);
-	applog(LOG_DEBUG, "Work job_id %s nonce2 %s ntime %s", work->job_id,
-			work->nonce2, work->ntime);
-
-	free(merkle_hash);
+	if (opt_debug) {
+		char *merkle_hash, *header;
+
+		merkle_hash = bin2hex((const unsigned char *) merkle_root, 32);
+		header = bin2hex(work->data, 128);
+		applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
+		applog(LOG_DEBUG, "Generated stratum header %s", header);
+		applog(LOG_DEBUG, "Work job_id %s nonce2 %s ntime %s", work->job_id,
+				work->nonce2, work->ntime);
+		free(header);
+		free(merkle_hash);
+	}
 
-	/* Convert hex data to binary data for work */
-	if (unlikely(!hex2bin(work->data, header, 128)))
-		quit(1, "Failed to convert header to data in gen_stratum_work");
-	free(header);
 	calc_midstate(work);
 
 	set_work_target(work, work->sdiff);
@@ -5467,6 +6294,652 @@ void submit_work_async(struct work *work_in, struct timeval *tv_work_found) {
 		quit(1, "Failed to create submit_work_thread");
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+/* The stratum server hands out work from the current stratum pool to
+ * downstream miners over our one connection to it. Each client is given the
+ * pool's extranonce1 with its own prefix from the front of the pool's
+ * extranonce2 space appended, prefix 0 being kept for our own devices, so
+ * their work never overlaps. Jobs are passed on as the pool sends them and
+ * shares are hashed here, with only those meeting the pool's difficulty
+ * submitted upstream as if we had found them. */
+#define SSERVER_JOBS 8
+#define SSERVER_BUFSIZE 4096
+#define SSERVER_EVENTS 64
+/* How far past the job's ntime a client may roll it, as pools allow */
+#define SSERVER_NTIME_ROLL 7000
+
+/* A share accepted for a job, keyed by its full nonce2, ntime and nonce in
+ * hex, so a client sending it again is refused rather than passed on for
+ * the pool to reject as a duplicate */
+struct sserver_share {
+	char *key;
+	UT_hash_handle hh;
+};
+
+struct sserver_job {
+	char *job_id;
+	char *notify[2]; /* The mining.notify line, indexed by clean flag */
+	unsigned char *coinbase;
+	size_t cb1_len;
+	size_t cb2_len;
+	int merkles;
+	unsigned char merkle_bin[STRATUM_MAX_MERKLES][32];
+	unsigned char header_bin[128];
+	double diff;
+	struct sserver_share *shares;
+};
+
+struct sserver_client {
+	struct list_head list;
+	int fd;
+	int id;
+	uint32_t prefix;
+	bool subscribed;
+	bool dead;
+	double diff;
+	int accepted, rejected, forwarded;
+	size_t buflen;
+	char buf[SSERVER_BUFSIZE];
+};
+
+static pthread_mutex_t sserver_lock;
+static LIST_HEAD(sserver_clients);
+static int sserver_epfd = -1;
+static int sserver_clientno;
+static uint32_t sserver_next_prefix;
+
+/* The pool session clients are currently bound to */
+static struct pool *sserver_pool;
+static char *sserver_nonce1;
+static size_t sserver_n1_len;
+static int sserver_n2size;
+static struct sserver_job sserver_jobs[SSERVER_JOBS];
+static int sserver_job_next;
+
+static void sserver_send(struct sserver_client *client, const char *s) {
+	size_t len = strlen(s);
+
+	if (client->dead)
+		return;
+	/* Clients too slow to take a whole line are dropped rather than
+	 * holding up every other client */
+	if (send(client->fd, s, len, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t) len) {
+		applog(LOG_INFO, "Stratum server client %d failed to take data",
+				client->id);
+		client->dead = true;
+	}
+}
+
+static void sserver_reply(struct sserver_client *client, json_t *id_val,
+		const char *result, int errno_, const char *errmsg) {
+	char *id = NULL, s[512];
+
+	if (id_val)
+		id = json_dumps(id_val, JSON_ENCODE_ANY);
+	if (errmsg)
+		snprintf(s, sizeof(s), "{\"id\": %s, \"result\": null, \"error\": [%d, \"%s\", null]}\n",
+				id ? id : "null", errno_, errmsg);
+	else
+		snprintf(s, sizeof(s), "{\"id\": %s, \"result\": %s, \"error\": null}\n",
+				id ? id : "null", result);
+	free(id);
+	sserver_send(client, s);
+}
+
+static void sserver_set_diff(struct sserver_client *client, double diff) {
+	char s[128];
+
+	client->diff = diff;
+	snprintf(s, sizeof(s), "{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [%f]}\n",
+			diff);
+	sserver_send(client, s);
+}
+
+static double sserver_client_diff(const struct sserver_job *job) {
+	return opt_sserver_diff < job->diff ? opt_sserver_diff : job->diff;
+}
+
+static void sserver_drop(struct sserver_client *client) {
+	struct epoll_event ev;
+
+	epoll_ctl(sserver_epfd, EPOLL_CTL_DEL, client->fd, &ev);
+	close(client->fd);
+	list_del(&client->list);
+	applog(LOG_INFO, "Stratum server client %d disconnected, A:%d R:%d forwarded:%d",
+			client->id, client->accepted, client->rejected, client->forwarded);
+	free(client);
+}
+
+static void sserver_free_job(struct sserver_job *job) {
+	struct sserver_share *share, *tmp;
+
+	HASH_ITER(hh, job->shares, share, tmp) {
+		HASH_DEL(job->shares, share);
+		free(share->key);
+		free(share);
+	}
+	free(job->job_id);
+	free(job->notify[0]);
+	free(job->notify[1]);
+	free(job->coinbase);
+	memset(job, 0, sizeof(struct sserver_job));
+}
+
+/* Must be called under sserver_lock */
+static struct sserver_job *__sserver_newest_job(void) {
+	struct sserver_job *job;
+
+	job = &sserver_jobs[(sserver_job_next + SSERVER_JOBS - 1) % SSERVER_JOBS];
+	return job->job_id ? job : NULL;
+}
+
+/* Drop every client and job, must be called under sserver_lock. Clients are
+ * only marked dead here as the server thread may hold events for them. */
+static void __sserver_unbind(void) {
+	struct sserver_client *client;
+	int i;
+
+	list_for_each_entry(client, &sserver_clients, list) {
+		client->subscribed = false;
+		client->dead = true;
+	}
+	for (i = 0; i < SSERVER_JOBS; i++)
+		sserver_free_job(&sserver_jobs[i]);
+	free(sserver_nonce1);
+	sserver_nonce1 = NULL;
+	sserver_pool = NULL;
+}
+
+/* Build the mining.notify lines clients are sent for a job. Must be called
+ * under the pool's data_lock */
+static void __sserver_notify(struct sserver_job *job, struct pool *pool) {
+	char *prev_hash, *cb1, *cb2, *bbversion, *nbit, *s, *p;
+	size_t len;
+	int i;
+
+	bbversion = bin2hex(job->header_bin, 4);
+	prev_hash = bin2hex(job->header_bin + 4, 32);
+	nbit = bin2hex(job->header_bin + 4 + 32 + 32 + 4, 4);
+	cb1 = bin2hex(job->coinbase, job->cb1_len);
+	cb2 = bin2hex(job->coinbase + job->cb1_len, job->cb2_len);
+
+	len = strlen(job->job_id) + strlen(cb1) + strlen(cb2) + job->merkles * 68 + 256;
+	s = malloc(len);
+	if (unlikely(!s))
+		quit(1, "Failed to malloc notify in sserver_notify");
+	p = s + sprintf(s, "{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", [",
+			job->job_id, prev_hash, cb1, cb2);
+	for (i = 0; i < job->merkles; i++) {
+		char *merkle = bin2hex(job->merkle_bin[i], 32);
+
+		p += sprintf(p, "%s\"%s\"", i ? ", " : "", merkle);
+		free(merkle);
+	}
+	sprintf(p, "], \"%s\", \"%s\", \"%s\", ", bbversion, nbit, pool->swork.ntime);
+	for (i = 0; i < 2; i++) {
+		job->notify[i] = malloc(strlen(s) + 9);
+		if (unlikely(!job->notify[i]))
+			quit(1, "Failed to malloc notify in sserver_notify");
+		sprintf(job->notify[i], "%s%s]}\n", s, i ? "true" : "false");
+	}
+
+	free(s);
+	free(cb2);
+	free(cb1);
+	free(nbit);
+	free(prev_hash);
+	free(bbversion);
+}
+
+/* Pass on the pool's current job to clients if it has not been already,
+ * rebinding to the pool first if it is no longer the session clients were
+ * given their extranonce from. */
+static void sserver_update(struct pool *pool) {
+	struct sserver_client *client;
+	struct sserver_job *job;
+	bool clean;
+	int i;
+
+	if (!opt_sserver_port || !pool || pool != current_pool() || !pool->has_stratum
+			|| !pool->stratum_active || !pool->stratum_notify || !pool->nonce1
+			|| sserver_prefix_len(pool->n2size) < 1)
+		return;
+
+	mutex_lock(&sserver_lock);
+	cg_rlock(&pool->data_lock);
+	if (pool != sserver_pool || !sserver_nonce1 || strcmp(pool->nonce1, sserver_nonce1)) {
+		if (sserver_pool)
+			applog(LOG_NOTICE, "Stratum server moving to pool %d, dropping clients",
+					pool->pool_no);
+		__sserver_unbind();
+		sserver_pool = pool;
+		sserver_nonce1 = strdup(pool->nonce1);
+		sserver_n1_len = pool->n1_len;
+		sserver_n2size = pool->n2size;
+	}
+	job = __sserver_newest_job();
+	if ((job && !strcmp(job->job_id, pool->swork.job_id))
+			|| strpbrk(pool->swork.job_id, "\"\\")) {
+		cg_runlock(&pool->data_lock);
+		goto out;
+	}
+
+	job = &sserver_jobs[sserver_job_next];
+	sserver_job_next = (sserver_job_next + 1) % SSERVER_JOBS;
+	sserver_free_job(job);
+	job->job_id = strdup(pool->swork.job_id);
+	job->cb1_len = pool->swork.cb1_len;
+	job->cb2_len = pool->swork.cb2_len;
+	job->coinbase = malloc(job->cb1_len + job->cb2_len + 1);
+	if (unlikely(!job->coinbase))
+		quit(1, "Failed to malloc coinbase in sserver_update");
+	memcpy(job->coinbase, pool->swork.coinbase, job->cb1_len + job->cb2_len);
+	job->merkles = pool->swork.merkles;
+	memcpy(job->merkle_bin, pool->swork.merkle_bin, job->merkles * 32);
+	memcpy(job->header_bin, pool->swork.header_bin, 128);
+	job->diff = pool->swork.diff;
+	clean = pool->swork.clean;
+	__sserver_notify(job, pool);
+	cg_runlock(&pool->data_lock);
+
+	/* Shares for older jobs would only be stale upstream */
+	if (clean) {
+		for (i = 0; i < SSERVER_JOBS; i++) {
+			if (&sserver_jobs[i] != job)
+				sserver_free_job(&sserver_jobs[i]);
+		}
+	}
+
+	list_for_each_entry(client, &sserver_clients, list) {
+		if (!client->subscribed)
+			continue;
+		if (client->diff != sserver_client_diff(job))
+			sserver_set_diff(client, sserver_client_diff(job));
+		sserver_send(client, job->notify[clean]);
+	}
+out:
+	mutex_unlock(&sserver_lock);
+}
+
+/* Must be called under sserver_lock */
+static bool __sserver_prefix_used(uint32_t prefix) {
+	struct sserver_client *client;
+
+	list_for_each_entry(client, &sserver_clients, list) {
+		if (client->subscribed && client->prefix == prefix)
+			return true;
+	}
+	return false;
+}
+
+static void sserver_subscribe(struct sserver_client *client, json_t *id_val) {
+	int prefix_len = sserver_prefix_len(sserver_n2size);
+	struct sserver_job *job = __sserver_newest_job();
+	uint32_t prefixes, tries;
+	char *prefix, s[256];
+
+	if (!sserver_pool || !job) {
+		sserver_reply(client, id_val, NULL, 20, "No upstream pool");
+		return;
+	}
+	if (client->subscribed) {
+		sserver_reply(client, id_val, NULL, 20, "Already subscribed");
+		return;
+	}
+
+	/* Prefix 0 is ours */
+	prefixes = (1 << (8 * prefix_len)) - 1;
+	for (tries = 0; tries < prefixes; tries++) {
+		client->prefix = sserver_next_prefix++ % prefixes + 1;
+		if (!__sserver_prefix_used(client->prefix))
+			break;
+	}
+	if (tries == prefixes) {
+		sserver_reply(client, id_val, NULL, 20, "Server full");
+		client->dead = true;
+		return;
+	}
+	client->subscribed = true;
+
+	prefix = bin2hex((const unsigned char *) &client->prefix, prefix_len);
+	snprintf(s, sizeof(s), "[[[\"mining.set_difficulty\", \"%d\"], [\"mining.notify\", \"%d\"]], \"%s%s\", %d]",
+			client->id, client->id, sserver_nonce1, prefix,
+			sserver_n2size - prefix_len);
+	free(prefix);
+	sserver_reply(client, id_val, s, 0, NULL);
+
+	sserver_set_diff(client, sserver_client_diff(job));
+	sserver_send(client, job->notify[1]);
+	applog(LOG_INFO, "Stratum server client %d subscribed with prefix %x",
+			client->id, client->prefix);
+}
+
+static void sserver_forward(struct work *work, struct sserver_job *job,
+		char *nonce2, const char *ntime) {
+	struct timeval tv_found;
+
+	cgtime(&tv_found);
+	work->pool = sserver_pool;
+	work->stratum = true;
+	work->job_id = strdup(job->job_id);
+	work->nonce1 = strdup(sserver_nonce1);
+	work->nonce2 = nonce2;
+	work->ntime = strdup(ntime);
+	work->sdiff = job->diff;
+	work->thr_id = SSERVER_THR_ID;
+	work->id = total_work++;
+	work->getwork_mode = GETWORK_MODE_STRATUM;
+	work->work_block = work_block;
+	calc_diff(work, work->sdiff);
+	copy_time(&work->tv_staged, &tv_found);
+	submit_work_async(work, &tv_found);
+}
+
+/* Rebuild the work the client claims a share for and check it against the
+ * client's and the pool's difficulty */
+static void sserver_submit(struct sserver_client *client, json_t *id_val,
+		json_t *params) {
+	int prefix_len = sserver_prefix_len(sserver_n2size);
+	const char *job_id, *nonce2, *ntime, *nonce;
+	unsigned char *coinbase, merkle_root[32];
+	struct sserver_job *job = NULL;
+	struct sserver_share *share;
+	uint32_t job_ntime, share_ntime;
+	unsigned char hash2[32];
+	char *prefix, *fullnonce2, *key;
+	struct work *work;
+	size_t cb_len;
+	int i;
+
+	job_id = json_string_value(json_array_get(params, 1));
+	nonce2 = json_string_value(json_array_get(params, 2));
+	ntime = json_string_value(json_array_get(params, 3));
+	nonce = json_string_value(json_array_get(params, 4));
+	if (!job_id || !nonce2 || !ntime || !nonce
+			|| strlen(nonce2) != (size_t) (sserver_n2size - prefix_len) * 2
+			|| strlen(ntime) != 8 || strlen(nonce) != 8) {
+		sserver_reply(client, id_val, NULL, 20, "Malformed share");
+		client->rejected++;
+		return;
+	}
+	for (i = 0; i < SSERVER_JOBS; i++) {
+		if (sserver_jobs[i].job_id && !strcmp(sserver_jobs[i].job_id, job_id)) {
+			job = &sserver_jobs[i];
+			break;
+		}
+	}
+	if (!job) {
+		sserver_reply(client, id_val, NULL, 21, "Job not found");
+		client->rejected++;
+		return;
+	}
+
+	prefix = bin2hex((const unsigned char *) &client->prefix, prefix_len);
+	fullnonce2 = malloc(strlen(prefix) + strlen(nonce2) + 1);
+	if (unlikely(!fullnonce2))
+		quit(1, "Failed to malloc nonce2 in sserver_submit");
+	sprintf(fullnonce2, "%s%s", prefix, nonce2);
+	free(prefix);
+
+	key = malloc(strlen(fullnonce2) + 8 + 8 + 1);
+	if (unlikely(!key))
+		quit(1, "Failed to malloc key in sserver_submit");
+	sprintf(key, "%s%s%s", fullnonce2, ntime, nonce);
+	/* Hex case makes no difference to the share */
+	for (i = 0; key[i]; i++)
+		key[i] = tolower((unsigned char) key[i]);
+	HASH_FIND_STR(job->shares, key, share);
+	if (share) {
+		sserver_reply(client, id_val, NULL, 22, "Duplicate share");
+		client->rejected++;
+		free(key);
+		free(fullnonce2);
+		return;
+	}
+
+	job_ntime = be32toh(*(uint32_t *)(job->header_bin + 4 + 32 + 32));
+	if (!hex2bin((unsigned char *) &share_ntime, ntime, 4)
+			|| be32toh(share_ntime) < job_ntime
+			|| be32toh(share_ntime) > job_ntime + SSERVER_NTIME_ROLL) {
+		sserver_reply(client, id_val, NULL, 20, "Ntime out of range");
+		client->rejected++;
+		free(key);
+		free(fullnonce2);
+		return;
+	}
+
+	work = make_work();
+	cb_len = job->cb1_len + sserver_n1_len + sserver_n2size + job->cb2_len;
+	coinbase = calloc(cb_len, 1);
+	if (unlikely(!coinbase))
+		quit(1, "Failed to calloc coinbase in sserver_submit");
+	memcpy(coinbase, job->coinbase, job->cb1_len);
+	hex2bin(coinbase + job->cb1_len, sserver_nonce1, sserver_n1_len);
+	memcpy(work->data, job->header_bin, 128);
+	if (!hex2bin(coinbase + job->cb1_len + sserver_n1_len, fullnonce2, sserver_n2size)
+			|| !hex2bin(work->data + 4 + 32 + 32, ntime, 4)
+			|| !hex2bin(work->data + 76, nonce, 4)) {
+		sserver_reply(client, id_val, NULL, 20, "Malformed share");
+		client->rejected++;
+		free(coinbase);
+		free(key);
+		free(fullnonce2);
+		free_work(work);
+		return;
+	}
+	memcpy(coinbase + cb_len - job->cb2_len, job->coinbase + job->cb1_len, job->cb2_len);
+	gen_merkle_root(coinbase, cb_len, job->merkle_bin[0], job->merkles, merkle_root);
+	free(coinbase);
+	memcpy(work->data + 4 + 32, merkle_root, 32);
+
+	regen_hash(work);
+	flip32(hash2, work->hash);
+	set_work_target(work, client->diff);
+	if (!fulltest(hash2, work->target)) {
+		sserver_reply(client, id_val, NULL, 23, "Low difficulty share");
+		client->rejected++;
+		free(key);
+		free(fullnonce2);
+		free_work(work);
+		return;
+	}
+	sserver_reply(client, id_val, "true", 0, NULL);
+	client->accepted++;
+
+	share = calloc(sizeof(struct sserver_share), 1);
+	if (unlikely(!share))
+		quit(1, "Failed to calloc share in sserver_submit");
+	share->key = key;
+	HASH_ADD_KEYPTR(hh, job->shares, share->key, strlen(share->key), share);
+
+	set_work_target(work, job->diff);
+	if (fulltest(hash2, work->target)) {
+		applog(LOG_INFO, "Stratum server client %d share meets pool %d target",
+				client->id, sserver_pool->pool_no);
+		client->forwarded++;
+		sserver_forward(work, job, fullnonce2, ntime);
+	} else
+		free(fullnonce2);
+	free_work(work);
+}
+
+static void sserver_line(struct sserver_client *client, char *s) {
+	json_t *val, *id_val, *params;
+	json_error_t err;
+	const char *method;
+
+	val = JSON_LOADS(s, &err);
+	if (!val) {
+		applog(LOG_INFO, "Stratum server client %d JSON decode failed(%d): %s",
+				client->id, err.line, err.text);
+		client->dead = true;
+		return;
+	}
+	id_val = json_object_get(val, "id");
+	params = json_object_get(val, "params");
+	method = json_string_value(json_object_get(val, "method"));
+	if (!method)
+		sserver_reply(client, id_val, NULL, 20, "No method");
+	else if (!strcmp(method, "mining.subscribe"))
+		sserver_subscribe(client, id_val);
+	else if (!strcmp(method, "mining.authorize"))
+		sserver_reply(client, id_val, "true", 0, NULL);
+	else if (!strcmp(method, "mining.submit")) {
+		if (client->subscribed)
+			sserver_submit(client, id_val, params);
+		else
+			sserver_reply(client, id_val, NULL, 25, "Not subscribed");
+	} else
+		sserver_reply(client, id_val, NULL, 20, "Unsupported method");
+	json_decref(val);
+}
+
+/* Must be called under sserver_lock */
+static void __sserver_read(struct sserver_client *client) {
+	char *line, *eol;
+	ssize_t n;
+
+	if (client->dead)
+		return;
+	n = recv(client->fd, client->buf + client->buflen,
+			SSERVER_BUFSIZE - 1 - client->buflen, MSG_DONTWAIT);
+	if (n <= 0) {
+		if (n == 0 || (errno != EAGAIN && errno != EINTR))
+			client->dead = true;
+		return;
+	}
+	client->buflen += n;
+	client->buf[client->buflen] = '\0';
+
+	line = client->buf;
+	while (!client->dead && (eol = strchr(line, '\n'))) {
+		*eol = '\0';
+		if (eol > line && eol[-1] == '\r')
+			eol[-1] = '\0';
+		if (*line)
+			sserver_line(client, line);
+		line = eol + 1;
+	}
+	client->buflen -= line - client->buf;
+	memmove(client->buf, line, client->buflen);
+	if (client->buflen == SSERVER_BUFSIZE - 1) {
+		applog(LOG_INFO, "Stratum server client %d overlong line", client->id);
+		client->dead = true;
+	}
+}
+
+static void sserver_accept(int listenfd) {
+	struct sserver_client *client;
+	struct sockaddr_in cli;
+	socklen_t clilen = sizeof(cli);
+	struct epoll_event ev;
+	int fd;
+
+	fd = accept(listenfd, (struct sockaddr *)&cli, &clilen);
+	if (fd < 0)
+		return;
+	if (opt_sserver_allow && !ip4access_allowed(sserver_access, sserver_ips, &cli, NULL)) {
+		applog(LOG_INFO, "Stratum server rejected connection from %s",
+		       inet_ntoa(cli.sin_addr));
+		close(fd);
+		return;
+	}
+	client = calloc(sizeof(struct sserver_client), 1);
+	if (unlikely(!client))
+		quit(1, "Failed to calloc client in sserver_accept");
+	client->fd = fd;
+
+	mutex_lock(&sserver_lock);
+	client->id = sserver_clientno++;
+	list_add_tail(&client->list, &sserver_clients);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = client;
+	if (unlikely(epoll_ctl(sserver_epfd, EPOLL_CTL_ADD, fd, &ev)))
+		client->dead = true;
+	mutex_unlock(&sserver_lock);
+
+	applog(LOG_INFO, "Stratum server client %d connected", client->id);
+}
+
+static void *sserver_thread(void __maybe_unused *userdata) {
+	struct epoll_event events[SSERVER_EVENTS], ev;
+	struct sockaddr_in serv;
+	int listenfd, optval = 1;
+
+	pthread_detach(pthread_self());
+	RenameThread("sserver");
+
+	if (opt_sserver_allow) {
+		sserver_ips = setup_ip4access(opt_sserver_allow, &sserver_access);
+		if (!sserver_ips) {
+			applog(LOG_ERR, "No valid --stratum-server-allow addresses, stratum server not started");
+			return NULL;
+		}
+	}
+
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenfd < 0) {
+		applog(LOG_ERR, "Stratum server failed to create socket: %s", strerror(errno));
+		return NULL;
+	}
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	/* Without an allow list only miners on this host may connect */
+	if (opt_sserver_allow)
+		serv.sin_addr.s_addr = htonl(INADDR_ANY);
+	else
+		serv.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	serv.sin_port = htons(opt_sserver_port);
+	if (bind(listenfd, (struct sockaddr *) &serv, sizeof(serv)) < 0 || listen(listenfd, 64) < 0) {
+		applog(LOG_ERR, "Stratum server failed to listen on port %d: %s",
+				opt_sserver_port, strerror(errno));
+		close(listenfd);
+		return NULL;
+	}
+
+	sserver_epfd = epoll_create(SSERVER_EVENTS);
+	if (unlikely(sserver_epfd < 0))
+		quit(1, "Failed to epoll_create for stratum server");
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(sserver_epfd, EPOLL_CTL_ADD, listenfd, &ev);
+	applog(LOG_NOTICE, "Stratum server listening on %s port %d",
+	       opt_sserver_allow ? "all addresses" : "localhost", opt_sserver_port);
+
+	while (42) {
+		struct sserver_client *client, *tmp;
+		int i, nfds;
+
+		nfds = epoll_wait(sserver_epfd, events, SSERVER_EVENTS, 1000);
+		for (i = 0; i < nfds; i++) {
+			client = events[i].data.ptr;
+			if (!client) {
+				sserver_accept(listenfd);
+				continue;
+			}
+			mutex_lock(&sserver_lock);
+			__sserver_read(client);
+			mutex_unlock(&sserver_lock);
+		}
+
+		/* Catch pool changes that brought no new notify with them */
+		sserver_update(current_pool());
+
+		mutex_lock(&sserver_lock);
+		list_for_each_entry_safe(client, tmp, &sserver_clients, list) {
+			if (client->dead)
+				sserver_drop(client);
+		}
+		mutex_unlock(&sserver_lock);
+	}
+
+	return NULL;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
 void inc_hw_errors(struct thr_info *thr) {
 	mutex_lock(&stats_lock);
 	hw_errors++;
@@ -5712,7 +7185,8 @@ static void hash_sole_work(struct thr_info *mythr) {
  * from this hashtable until they are no longer in use anywhere. Once a work
  * item is physically queued on the device itself, the work->queued flag
  * should be set under cgpu->qlock write lock to prevent it being dereferenced
- * while still in use. */
+ * while still in use. New work also goes on the tail of the unqueued_work
+ * list so get_queued() can take the oldest without searching. */
 static void fill_queue(struct thr_info *mythr, struct cgpu_info *cgpu,
 		struct device_drv *drv, const int thr_id) {
 	thread_reportout(mythr);
@@ -5729,6 +7203,7 @@ static void fill_queue(struct thr_info *mythr, struct cgpu_info *cgpu,
 			work->device_diff = MIN(drv->max_diff, work->work_difficulty);
 			wr_lock(&cgpu->qlock);
 			HASH_ADD_INT(cgpu->queued_work, id, work);
+			list_add_tail(&work->qlist, &cgpu->unqueued_work);
 			wr_unlock(&cgpu->qlock);
 		}
 		/* The queue_full function should be used by the driver to
@@ -5737,22 +7212,30 @@ static void fill_queue(struct thr_info *mythr, struct cgpu_info *cgpu,
 	} while (!drv->queue_full(cgpu));
 }
 
+static void make_queued_key(unsigned char *key, const unsigned char *midstate,
+		const unsigned char *tail) {
+	memcpy(key, midstate, QUEUED_MIDSTATE_LEN);
+	memcpy(key + QUEUED_MIDSTATE_LEN, tail, QUEUED_TAIL_LEN);
+}
+
 /* This function is for retrieving one work item from the queued hashtable of
  * available work items that are not yet physically on a device (which is
  * flagged with the work->queued bool). Code using this function must be able
- * to handle NULL as a return which implies there is no work available. */
+ * to handle NULL as a return which implies there is no work available.
+ * The work is indexed by its midstate and header tail as it is taken, so the
+ * driver must not change either once it has the work. */
 struct work *get_queued(struct cgpu_info *cgpu) {
-	struct work *work, *tmp, *ret = NULL;
+	struct work *ret = NULL;
 
 	wr_lock(&cgpu->qlock);
-	HASH_ITER(hh, cgpu->queued_work, work, tmp)
-	{
-		if (!work->queued) {
-			work->queued = true;
-			cgpu->queued_count++;
-			ret = work;
-			break;
-		}
+	if (!list_empty(&cgpu->unqueued_work)) {
+		ret = list_entry(cgpu->unqueued_work.next, struct work, qlist);
+		list_del_init(&ret->qlist);
+		ret->queued = true;
+		cgpu->queued_count++;
+		make_queued_key(ret->queued_key, ret->midstate,
+				ret->data + QUEUED_TAIL_OFFSET);
+		HASH_ADD(qhh, cgpu->queued_index, queued_key, QUEUED_KEY_LEN, ret);
 	}
 	wr_unlock(&cgpu->qlock);
 
@@ -5783,11 +7266,22 @@ struct work *__find_work_bymidstate(struct work *que, char *midstate,
 /* This function is for finding an already queued work item in the
  * device's queued_work hashtable. Code using this function must be able
  * to handle NULL as a return which implies there is no matching work.
- * The common values for midstatelen, offset, datalen are 32, 64, 12 */
+ * The common values for midstatelen, offset, datalen are 32, 64, 12 and
+ * are looked up directly in the queued index, anything else is searched. */
 struct work *find_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate,
 		size_t midstatelen, char *data, int offset, size_t datalen) {
+	unsigned char key[QUEUED_KEY_LEN];
 	struct work *ret;
 
+	if (midstatelen == QUEUED_MIDSTATE_LEN && offset == QUEUED_TAIL_OFFSET
+			&& datalen == QUEUED_TAIL_LEN) {
+		make_queued_key(key, (unsigned char *)midstate, (unsigned char *)data);
+		rd_lock(&cgpu->qlock);
+		HASH_FIND(qhh, cgpu->queued_index, key, QUEUED_KEY_LEN, ret);
+		rd_unlock(&cgpu->qlock);
+		return ret;
+	}
+
 	rd_lock(&cgpu->qlock);
 	ret = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data,
 			offset, datalen);
@@ -5800,8 +7294,11 @@ struct work *find_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate,
  * the work struct is no longer in use. */
 void work_completed(struct cgpu_info *cgpu, struct work *work) {
 	wr_lock(&cgpu->qlock);
-	if (work->queued)
+	if (work->queued) {
 		cgpu->queued_count--;
+		HASH_DELETE(qhh, cgpu->queued_index, work);
+	} else
+		list_del(&work->qlist);
 	HASH_DEL(cgpu->queued_work, work);
 	wr_unlock(&cgpu->qlock);
 
@@ -5812,16 +7309,15 @@ static void flush_queue(struct cgpu_info *cgpu) {
 	struct work *work, *tmp;
 	int discarded = 0;
 
+	/* Can only discard the work items if they're not physically
+	 * queued on the device. */
 	wr_lock(&cgpu->qlock);
-	HASH_ITER(hh, cgpu->queued_work, work, tmp)
+	list_for_each_entry_safe(work, tmp, &cgpu->unqueued_work, qlist)
 	{
-		/* Can only discard the work items if they're not physically
-		 * queued on the device. */
-		if (!work->queued) {
-			HASH_DEL(cgpu->queued_work, work);
-			discard_work(work);
-			discarded++;
-		}
+		list_del(&work->qlist);
+		HASH_DEL(cgpu->queued_work, work);
+		discard_work(work);
+		discarded++;
 	}
 	wr_unlock(&cgpu->qlock);
 
@@ -6128,7 +7624,21 @@ static void *longpoll_thread(void *userdata) {
 	return NULL ;
 }
 
+/* Tell any API subscribers a device changed state */
+static void device_event(struct cgpu_info *cgpu, const char *status) {
+	struct api_data *root = NULL;
+
+	if (!api_subscribers)
+		return;
+
+	root = api_add_const(root, "Name", cgpu->drv->name, false);
+	root = api_add_int(root, "ID", &(cgpu->device_id), false);
+	root = api_add_const(root, "Status", status, false);
+	api_event("device", root);
+}
+
 void reinit_device(struct cgpu_info *cgpu) {
+	device_event(cgpu, "Restart");
 	cgpu->drv->reinit_device(cgpu);
 }
 
@@ -6345,8 +7855,10 @@ static void *watchdog_thread(void __maybe_unused *userdata) {
 #endif
 			if (cgpu->status != LIFE_WELL
 					&& (now.tv_sec - thr->last.tv_sec < WATCHDOG_SICK_TIME)) {
-				if (cgpu->status != LIFE_INIT)
+				if (cgpu->status != LIFE_INIT) {
 					applog(LOG_ERR, "%s: Recovered, declaring WELL!", dev_str);
+					device_event(cgpu, "Alive");
+				}
 				cgpu->status = LIFE_WELL;
 				cgpu->device_last_well = time(NULL );
 			} else if (cgpu->status == LIFE_WELL
@@ -6357,6 +7869,7 @@ static void *watchdog_thread(void __maybe_unused *userdata) {
 						"%s: Idle for more than 60 seconds, declaring SICK!",
 						dev_str);
 				cgtime(&thr->sick);
+				device_event(cgpu, "Sick");
 
 				dev_error(cgpu, REASON_DEV_SICK_IDLE_60);
 #ifdef HAVE_ADL
@@ -6376,6 +7889,7 @@ static void *watchdog_thread(void __maybe_unused *userdata) {
 						"%s: Not responded for more than 10 minutes, declaring DEAD!",
 						dev_str);
 				cgtime(&thr->sick);
+				device_event(cgpu, "Dead");
 
 				dev_error(cgpu, REASON_DEV_DEAD_IDLE_600);
 			} else if (now.tv_sec - thr->sick.tv_sec > 60
@@ -6514,11 +8028,14 @@ void print_summary(void) {
 }
 
 static void clean_up(void) {
+	log_thread_stop();
+
 #ifdef HAVE_OPENCL
 	clear_adl(nDevs);
 #endif
 #ifdef HAVE_LIBUSB
-	libusb_exit(NULL);
+	if (!usb_unavailable)
+		libusb_exit(NULL);
 #endif
 
 	cgtime(&total_tv_end);
@@ -6926,6 +8443,8 @@ void enable_device(struct cgpu_info *cgpu) {
 
 	rwlock_init(&cgpu->qlock);
 	cgpu->queued_work = NULL;
+	INIT_LIST_HEAD(&cgpu->unqueued_work);
+	cgpu->queued_index = NULL;
 }
 
 struct _cgpu_devid_counter {
@@ -7102,8 +8621,8 @@ static void probe_pools(void) {
 extern unsigned char *usedBlockMap;
 int main(int argc, char *argv[]) {
 	struct sigaction handler;
+	pthread_t submit_thread;
 	struct thr_info *thr;
-	struct block *block;
 	unsigned int k;
 	int i, j;
 	char *s;
@@ -7121,12 +8640,10 @@ int main(int argc, char *argv[]) {
 	initial_args[argc] = NULL;
 
 #ifdef HAVE_LIBUSB
-	int err = libusb_init(NULL);
-	if (err) {
-		fprintf(stderr, "libusb_init() failed err %d", err);
-		fflush(stderr);
-		quit(1, "libusb_init() failed");
-	}
+	// Checked once the options are known
+	int usb_init_err = libusb_init(NULL);
+	if (usb_init_err)
+		usb_unavailable = true;
 #ifdef USE_USBUTILS
 	mutex_init(&cgusb_lock);
 #endif
@@ -7138,7 +8655,12 @@ int main(int argc, char *argv[]) {
 	mutex_init(&stats_lock);
 	mutex_init(&sharelog_lock);
 	cglock_init(&ch_lock);
+	mutex_init(&gbt_hash_lock);
 	mutex_init(&sshare_lock);
+	if (unlikely(pthread_cond_init(&sshare_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init sshare_cond");
+	for (i = 0; i < SSHARE_WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&sshare_wheel[i]);
 	rwlock_init(&blk_lock);
 	rwlock_init(&netacc_lock);
 	rwlock_init(&mining_thr_lock);
@@ -7148,6 +8670,11 @@ int main(int argc, char *argv[]) {
 	if (unlikely(pthread_cond_init(&lp_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init lp_cond");
 
+#ifdef HAVE_SYS_EPOLL_H
+	mutex_init(&stratum_loop_lock);
+	mutex_init(&sserver_lock);
+#endif
+
 	mutex_init(&restart_lock);
 	if (unlikely(pthread_cond_init(&restart_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init restart_cond");
@@ -7194,14 +8721,6 @@ int main(int argc, char *argv[]) {
 	logstart = devcursor + 1;
 	logcursor = logstart + 1;
 
-	block = calloc(sizeof(struct block), 1);
-	if (unlikely(!block))
-		quit(1, "main OOM");
-	for (i = 0; i < 36; i++)
-		strcat(block->hash, "0");
-	HASH_ADD_STR(blocks, hash, block);
-	strcpy(current_block, block->hash);
-
 	INIT_LIST_HEAD(&scan_devices);
 
 #ifdef HAVE_OPENCL
@@ -7243,6 +8762,8 @@ int main(int argc, char *argv[]) {
 		enable_curses();
 #endif
 
+	log_thread_start();
+
 	applog(LOG_WARNING, "Started %s", packagename);
 	if (cnfbuf) {
 		applog(LOG_NOTICE, "Loaded configuration file %s", cnfbuf);
@@ -7270,6 +8791,21 @@ int main(int argc, char *argv[]) {
 	if (want_per_device_stats)
 		opt_log_output = true;
 
+#ifdef HAVE_LIBUSB
+	if (usb_unavailable) {
+#ifdef USE_USBUTILS
+		if (opt_usb_sim && *opt_usb_sim)
+			applog(LOG_WARNING, "libusb_init() failed err %d, only using --usb-sim devices", usb_init_err);
+		else
+#endif
+		{
+			fprintf(stderr, "libusb_init() failed err %d", usb_init_err);
+			fflush(stderr);
+			quit(1, "libusb_init() failed");
+		}
+	}
+#endif
+
 #ifdef USE_USBUTILS
 	usb_initialise();
 #endif
@@ -7351,7 +8887,7 @@ int main(int argc, char *argv[]) {
 #endif
 
 #ifdef USE_ZTEX
-	if (!opt_scrypt)
+	if (!opt_scrypt && !usb_unavailable)
 	ztex_drv.drv_detect();
 #endif
 
@@ -7486,6 +9022,20 @@ int main(int argc, char *argv[]) {
 		quit(1, "stage thread create failed");
 	pthread_detach(thr->pth);
 
+	if (unlikely(pthread_create(&submit_thread, NULL, stratum_submit_thread, NULL)))
+		quit(1, "stratum submit thread create failed");
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (opt_sserver_port) {
+		pthread_t sserver_pth;
+
+		if (opt_scrypt)
+			quit(1, "The stratum server does not support scrypt");
+		if (unlikely(pthread_create(&sserver_pth, NULL, sserver_thread, NULL)))
+			quit(1, "stratum server thread create failed");
+	}
+#endif
+
 	/* Create a unique get work queue */
 	getq = tq_new();
 	if (!getq)
@@ -7774,6 +9324,7 @@ int main(int argc, char *argv[]) {
 		stage_work(work);
 		push_curl_entry(ce, pool);
 	}
+	log_thread_stop();
 	fclose(flog);
 	free(usedBlockMap);
 	return 0;
@@ -1329,8 +1329,17 @@ void search(
     
     ZA[924] = (ZCh(ZA[922], ZA[920], ZA[918]) + ZA[923]) + ZR26(ZA[922]);
     
+#ifdef COMPACT
+/* output[0] counts every nonce found, the first MAXNONCES of them follow */
+#define SETFOUND(Xnonce) do { \
+		uint found_slot = atomic_inc(&output[0]); \
+		if (found_slot < MAXNONCES) \
+			output[found_slot + 1] = Xnonce; \
+	} while (0)
+#else
 #define FOUND (0x0F)
 #define SETFOUND(Xnonce) output[output[FOUND]++] = Xnonce
+#endif
 
 #if defined(VECTORS4)
 	bool result = any(ZA[924] == K[79]);
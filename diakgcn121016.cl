@@ -571,8 +571,17 @@ __kernel
 
 	V[7] += V[3] + W[12] + ch(V[0], V[1], V[2]) + rotr26(V[0]);
 
+#ifdef COMPACT
+/* output[0] counts every nonce found, the first MAXNONCES of them follow */
+#define SETFOUND(Xnonce) do { \
+		uint found_slot = atomic_inc(&output[0]); \
+		if (found_slot < MAXNONCES) \
+			output[found_slot + 1] = Xnonce; \
+	} while (0)
+#else
 #define FOUND (0x0F)
 #define SETFOUND(Xnonce) output[output[FOUND]++] = Xnonce
+#endif
 
 #ifdef VECTORS4
 	if ((V[7].x == 0x136032edU) ^ (V[7].y == 0x136032edU) ^ (V[7].z == 0x136032edU) ^ (V[7].w == 0x136032edU)) {
@@ -255,14 +255,21 @@ static inline int avalon_gets(int fd, uint8_t *buf, struct thr_info *thr,
 	}
 }
 
+static const struct timeval avalon_gets_timeout = { 0, 100000 };
+
 static int avalon_get_result(int fd, struct avalon_result *ar,
 			     struct thr_info *thr, struct timeval *tv_finish)
 {
+	struct avalon_info *info = avalon_infos[thr->cgpu->device_id];
 	uint8_t result[AVALON_READ_SIZE];
 	int ret;
 
 	memset(result, 0, AVALON_READ_SIZE);
-	ret = avalon_gets(fd, result, thr, tv_finish);
+	if (info->sio)
+		ret = serial_io_gets(info->sio, result, tv_finish,
+				     &avalon_gets_timeout, &thr->work_restart);
+	else
+		ret = avalon_gets(fd, result, thr, tv_finish);
 
 	if (ret == AVA_GETS_OK) {
 		if (opt_debug) {
@@ -635,6 +642,10 @@ static inline void avalon_detect()
 
 static void __avalon_init(struct cgpu_info *avalon)
 {
+	struct avalon_info *info = avalon_infos[avalon->device_id];
+
+	if (!info->sio)
+		info->sio = serial_io_add(avalon->device_fd, AVALON_READ_SIZE);
 	applog(LOG_INFO, "Avalon: Opened on %s", avalon->device_path);
 }
 
@@ -712,6 +723,8 @@ static void do_avalon_close(struct thr_info *thr)
 	struct avalon_info *info = avalon_infos[avalon->device_id];
 
 	avalon_free_work(thr);
+	serial_io_remove(info->sio);
+	info->sio = NULL;
 	sleep(1);
 	avalon_reset(avalon->device_fd, &ar);
 	avalon_idle(avalon);
@@ -95,16 +95,18 @@ struct avalon_info {
 	int matching_work[AVALON_DEFAULT_MINER_NUM];
 
 	int frequency;
+
+	struct serial_io *sio;
 };
 
 #define AVALON_WRITE_SIZE (sizeof(struct avalon_task))
 #define AVALON_READ_SIZE (sizeof(struct avalon_result))
 #define AVALON_ARRAY_SIZE 4
 
-#define AVA_GETS_ERROR -1
-#define AVA_GETS_OK 0
-#define AVA_GETS_RESTART 1
-#define AVA_GETS_TIMEOUT 2
+#define AVA_GETS_ERROR SERIAL_IO_ERROR
+#define AVA_GETS_OK SERIAL_IO_OK
+#define AVA_GETS_RESTART SERIAL_IO_RESTART
+#define AVA_GETS_TIMEOUT SERIAL_IO_TIMEOUT
 
 #define AVA_SEND_ERROR -1
 #define AVA_SEND_OK 0
@@ -946,7 +946,8 @@ static void flush_one_dev(struct cgpu_info *bflsc, int dev)
 	rd_lock(&bflsc->qlock);
 
 	HASH_ITER(hh, bflsc->queued_work, work, tmp) {
-		if (work->subid == dev) {
+		// Only work actually sent to the device, unqueued work has no subid yet
+		if (work->queued && work->subid == dev) {
 			// devflag is used to flag stale work
 			work->devflag = true;
 			did = true;
@@ -1762,7 +1763,12 @@ static int64_t bflsc_scanwork(struct thr_info *thr)
 				wr_lock(&bflsc->qlock);
 				HASH_ITER(hh, bflsc->queued_work, work, tmp) {
 					if (work->devflag && work->subid == dev) {
-						bflsc->queued_count--;
+						// as work_completed() does
+						if (work->queued) {
+							bflsc->queued_count--;
+							HASH_DELETE(qhh, bflsc->queued_index, work);
+						} else
+							list_del(&work->qlist);
 						HASH_DEL(bflsc->queued_work, work);
 						discard_work(work);
 					}
@@ -184,6 +184,9 @@ struct ICARUS_INFO {
 	int work_division;
 	int fpga_count;
 	uint32_t nonce_mask;
+
+	// replies via the serial I/O service, NULL if reading directly
+	struct serial_io *sio;
 };
 
 #define END_CONDITION 0x0000ffff
@@ -225,10 +228,10 @@ static void rev(unsigned char *s, size_t l)
 #define icarus_open2(devpath, baud, purge)  serial_open(devpath, baud, ICARUS_READ_FAULT_DECISECONDS, purge)
 #define icarus_open(devpath, baud)  icarus_open2(devpath, baud, false)
 
-#define ICA_GETS_ERROR -1
-#define ICA_GETS_OK 0
-#define ICA_GETS_RESTART 1
-#define ICA_GETS_TIMEOUT 2
+#define ICA_GETS_ERROR SERIAL_IO_ERROR
+#define ICA_GETS_OK SERIAL_IO_OK
+#define ICA_GETS_RESTART SERIAL_IO_RESTART
+#define ICA_GETS_TIMEOUT SERIAL_IO_TIMEOUT
 
 static int icarus_gets(unsigned char *buf, int fd, struct timeval *tv_finish, struct thr_info *thr, int read_count)
 {
@@ -293,6 +296,10 @@ static int icarus_write(int fd, const void *buf, size_t bufLen)
 static void do_icarus_close(struct thr_info *thr)
 {
 	struct cgpu_info *icarus = thr->cgpu;
+	struct ICARUS_INFO *info = icarus_info[icarus->device_id];
+
+	serial_io_remove(info->sio);
+	info->sio = NULL;
 	icarus_close(icarus->device_fd);
 	icarus->device_fd = -1;
 }
@@ -628,6 +635,7 @@ static bool icarus_prepare(struct thr_info *thr)
 	}
 
 	icarus->device_fd = fd;
+	icarus_info[icarus->device_id]->sio = serial_io_add(fd, ICARUS_READ_SIZE);
 
 	applog(LOG_INFO, "Opened Icarus on %s", icarus->device_path);
 	cgtime(&now);
@@ -649,7 +657,7 @@ static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 	char *ob_hex;
 	uint32_t nonce;
 	int64_t hash_count;
-	struct timeval tv_start, tv_finish, elapsed;
+	struct timeval tv_start, tv_finish, elapsed, tv_timeout;
 	struct timeval tv_history_start, tv_history_finish;
 	double Ti, Xi;
 	int curr_hw_errors, i;
@@ -705,7 +713,12 @@ static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 	/* Icarus will return 4 bytes (ICARUS_READ_SIZE) nonces or nothing */
 	memset(nonce_bin, 0, sizeof(nonce_bin));
 	info = icarus_info[icarus->device_id];
-	ret = icarus_gets(nonce_bin, fd, &tv_finish, thr, info->read_count);
+	if (info->sio) {
+		tv_timeout.tv_sec = info->read_count / TIME_FACTOR;
+		tv_timeout.tv_usec = (info->read_count % TIME_FACTOR) * (1000000 / TIME_FACTOR);
+		ret = serial_io_gets(info->sio, nonce_bin, &tv_finish, &tv_timeout, &thr->work_restart);
+	} else
+		ret = icarus_gets(nonce_bin, fd, &tv_finish, thr, info->read_count);
 	if (ret == ICA_GETS_ERROR) {
 		do_icarus_close(thr);
 		applog(LOG_ERR, "%s%i: Comms error", icarus->drv->name, icarus->device_id);
@@ -44,6 +44,8 @@ extern void enable_curses(void);
 extern int mining_threads;
 extern double total_secs;
 extern int opt_g_threads;
+extern bool opt_gpu_pipeline;
+extern bool opt_gpu_autotune;
 extern bool ping;
 extern bool opt_loginput;
 extern char *opt_kernel_path;
@@ -1114,6 +1116,174 @@ static void set_threads_hashes(unsigned int vectors,int64_t *hashes, size_t *glo
 	*globalThreads = threads;
 	*hashes = threads * vectors;
 }
+
+typedef cl_int (*queue_kernel_fn)(_clState *, dev_blk_ctx *, cl_uint);
+
+static queue_kernel_fn select_queue_kernel(enum cl_kernels kernel)
+{
+	switch (kernel) {
+		case KL_POCLBM:
+			return &queue_poclbm_kernel;
+		case KL_PHATK:
+			return &queue_phatk_kernel;
+		case KL_DIAKGCN:
+			return &queue_diakgcn_kernel;
+#ifdef USE_SCRYPT
+		case KL_SCRYPT:
+			return &queue_scrypt_kernel;
+#endif
+		default:
+		case KL_DIABLO:
+			return &queue_diablo_kernel;
+	}
+}
+
+/* Autotune limits. Each kernel run has to finish within TUNE_MAXMS so the
+ * chosen intensity can't starve the card of fresh work */
+#define TUNE_RUNS	5
+#define TUNE_MAXMS	100
+#define TUNE_MIN_INTENSITY 0
+
+static void release_clstate(_clState *clState)
+{
+	int i;
+
+	clReleaseKernel(clState->kernel);
+	clReleaseProgram(clState->program);
+	for (i = 0; i < OPENCL_PIPELINE; i++)
+		clReleaseMemObject(clState->outputBuffers[i]);
+	clReleaseCommandQueue(clState->commandQueue);
+	clReleaseContext(clState->context);
+	free(clState);
+}
+
+/* Times TUNE_RUNS kernel runs at the given intensity on dummy work, after
+ * one untimed run to take any lazy setup out of the figures */
+static bool tune_run(_clState *clState, queue_kernel_fn queue_kernel, int *intensity,
+		     double *mhs, double *ms)
+{
+	static const uint32_t tune_data[32];
+	struct timeval tv_start, tv_end;
+	size_t localThreads[1] = { clState->wsize };
+	size_t globalThreads[1];
+	dev_blk_ctx blk;
+	int64_t hashes;
+	cl_int status;
+	double secs;
+	int i;
+
+	memset(&blk, 0, sizeof(blk));
+	precalc_hash(&blk, (uint32_t *)tune_data, (uint32_t *)tune_data + 16);
+	set_threads_hashes(clState->vwidth, &hashes, globalThreads, localThreads[0], intensity);
+
+	for (i = 0; i <= TUNE_RUNS; i++) {
+		size_t global_work_offset[1] = { blk.nonce };
+
+		if (i == 1)
+			cgtime(&tv_start);
+		status = queue_kernel(clState, &blk, globalThreads[0]);
+		status |= clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel, 1,
+						 clState->goffset ? global_work_offset : NULL,
+						 globalThreads, localThreads, 0, NULL, NULL);
+		status |= clFinish(clState->commandQueue);
+		if (unlikely(status != CL_SUCCESS))
+			return false;
+		blk.nonce += hashes;
+	}
+	cgtime(&tv_end);
+
+	secs = tdiff(&tv_end, &tv_start);
+	if (secs <= 0)
+		secs = 0.000001;
+	*mhs = (double)hashes * TUNE_RUNS / secs / 1000000;
+	*ms = secs * 1000 / TUNE_RUNS;
+	return true;
+}
+
+/* Tries every kernel, vector width and worksize the device accepts, sweeping
+ * intensity upwards for each until a run takes longer than TUNE_MAXMS, and
+ * keeps the fastest combination in the device's kernel, vectors, worksize and
+ * intensity settings. Those are what the next initCl() uses and what a saved
+ * config file records for the device. */
+static void opencl_autotune(struct cgpu_info *cgpu)
+{
+	static const enum cl_kernels kernels[] = { KL_POCLBM, KL_PHATK, KL_DIAKGCN, KL_DIABLO };
+	static const char *knames[] = { "poclbm", "phatk", "diakgcn", "diablo" };
+	static const int vectors[] = { 1, 2, 4 };
+	static const int worksizes[] = { 64, 128, 256 };
+	enum cl_kernels old_kernel = cgpu->kernel;
+	int old_vwidth = cgpu->vwidth, old_wsize = cgpu->work_size;
+	int best_k = -1, best_v = 0, best_w = 0, best_i = 0;
+	double best_mhs = 0, best_ms = 0;
+	char name[256];
+	unsigned int k, v, w;
+
+	cgpu->autotune = false;
+	if (opt_scrypt) {
+		applog(LOG_WARNING, "GPU %d: autotune is not supported for scrypt", cgpu->device_id);
+		return;
+	}
+
+	applog(LOG_WARNING, "GPU %d: autotuning, this may take a while", cgpu->device_id);
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		for (v = 0; v < sizeof(vectors) / sizeof(vectors[0]); v++) {
+			for (w = 0; w < sizeof(worksizes) / sizeof(worksizes[0]); w++) {
+				_clState *clState;
+				int intensity;
+
+				cgpu->kernel = kernels[k];
+				cgpu->vwidth = vectors[v];
+				cgpu->work_size = worksizes[w];
+				clState = initCl(cgpu->virtual_gpu, name, sizeof(name));
+				if (!clState)
+					continue;
+				/* The device capped the worksize, already covered */
+				if ((int)clState->wsize != worksizes[w]) {
+					release_clstate(clState);
+					continue;
+				}
+
+				for (intensity = TUNE_MIN_INTENSITY; intensity <= MAX_INTENSITY; intensity++) {
+					double mhs, ms;
+
+					if (!tune_run(clState, select_queue_kernel(kernels[k]), &intensity, &mhs, &ms))
+						break;
+					applog(LOG_INFO, "GPU %d: %s v%d w%d I%d: %.2f MH/s %.1f ms",
+					       cgpu->device_id, knames[k], vectors[v], worksizes[w],
+					       intensity, mhs, ms);
+					if (ms > TUNE_MAXMS)
+						break;
+					if (mhs > best_mhs) {
+						best_mhs = mhs;
+						best_ms = ms;
+						best_k = k;
+						best_v = vectors[v];
+						best_w = worksizes[w];
+						best_i = intensity;
+					}
+				}
+				release_clstate(clState);
+			}
+		}
+	}
+
+	if (best_k < 0) {
+		cgpu->kernel = old_kernel;
+		cgpu->vwidth = old_vwidth;
+		cgpu->work_size = old_wsize;
+		applog(LOG_WARNING, "GPU %d: autotune found no working configuration", cgpu->device_id);
+		return;
+	}
+
+	cgpu->kernel = kernels[best_k];
+	cgpu->kname = knames[best_k];
+	cgpu->vwidth = best_v;
+	cgpu->work_size = best_w;
+	cgpu->dynamic = false;
+	cgpu->intensity = best_i;
+	applog(LOG_WARNING, "GPU %d: autotune chose %s kernel, %d vectors, worksize %d, intensity %d (%.2f MH/s, %.1f ms per run)",
+	       cgpu->device_id, knames[best_k], best_v, best_w, best_i, best_mhs, best_ms);
+}
 #endif /* HAVE_OPENCL */
 
 
@@ -1170,6 +1340,9 @@ select_cgpu:
 			applog(LOG_WARNING, "Thread %d no longer exists", thr_id);
 	}
 
+	if (gpus[gpu].autotune)
+		opencl_autotune(&gpus[gpu]);
+
 	for (thr_id = 0; thr_id < mining_threads; ++thr_id) {
 		int virtual_gpu;
 
@@ -1309,13 +1482,34 @@ static void get_opencl_statline(char *buf, struct cgpu_info *gpu)
 	tailsprintf(buf, " I:%2d", gpu->intensity);
 }
 
+/* One kernel run in flight with --gpu-pipeline. The work is a copy so the
+ * results can still be checked after the caller has moved on to new work */
+struct opencl_slot {
+	uint32_t *res;
+	cl_event read_ev;
+	cl_event clear_ev;
+	struct work *work;
+	int work_id;
+	bool busy;
+};
+
 struct opencl_thread_data {
 	cl_int (*queue_kernel_parameters)(_clState *, dev_blk_ctx *, cl_uint);
 	uint32_t *res;
+	bool pipeline;
+	int slot;
+	cl_event kernel_ev;
+	struct opencl_slot slots[OPENCL_PIPELINE];
 };
 
 static uint32_t *blank_res;
 
+#define OUTBUF_SIZE(clState) ((clState)->compact ? COMPACT_BUFFERSIZE : BUFFERSIZE)
+/* Pipelined mode reads BUFFERSIZE either way, which with compacted results is
+ * the count and this many nonces. Any more are read separately, and that
+ * read can wait behind the kernel run queued after it */
+#define PIPELINE_NONCES (MAXBUFFERS - 1)
+
 static bool opencl_thread_prepare(struct thr_info *thr)
 {
 	char name[256];
@@ -1327,12 +1521,17 @@ static bool opencl_thread_prepare(struct thr_info *thr)
 	static bool failmessage = false;
 
 	if (!blank_res)
-		blank_res = calloc(BUFFERSIZE, 1);
+		blank_res = calloc(COMPACT_BUFFERSIZE, 1);
 	if (!blank_res) {
 		applog(LOG_ERR, "Failed to calloc in opencl_thread_init");
 		return false;
 	}
 
+	if (opt_gpu_autotune && !thr->device_thread)
+		cgpu->autotune = true;
+	if (cgpu->autotune)
+		opencl_autotune(cgpu);
+
 	strcpy(name, "");
 	applog(LOG_INFO, "Init GPU thread %i GPU %i virtual GPU %i", i, gpu, virtual_gpu);
 	clStates[i] = initCl(virtual_gpu, name, sizeof(name));
@@ -1412,28 +1611,9 @@ static bool opencl_thread_init(struct thr_info *thr)
 		return false;
 	}
 
-	switch (clState->chosen_kernel) {
-		case KL_POCLBM:
-			thrdata->queue_kernel_parameters = &queue_poclbm_kernel;
-			break;
-		case KL_PHATK:
-			thrdata->queue_kernel_parameters = &queue_phatk_kernel;
-			break;
-		case KL_DIAKGCN:
-			thrdata->queue_kernel_parameters = &queue_diakgcn_kernel;
-			break;
-#ifdef USE_SCRYPT
-		case KL_SCRYPT:
-			thrdata->queue_kernel_parameters = &queue_scrypt_kernel;
-			break;
-#endif
-		default:
-		case KL_DIABLO:
-			thrdata->queue_kernel_parameters = &queue_diablo_kernel;
-			break;
-	}
+	thrdata->queue_kernel_parameters = select_queue_kernel(clState->chosen_kernel);
 
-	thrdata->res = calloc(BUFFERSIZE, 1);
+	thrdata->res = calloc(COMPACT_BUFFERSIZE, 1);
 
 	if (!thrdata->res) {
 		free(thrdata);
@@ -1441,8 +1621,27 @@ static bool opencl_thread_init(struct thr_info *thr)
 		return false;
 	}
 
-	status |= clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer, CL_TRUE, 0,
-			BUFFERSIZE, blank_res, 0, NULL, NULL);
+	/* The scrypt kernel shares its input and pad buffers between runs */
+	thrdata->pipeline = opt_gpu_pipeline;
+#ifdef USE_SCRYPT
+	if (opt_scrypt)
+		thrdata->pipeline = false;
+#endif
+	if (thrdata->pipeline) {
+		int i;
+
+		for (i = 0; i < OPENCL_PIPELINE; i++) {
+			thrdata->slots[i].res = calloc(COMPACT_BUFFERSIZE, 1);
+			if (!thrdata->slots[i].res) {
+				applog(LOG_ERR, "Failed to calloc in opencl_thread_init");
+				return false;
+			}
+			status |= clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffers[i], CL_TRUE, 0,
+					OUTBUF_SIZE(clState), blank_res, 0, NULL, NULL);
+		}
+	} else
+		status |= clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer, CL_TRUE, 0,
+				OUTBUF_SIZE(clState), blank_res, 0, NULL, NULL);
 	if (unlikely(status != CL_SUCCESS)) {
 		applog(LOG_ERR, "Error: clEnqueueWriteBuffer failed.");
 		return false;
@@ -1469,6 +1668,147 @@ static bool opencl_prepare_work(struct thr_info __maybe_unused *thr, struct work
 
 extern int opt_dynamic_interval;
 
+/* Hands the nonces in a result buffer read back from the device to postcalc
+ * and returns how much of the device buffer needs clearing, 0 if nothing was
+ * found. With compacted results only the count and the first 'have' nonces
+ * have been read, the rest are fetched here now the kernel has finished. */
+static size_t opencl_results(struct thr_info *thr, struct work *work, _clState *clState,
+			     cl_mem buffer, uint32_t *res, unsigned int have)
+{
+	struct cgpu_info *gpu = thr->cgpu;
+	unsigned int count;
+	cl_int status;
+
+	if (!clState->compact) {
+		/* FOUND entry is used as a counter to say how many nonces exist */
+		if (!res[FOUND])
+			return 0;
+		applog(LOG_DEBUG, "GPU %d found something?", gpu->device_id);
+		postcalc_hash_async(thr, work, res);
+		memset(res, 0, BUFFERSIZE);
+		return BUFFERSIZE;
+	}
+
+	count = res[0];
+	if (!count)
+		return 0;
+	if (unlikely(count > MAXNONCES)) {
+		applog(LOG_WARNING, "GPU %d: %u nonces found but only %d fit in the result buffer",
+		       gpu->device_id, count, MAXNONCES);
+		count = MAXNONCES;
+	}
+	if (count > have) {
+		status = clEnqueueReadBuffer(clState->commandQueue, buffer, CL_TRUE,
+				sizeof(uint32_t) * (have + 1), sizeof(uint32_t) * (count - have),
+				res + have + 1, 0, NULL, NULL);
+		if (unlikely(status != CL_SUCCESS)) {
+			applog(LOG_ERR, "Error: clEnqueueReadBuffer failed error %d. (clEnqueueReadBuffer)", status);
+			count = have;
+		}
+	}
+	applog(LOG_DEBUG, "GPU %d found %u nonces", gpu->device_id, count);
+	postcalc_nonces_async(thr, work, res + 1, count);
+	res[0] = 0;
+	return COMPACT_HEADSIZE;
+}
+
+/* Waits for the read of a pipelined slot and hands any nonces found to
+ * postcalc. The output buffer clear is queued behind the next kernel run and
+ * the next run in this slot waits on it, so nothing here blocks on the
+ * kernel that is currently executing. */
+static bool opencl_slot_results(struct thr_info *thr, _clState *clState, int i)
+{
+	struct opencl_thread_data *thrdata = thr->cgpu_data;
+	struct opencl_slot *slot = &thrdata->slots[i];
+	cl_int status;
+	size_t clear;
+
+	status = clWaitForEvents(1, &slot->read_ev);
+	clReleaseEvent(slot->read_ev);
+	slot->read_ev = NULL;
+	slot->busy = false;
+	if (unlikely(status != CL_SUCCESS)) {
+		applog(LOG_ERR, "Error %d: Waiting for results. (clWaitForEvents)", status);
+		return false;
+	}
+
+	clear = opencl_results(thr, slot->work, clState, clState->outputBuffers[i],
+			       slot->res, PIPELINE_NONCES);
+	if (clear) {
+		status = clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffers[i], CL_FALSE, 0,
+				clear, blank_res, 0, NULL, &slot->clear_ev);
+		if (unlikely(status != CL_SUCCESS)) {
+			applog(LOG_ERR, "Error: clEnqueueWriteBuffer failed.");
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Launches the next kernel run into its own output buffer and then scans the
+ * results of the oldest run still in flight, so the device always has the
+ * next run queued while the host works. The events chain each slot's
+ * clear -> kernel -> read, and each kernel also waits on the one before it,
+ * so this is safe on out of order queues as well. */
+static bool opencl_pipeline(struct thr_info *thr, struct work *work,
+			    size_t *globalThreads, size_t *localThreads)
+{
+	struct opencl_thread_data *thrdata = thr->cgpu_data;
+	_clState *clState = clStates[thr->id];
+	struct opencl_slot *slot = &thrdata->slots[thrdata->slot];
+	size_t global_work_offset[1] = { work->blk.nonce };
+	cl_event wait[2], kernel_ev;
+	cl_uint nwait = 0;
+	cl_int status;
+
+	clState->outputBuffer = clState->outputBuffers[thrdata->slot];
+	status = thrdata->queue_kernel_parameters(clState, &work->blk, globalThreads[0]);
+	if (unlikely(status != CL_SUCCESS)) {
+		applog(LOG_ERR, "Error: clSetKernelArg of all params failed.");
+		return false;
+	}
+
+	if (thrdata->kernel_ev)
+		wait[nwait++] = thrdata->kernel_ev;
+	if (slot->clear_ev)
+		wait[nwait++] = slot->clear_ev;
+	status = clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel, 1,
+					clState->goffset ? global_work_offset : NULL,
+					globalThreads, localThreads, nwait, nwait ? wait : NULL, &kernel_ev);
+	if (unlikely(status != CL_SUCCESS)) {
+		applog(LOG_ERR, "Error %d: Enqueueing kernel onto command queue. (clEnqueueNDRangeKernel)", status);
+		return false;
+	}
+	if (thrdata->kernel_ev)
+		clReleaseEvent(thrdata->kernel_ev);
+	thrdata->kernel_ev = kernel_ev;
+	if (slot->clear_ev) {
+		clReleaseEvent(slot->clear_ev);
+		slot->clear_ev = NULL;
+	}
+
+	status = clEnqueueReadBuffer(clState->commandQueue, clState->outputBuffer, CL_FALSE, 0,
+			BUFFERSIZE, slot->res, 1, &kernel_ev, &slot->read_ev);
+	if (unlikely(status != CL_SUCCESS)) {
+		applog(LOG_ERR, "Error: clEnqueueReadBuffer failed error %d. (clEnqueueReadBuffer)", status);
+		return false;
+	}
+	clFlush(clState->commandQueue);
+	slot->busy = true;
+
+	if (!slot->work || slot->work_id != work->id) {
+		if (slot->work)
+			free_work(slot->work);
+		slot->work = copy_work(work);
+		slot->work_id = work->id;
+	}
+
+	thrdata->slot = (thrdata->slot + 1) % OPENCL_PIPELINE;
+	if (thrdata->slots[thrdata->slot].busy)
+		return opencl_slot_results(thr, clState, thrdata->slot);
+	return true;
+}
+
 static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 				int64_t __maybe_unused max_nonce)
 {
@@ -1483,6 +1823,7 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 	size_t globalThreads[1];
 	size_t localThreads[1] = { clState->wsize };
 	int64_t hashes;
+	size_t clear;
 
 	/* Windows' timer resolution is only 15ms so oversample 5x */
 	if (gpu->dynamic && (++gpu->intervals * dynamic_us) > 70000) {
@@ -1506,6 +1847,13 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 	if (hashes > gpu->max_hashes)
 		gpu->max_hashes = hashes;
 
+	if (thrdata->pipeline) {
+		if (!opencl_pipeline(thr, work, globalThreads, localThreads))
+			return -1;
+		work->blk.nonce += gpu->max_hashes;
+		return hashes;
+	}
+
 	status = thrdata->queue_kernel_parameters(clState, &work->blk, globalThreads[0]);
 	if (unlikely(status != CL_SUCCESS)) {
 		applog(LOG_ERR, "Error: clSetKernelArg of all params failed.");
@@ -1527,7 +1875,7 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 	}
 
 	status = clEnqueueReadBuffer(clState->commandQueue, clState->outputBuffer, CL_FALSE, 0,
-			BUFFERSIZE, thrdata->res, 0, NULL, NULL);
+			clState->compact ? COMPACT_HEADSIZE : BUFFERSIZE, thrdata->res, 0, NULL, NULL);
 	if (unlikely(status != CL_SUCCESS)) {
 		applog(LOG_ERR, "Error: clEnqueueReadBuffer failed error %d. (clEnqueueReadBuffer)", status);
 		return -1;
@@ -1541,18 +1889,15 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 	/* This finish flushes the readbuffer set with CL_FALSE in clEnqueueReadBuffer */
 	clFinish(clState->commandQueue);
 
-	/* FOUND entry is used as a counter to say how many nonces exist */
-	if (thrdata->res[FOUND]) {
+	clear = opencl_results(thr, work, clState, clState->outputBuffer, thrdata->res, 0);
+	if (clear) {
 		/* Clear the buffer again */
 		status = clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer, CL_FALSE, 0,
-				BUFFERSIZE, blank_res, 0, NULL, NULL);
+				clear, blank_res, 0, NULL, NULL);
 		if (unlikely(status != CL_SUCCESS)) {
 			applog(LOG_ERR, "Error: clEnqueueWriteBuffer failed.");
 			return -1;
 		}
-		applog(LOG_DEBUG, "GPU %d found something?", gpu->device_id);
-		postcalc_hash_async(thr, work, thrdata->res);
-		memset(thrdata->res, 0, BUFFERSIZE);
 		/* This finish flushes the writebuffer set with CL_FALSE in clEnqueueWriteBuffer */
 		clFinish(clState->commandQueue);
 	}
@@ -1563,8 +1908,28 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 static void opencl_thread_shutdown(struct thr_info *thr)
 {
 	const int thr_id = thr->id;
+	struct opencl_thread_data *thrdata = thr->cgpu_data;
 	_clState *clState = clStates[thr_id];
 
+	if (thrdata && thrdata->pipeline) {
+		int i;
+
+		clFinish(clState->commandQueue);
+		if (thrdata->kernel_ev)
+			clReleaseEvent(thrdata->kernel_ev);
+		for (i = 0; i < OPENCL_PIPELINE; i++) {
+			struct opencl_slot *slot = &thrdata->slots[i];
+
+			if (slot->read_ev)
+				clReleaseEvent(slot->read_ev);
+			if (slot->clear_ev)
+				clReleaseEvent(slot->clear_ev);
+			if (slot->work)
+				free_work(slot->work);
+			free(slot->res);
+		}
+		thrdata->pipeline = false;
+	}
 	clReleaseCommandQueue(clState->commandQueue);
 	clReleaseKernel(clState->kernel);
 	clReleaseProgram(clState->program);
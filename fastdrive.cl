@@ -111,8 +111,17 @@ const uint H[8] = {
 //SHA round for constant W values
 #define sharoundC(n)  {Barrier3(n); Vals[(3 + 128 - (n)) % 8] += t1C(n); Vals[(7 + 128 - (n)) % 8] = t1C(n) + t2(n);}
 
+#ifdef COMPACT
+/* output[0] counts every nonce found, the first MAXNONCES of them follow */
+#define SETFOUND(Xnonce) do { \
+		uint found_slot = atomic_inc(&output[0]); \
+		if (found_slot < MAXNONCES) \
+			output[found_slot + 1] = Xnonce; \
+	} while (0)
+#else
 #define FOUND (0x0F)
 #define SETFOUND(Xnonce) output[output[FOUND]++] = Xnonce
+#endif
 #define P124(n) P2(n) + P1(n) + P4(n)
 
 #define WORKSIZE 386
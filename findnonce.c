@@ -174,9 +174,9 @@ void precalc_hash(dev_blk_ctx *blk, uint32_t *state, uint32_t *data)
 struct pc_data {
 	struct thr_info *thr;
 	struct work *work;
-	uint32_t res[MAXBUFFERS];
+	unsigned int count;
+	uint32_t nonces[MAXNONCES];
 	pthread_t pth;
-	int found;
 };
 
 static void *postcalc_hash(void *userdata)
@@ -187,18 +187,8 @@ static void *postcalc_hash(void *userdata)
 
 	pthread_detach(pthread_self());
 
-	/* To prevent corrupt values in FOUND from trying to read beyond the
-	 * end of the res[] array */
-	if (unlikely(pcd->res[FOUND] & ~FOUND)) {
-		applog(LOG_WARNING, "%s%d: invalid nonce count - HW error",
-				thr->cgpu->drv->name, thr->cgpu->device_id);
-		hw_errors++;
-		thr->cgpu->hw_errors++;
-		pcd->res[FOUND] &= FOUND;
-	}
-
-	for (entry = 0; entry < pcd->res[FOUND]; entry++) {
-		uint32_t nonce = pcd->res[entry];
+	for (entry = 0; entry < pcd->count; entry++) {
+		uint32_t nonce = pcd->nonces[entry];
 
 		applog(LOG_DEBUG, "OCL NONCE %u found in slot %d", nonce, entry);
 		submit_nonce(thr, pcd->work, nonce);
@@ -210,21 +200,43 @@ static void *postcalc_hash(void *userdata)
 	return NULL;
 }
 
-void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res)
+void postcalc_nonces_async(struct thr_info *thr, struct work *work, const uint32_t *nonces, unsigned int count)
 {
-	struct pc_data *pcd = malloc(sizeof(struct pc_data));
+	struct pc_data *pcd;
+
+	if (count > MAXNONCES)
+		count = MAXNONCES;
+
+	pcd = malloc(sizeof(struct pc_data));
 	if (unlikely(!pcd)) {
-		applog(LOG_ERR, "Failed to malloc pc_data in postcalc_hash_async");
+		applog(LOG_ERR, "Failed to malloc pc_data in postcalc_nonces_async");
 		return;
 	}
 
 	pcd->thr = thr;
 	pcd->work = copy_work(work);
-	memcpy(&pcd->res, res, BUFFERSIZE);
+	pcd->count = count;
+	memcpy(pcd->nonces, nonces, sizeof(uint32_t) * count);
 
 	if (pthread_create(&pcd->pth, NULL, postcalc_hash, (void *)pcd)) {
 		applog(LOG_ERR, "Failed to create postcalc_hash thread");
 		return;
 	}
 }
+
+/* For the original result layout with the count in res[FOUND] */
+void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res)
+{
+	/* To prevent corrupt values in FOUND from trying to read beyond the
+	 * end of the res[] array */
+	if (unlikely(res[FOUND] & ~FOUND)) {
+		applog(LOG_WARNING, "%s%d: invalid nonce count - HW error",
+				thr->cgpu->drv->name, thr->cgpu->device_id);
+		hw_errors++;
+		thr->cgpu->hw_errors++;
+		res[FOUND] &= FOUND;
+	}
+
+	postcalc_nonces_async(thr, work, res, res[FOUND]);
+}
 #endif /* HAVE_OPENCL */
@@ -8,8 +8,16 @@
 #define BUFFERSIZE (sizeof(uint32_t) * MAXBUFFERS)
 #define FOUND (0x0F)
 
+/* Compacted output, used by kernels built with COMPACT on OpenCL 1.1+.
+ * Entry 0 counts every nonce found and the first MAXNONCES of them follow,
+ * so only the count needs reading back when nothing was found */
+#define MAXNONCES (0xFF)
+#define COMPACT_BUFFERSIZE (sizeof(uint32_t) * (MAXNONCES + 1))
+#define COMPACT_HEADSIZE (sizeof(uint32_t))
+
 #ifdef HAVE_OPENCL
 extern void precalc_hash(dev_blk_ctx *blk, uint32_t *state, uint32_t *data);
 extern void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res);
+extern void postcalc_nonces_async(struct thr_info *thr, struct work *work, const uint32_t *nonces, unsigned int count);
 #endif /* HAVE_OPENCL */
 #endif /*__FINDNONCE_H__*/
@@ -608,3 +608,272 @@ int get_serial_cts(const int fd)
 	return (flags & MS_CTS_ON) ? 1 : 0;
 }
 #endif // ! WIN32
+
+#if !defined(WIN32) && defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+
+/*
+ * Serial I/O service (--serial-async)
+ *
+ * Rather than each mining thread polling its own serial port, an added port
+ * is watched by the one epoll thread which reads whatever arrives into the
+ * port's buffer, noting when the reply started arriving, and only wakes the
+ * mining thread once a whole reply of 'frame' bytes is buffered, or the
+ * work is restarted
+ * Writes are still done directly on the fd by the driver
+ */
+#define SERIAL_IO_BUFSIZ 256
+#define SERIAL_IO_EVENTS 16
+
+struct serial_io {
+	struct list_head list;
+	int fd;
+	size_t frame;
+	pthread_cond_t cond;
+	bool err;
+	struct timeval tv_first;
+	size_t len;
+	unsigned char buf[SERIAL_IO_BUFSIZ];
+};
+
+static LIST_HEAD(serial_ios);
+static pthread_mutex_t serial_io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t serial_io_pth;
+static int serial_io_epfd = -1;
+static bool serial_io_dead;
+
+// Called with serial_io_lock held
+static void serial_io_fail(struct serial_io *sio)
+{
+	if (!sio->err) {
+		sio->err = true;
+		epoll_ctl(serial_io_epfd, EPOLL_CTL_DEL, sio->fd, NULL);
+	}
+	pthread_cond_signal(&sio->cond);
+}
+
+// Called with serial_io_lock held
+static void serial_io_service(struct serial_io *sio, uint32_t events, struct timeval *now)
+{
+	ssize_t ret;
+
+	if (events & EPOLLIN) {
+		if (sio->len >= sizeof(sio->buf)) {
+			applog(LOG_DEBUG, "Serial I/O fd %d discarding %d unread bytes",
+					sio->fd, (int)(sio->len));
+			sio->len = 0;
+		}
+
+		ret = read(sio->fd, sio->buf + sio->len, sizeof(sio->buf) - sio->len);
+		if (ret > 0) {
+			if (sio->len == 0)
+				copy_time(&sio->tv_first, now);
+			sio->len += ret;
+			if (sio->len >= sio->frame)
+				pthread_cond_signal(&sio->cond);
+		} else if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+			applog(LOG_DEBUG, "Serial I/O fd %d read error %d", sio->fd, errno);
+			serial_io_fail(sio);
+			return;
+		}
+	}
+
+	if (events & (EPOLLERR | EPOLLHUP))
+		serial_io_fail(sio);
+}
+
+static void *serial_io_thread(void __maybe_unused *userdata)
+{
+	struct epoll_event events[SERIAL_IO_EVENTS];
+	struct serial_io *sio;
+	struct timeval now;
+	int i, n;
+
+	RenameThread("serialio");
+
+	while (42) {
+		n = epoll_wait(serial_io_epfd, events, SERIAL_IO_EVENTS, -1);
+		if (unlikely(n < 0)) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		cgtime(&now);
+
+		mutex_lock(&serial_io_lock);
+		for (i = 0; i < n; i++) {
+			// A port removed since epoll_wait() returned is no longer listed
+			list_for_each_entry(sio, &serial_ios, list) {
+				if (sio->fd == events[i].data.fd) {
+					serial_io_service(sio, events[i].events, &now);
+					break;
+				}
+			}
+		}
+		mutex_unlock(&serial_io_lock);
+	}
+
+	applog(LOG_ERR, "Serial I/O epoll_wait failed (%d), using direct reads", errno);
+
+	// Fail every port so the drivers reopen them without the service
+	mutex_lock(&serial_io_lock);
+	serial_io_dead = true;
+	list_for_each_entry(sio, &serial_ios, list)
+		serial_io_fail(sio);
+	mutex_unlock(&serial_io_lock);
+
+	return NULL;
+}
+
+/*
+ * Returns NULL if the service isn't in use, the driver should then read the
+ * fd directly as before
+ */
+struct serial_io *serial_io_add(int fd, size_t frame)
+{
+	struct epoll_event event;
+	struct serial_io *sio;
+
+	if (!opt_serial_async || frame < 1 || frame > SERIAL_IO_BUFSIZ)
+		return NULL;
+
+	sio = calloc(1, sizeof(*sio));
+	if (unlikely(!sio))
+		quit(1, "Failed to calloc serial_io");
+
+	sio->fd = fd;
+	sio->frame = frame;
+	if (unlikely(pthread_cond_init(&sio->cond, NULL)))
+		quit(1, "Failed to pthread_cond_init serial_io cond");
+
+	mutex_lock(&serial_io_lock);
+	if (serial_io_dead)
+		goto failed;
+
+	if (serial_io_epfd == -1) {
+		serial_io_epfd = epoll_create(SERIAL_IO_EVENTS);
+		if (serial_io_epfd == -1) {
+			applog(LOG_ERR, "Serial I/O epoll_create failed (%d), using direct reads", errno);
+			serial_io_dead = true;
+			goto failed;
+		}
+		if (unlikely(pthread_create(&serial_io_pth, NULL, serial_io_thread, NULL)))
+			quit(1, "Failed to create serial I/O thread");
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(serial_io_epfd, EPOLL_CTL_ADD, fd, &event)) {
+		applog(LOG_ERR, "Serial I/O failed to add fd %d (%d), using direct reads", fd, errno);
+		goto failed;
+	}
+
+	list_add_tail(&sio->list, &serial_ios);
+	mutex_unlock(&serial_io_lock);
+
+	return sio;
+
+failed:
+	mutex_unlock(&serial_io_lock);
+	pthread_cond_destroy(&sio->cond);
+	free(sio);
+	return NULL;
+}
+
+// Stop servicing the fd, it must be removed before it's closed
+void serial_io_remove(struct serial_io *sio)
+{
+	if (!sio)
+		return;
+
+	mutex_lock(&serial_io_lock);
+	if (!sio->err)
+		epoll_ctl(serial_io_epfd, EPOLL_CTL_DEL, sio->fd, NULL);
+	list_del(&sio->list);
+	mutex_unlock(&serial_io_lock);
+
+	pthread_cond_destroy(&sio->cond);
+	free(sio);
+}
+
+/*
+ * Wait up to timeout for a whole frame into buf, or until *restart is set
+ * tv_finish is when the frame started arriving, or the time it gave up
+ * Any bytes after the frame are kept for the next call
+ */
+int serial_io_gets(struct serial_io *sio, void *buf, struct timeval *tv_finish, const struct timeval *timeout, bool *restart)
+{
+	struct timeval now, then;
+	struct timespec abstime;
+	int ret;
+
+	cgtime(&now);
+	timeradd(&now, timeout, &then);
+	abstime.tv_sec = then.tv_sec;
+	abstime.tv_nsec = then.tv_usec * 1000;
+
+	mutex_lock(&serial_io_lock);
+	while (42) {
+		if (sio->len >= sio->frame) {
+			memcpy(buf, sio->buf, sio->frame);
+			sio->len -= sio->frame;
+			if (sio->len)
+				memmove(sio->buf, sio->buf + sio->frame, sio->len);
+			copy_time(tv_finish, &sio->tv_first);
+			ret = SERIAL_IO_OK;
+			break;
+		}
+		if (sio->err) {
+			ret = SERIAL_IO_ERROR;
+			break;
+		}
+		if (restart && *restart) {
+			ret = SERIAL_IO_RESTART;
+			break;
+		}
+		if (pthread_cond_timedwait(&sio->cond, &serial_io_lock, &abstime) == ETIMEDOUT
+		&&  sio->len < sio->frame && !sio->err && !(restart && *restart)) {
+			ret = SERIAL_IO_TIMEOUT;
+			break;
+		}
+	}
+	mutex_unlock(&serial_io_lock);
+
+	if (ret != SERIAL_IO_OK)
+		cgtime(tv_finish);
+
+	return ret;
+}
+
+// Wake every waiting serial_io_gets() to see the work restart
+void serial_io_restart(void)
+{
+	struct serial_io *sio;
+
+	mutex_lock(&serial_io_lock);
+	list_for_each_entry(sio, &serial_ios, list)
+		pthread_cond_signal(&sio->cond);
+	mutex_unlock(&serial_io_lock);
+}
+#else
+struct serial_io *serial_io_add(__maybe_unused int fd, __maybe_unused size_t frame)
+{
+	return NULL;
+}
+
+void serial_io_remove(__maybe_unused struct serial_io *sio)
+{
+}
+
+int serial_io_gets(__maybe_unused struct serial_io *sio, __maybe_unused void *buf, struct timeval *tv_finish, __maybe_unused const struct timeval *timeout, __maybe_unused bool *restart)
+{
+	cgtime(tv_finish);
+	return SERIAL_IO_ERROR;
+}
+
+void serial_io_restart(void)
+{
+}
+#endif
@@ -38,6 +38,18 @@ extern FILE *open_bitstream(const char *dname, const char *filename);
 
 extern int get_serial_cts(int fd);
 
+#define SERIAL_IO_ERROR -1
+#define SERIAL_IO_OK 0
+#define SERIAL_IO_RESTART 1
+#define SERIAL_IO_TIMEOUT 2
+
+struct serial_io;
+
+extern struct serial_io *serial_io_add(int fd, size_t frame);
+extern void serial_io_remove(struct serial_io *sio);
+extern int serial_io_gets(struct serial_io *sio, void *buf, struct timeval *tv_finish, const struct timeval *timeout, bool *restart);
+extern void serial_io_restart(void);
+
 #ifndef WIN32
 extern const struct timeval tv_timeout_default;
 extern const struct timeval tv_inter_char_default;
@@ -29,4 +29,4 @@ export CXXLDFLAGS="-L/usr/local/cuda/lib64 -L/usr/lib64"
 export CPPLDFLAGS="-L/usr/local/cuda/lib64 -L/usr/lib64"
 #/opt/intel/bin/iccvars.sh intel64
 #/opt/intel/bin/compilervars.sh intel64
-./configure $1 LIBCURL_LIBS="/usr/lib64/libcurl.so" --libdir=/usr/lib64 --enable-npumining --enable-mpumining --enable-cudadrive --enable-cpumining --enable-cldrive --prefix=/usr 
+./configure $1 LIBCURL_LIBS="/usr/lib64/libcurl.so" --libdir=/usr/lib64 --enable-npumining --enable-mpumining --enable-cpumining --enable-opencl --prefix=/usr 
@@ -10,6 +10,7 @@
 #include "config.h"
 
 #include <unistd.h>
+#include <pthread.h>
 
 #include "logging.h"
 #include "miner.h"
@@ -48,6 +49,259 @@ static void log_generic(int prio, const char *fmt, va_list ap);
 static void log_generic_short(int prio, const char *fmt, va_list ap);
 static void flog_generic_short(int prio, const char *fmt, va_list ap);
 
+/*
+ * Once log_thread_start() has run, messages are formatted by the caller into
+ * a bounded multi-producer ring and a single writer thread does the stderr,
+ * curses, syslog and file output in batches. A full ring drops the message
+ * and counts it rather than blocking the mining thread that logged it.
+ */
+#define LOG_RING	1024	/* must be a power of 2 */
+#define LOG_LINESIZ	1024
+#define LOG_WAIT_MS	100
+
+enum log_kind {
+	LOG_KIND_STAMP,
+	LOG_KIND_SHORT,
+	LOG_KIND_FILE,
+};
+
+struct log_slot {
+	volatile unsigned int seq;
+	int prio;
+	enum log_kind kind;
+	time_t when;
+	char line[LOG_LINESIZ];
+};
+
+static struct log_slot log_ring[LOG_RING];
+static volatile unsigned int log_head;
+static unsigned int log_tail;
+static volatile unsigned int log_dropped;
+static volatile unsigned int log_producers;
+static volatile bool log_running;
+static volatile bool log_sleeping;
+static bool log_tty;
+static pthread_t log_thr;
+static pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake_cond = PTHREAD_COND_INITIALIZER;
+
+/* Returns false when the writer thread isn't running and the caller must log
+ * synchronously */
+static bool log_queue(int prio, enum log_kind kind, const char *fmt, va_list ap) {
+	struct log_slot *slot;
+	struct timeval tv;
+	unsigned int pos;
+	int dif;
+
+	/* Counted in before looking at log_running so log_thread_stop() can
+	 * wait for every slot claimed while the ring was live to be published */
+	__sync_fetch_and_add(&log_producers, 1);
+	if (!log_running) {
+		__sync_fetch_and_sub(&log_producers, 1);
+		return false;
+	}
+
+	pos = log_head;
+	while (42) {
+		slot = &log_ring[pos & (LOG_RING - 1)];
+		dif = (int)(slot->seq - pos);
+		if (dif == 0) {
+			if (__sync_bool_compare_and_swap(&log_head, pos, pos + 1))
+				break;
+		} else if (dif < 0) {
+			__sync_fetch_and_add(&log_dropped, 1);
+			__sync_fetch_and_sub(&log_producers, 1);
+			return true;
+		}
+		pos = log_head;
+	}
+
+	cgtime(&tv);
+	slot->prio = prio;
+	slot->kind = kind;
+	slot->when = tv.tv_sec;
+	vsnprintf(slot->line, sizeof(slot->line), fmt, ap);
+	__sync_synchronize();
+	slot->seq = pos + 1;
+	__sync_fetch_and_sub(&log_producers, 1);
+
+	__sync_synchronize();
+	if (log_sleeping) {
+		mutex_lock(&log_wake_lock);
+		pthread_cond_signal(&log_wake_cond);
+		mutex_unlock(&log_wake_lock);
+	}
+	return true;
+}
+
+static void log_curses(int prio, char *f, ...) {
+	va_list ap;
+
+	va_start(ap, f);
+	my_log_curses(prio, f, ap);
+	va_end(ap);
+}
+
+static void log_write(int prio, enum log_kind kind, time_t when, const char *line) {
+	static time_t stamp_when = -1;
+	static char stamp[32];
+	char f[32];
+
+	if (kind == LOG_KIND_FILE) {
+		if (flog)
+			fprintf(flog, "%s\n", line);
+		return;
+	}
+
+#ifdef HAVE_SYSLOG_H
+	if (use_syslog) {
+		syslog(prio, "%s", line);
+		return;
+	}
+#endif
+
+	if (kind == LOG_KIND_STAMP) {
+		/* Only redo the localtime conversion once a second */
+		if (when != stamp_when) {
+			strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S",
+					localtime(&when));
+			stamp_when = when;
+		}
+		if (!log_tty)
+			fprintf(stderr, " [%s] %s\n", stamp, line);
+		strcpy(f, " [%s] %s\n");
+		log_curses(prio, f, stamp, line);
+	} else {
+		if (!log_tty)
+			fprintf(stderr, " %s\n", line);
+		strcpy(f, " %s\n");
+		log_curses(prio, f, line);
+	}
+}
+
+/* Only ever run by one thread at a time: the writer, or log_thread_stop()
+ * once the writer has been joined */
+static bool log_drain(void) {
+	struct log_slot *slot;
+	unsigned int dropped;
+	bool any = false;
+
+	while (42) {
+		slot = &log_ring[log_tail & (LOG_RING - 1)];
+		if ((int)(slot->seq - (log_tail + 1)) < 0)
+			break;
+		__sync_synchronize();
+		log_write(slot->prio, slot->kind, slot->when, slot->line);
+		__sync_synchronize();
+		slot->seq = log_tail + LOG_RING;
+		log_tail++;
+		any = true;
+	}
+
+	dropped = __sync_lock_test_and_set(&log_dropped, 0);
+	if (dropped) {
+		char line[64];
+
+		sprintf(line, "Logger overloaded, dropped %u messages", dropped);
+		log_write(LOG_WARNING, LOG_KIND_STAMP, time(NULL), line);
+		any = true;
+	}
+
+	if (any) {
+		if (!log_tty)
+			fflush(stderr);
+		if (flog)
+			fflush(flog);
+	}
+	return any;
+}
+
+static bool log_pending(void) {
+	struct log_slot *slot = &log_ring[log_tail & (LOG_RING - 1)];
+
+	return (int)(slot->seq - (log_tail + 1)) >= 0 || log_dropped;
+}
+
+static void *log_thread(__maybe_unused void *userdata) {
+	struct timespec abstime;
+	struct timeval now;
+
+	RenameThread("logger");
+
+	while (log_running) {
+		if (log_drain())
+			continue;
+
+		mutex_lock(&log_wake_lock);
+		log_sleeping = true;
+		__sync_synchronize();
+		if (log_running && !log_pending()) {
+			cgtime(&now);
+			abstime.tv_sec = now.tv_sec;
+			abstime.tv_nsec = now.tv_usec * 1000 + LOG_WAIT_MS * 1000000;
+			if (abstime.tv_nsec >= 1000000000) {
+				abstime.tv_sec++;
+				abstime.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&log_wake_cond, &log_wake_lock, &abstime);
+		}
+		log_sleeping = false;
+		mutex_unlock(&log_wake_lock);
+	}
+	log_drain();
+	return NULL;
+}
+
+void log_thread_start(void) {
+	int i;
+
+	if (log_running)
+		return;
+
+	for (i = 0; i < LOG_RING; i++)
+		log_ring[i].seq = log_head + i;
+	log_tail = log_head;
+	log_tty = isatty(fileno((FILE *) stderr));
+	__sync_synchronize();
+	log_running = true;
+	if (unlikely(pthread_create(&log_thr, NULL, log_thread, NULL))) {
+		log_running = false;
+		applog(LOG_WARNING, "Failed to create logging thread, logging synchronously");
+	}
+}
+
+/* Flushes everything queued and returns to synchronous logging. Safe to call
+ * when the thread was never started or has already been stopped */
+void log_thread_stop(void) {
+	unsigned int lost;
+	int i;
+
+	if (!__sync_bool_compare_and_swap(&log_running, true, false))
+		return;
+
+	mutex_lock(&log_wake_lock);
+	pthread_cond_signal(&log_wake_cond);
+	mutex_unlock(&log_wake_lock);
+	pthread_join(log_thr, NULL);
+
+	/* Producers that saw log_running before it was cleared may still be
+	 * filling in their slots, give them a moment to publish */
+	for (i = 0; i < LOG_WAIT_MS && log_producers; i++)
+		nmsleep(1);
+
+	/* Catch anything queued while the writer was exiting */
+	log_drain();
+
+	/* A slot still unpublished holds up everything after it, report those
+	 * as dropped rather than lose them silently */
+	lost = log_head - log_tail;
+	if (lost) {
+		__sync_fetch_and_add(&log_dropped, lost);
+		log_tail = log_head;
+		log_drain();
+	}
+}
+
 void vapplog(int prio, const char *fmt, va_list ap) {
 	if (!opt_debug && prio == LOG_DEBUG)
 		return;
@@ -78,6 +332,9 @@ void fapplog_short(int prio, const char *fmt, va_list ap) {
  * equals vapplog() without additional priority checks
  */
 static void log_generic(int prio, const char *fmt, va_list ap) {
+	if (log_queue(prio, LOG_KIND_STAMP, fmt, ap))
+		return;
+
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog) {
 		vsyslog(prio, fmt, ap);
@@ -115,6 +372,9 @@ static void log_generic(int prio, const char *fmt, va_list ap) {
 }
 
 static void log_generic_short(int prio, const char *fmt, va_list ap) {
+	if (log_queue(prio, LOG_KIND_SHORT, fmt, ap))
+		return;
+
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog) {
 		vsyslog(prio, fmt, ap);
@@ -154,6 +414,11 @@ static void flog_generic_short(int prio, const char *fmt, va_list ap) {
 	char *f;
 	int len;
 
+	if (!flog)
+		return;
+	if (log_queue(prio, LOG_KIND_FILE, fmt, ap))
+		return;
+
 	len = 40 + strlen(fmt) + 22;
 	f = alloca(len);
 	sprintf(f, "%s\n", fmt);
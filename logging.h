@@ -34,6 +34,10 @@ extern void fapplog_short(int prio, const char *fmt, va_list ap);
 extern void vapplog_short(int prio, const char *fmt, va_list ap);
 extern void applog(int prio, const char *fmt, ...);
 
+/* move output to a background writer thread and back */
+extern void log_thread_start(void);
+extern void log_thread_stop(void);
+
 /* high-level logging functions with implicit priority */
 extern void log_error(const char *fmt, ...);
 extern void log_warning(const char *fmt, ...);
@@ -410,6 +410,9 @@ struct cgminer_pool_stats {
 	uint64_t times_received;
 	uint64_t bytes_received;
 	uint64_t net_bytes_received;
+	double submit_rtt;
+	double submit_rtt_max;
+	double submit_rtt_rolling;
 };
 
 struct cgpu_info {
@@ -492,6 +495,7 @@ struct cgpu_info {
 #endif
 	struct timeval tv_gpustart;
 	int intervals;
+	bool autotune;
 #endif
 
 	bool new_work;
@@ -538,6 +542,10 @@ struct cgpu_info {
 
 	pthread_rwlock_t qlock;
 	struct work *queued_work;
+	/* Work not yet on the device, oldest first */
+	struct list_head unqueued_work;
+	/* Work on the device, hashed by queued_key */
+	struct work *queued_index;
 	unsigned int queued_count;
 };
 
@@ -826,6 +834,9 @@ extern bool use_curses;
 extern char *opt_api_allow;
 extern char *opt_api_groups;
 extern char *opt_api_description;
+extern int opt_api_clients;
+extern int opt_api_metrics_port;
+extern int opt_api_snapshot;
 extern int opt_api_port;
 extern bool opt_api_listen;
 extern bool opt_api_network;
@@ -833,6 +844,7 @@ extern bool opt_delaynet;
 extern bool opt_restart;
 extern char *opt_icarus_options;
 extern char *opt_icarus_timing;
+extern bool opt_serial_async;
 extern bool opt_worktime;
 #ifdef USE_AVALON
 extern char *opt_avalon_options;
@@ -841,12 +853,15 @@ extern char *opt_avalon_options;
 extern char *opt_usb_select;
 extern int opt_usbdump;
 extern bool opt_usb_list_all;
+extern bool opt_usb_async;
+extern char *opt_usb_sim;
 #endif
 #ifdef USE_BITFORCE
 extern bool opt_bfl_noncerange;
 #endif
 extern bool ping;
 extern int swork_id;
+extern const char *workpadding;
 
 extern pthread_rwlock_t netacc_lock;
 
@@ -876,6 +891,9 @@ extern int opt_expiry;
 #ifdef USE_USBUTILS
 extern pthread_mutex_t cgusb_lock;
 #endif
+#ifdef HAVE_LIBUSB
+extern bool usb_unavailable;
+#endif
 
 extern cglock_t control_lock;
 extern pthread_mutex_t hash_lock;
@@ -905,7 +923,17 @@ extern int set_memoryclock(int gpu, int iMemoryClock);
 
 extern void api(int thr_id);
 
+struct IP4ACCESS {
+	in_addr_t ip;
+	in_addr_t mask;
+	char group;
+};
+
+extern int setup_ip4access(const char *allow, struct IP4ACCESS **access);
+extern bool ip4access_allowed(struct IP4ACCESS *access, int count, struct sockaddr_in *cli, char *group);
+
 extern struct pool *current_pool(void);
+extern int total_staged(void);
 extern int enabled_pools;
 extern bool detect_stratum(struct pool *pool, char *url);
 extern void print_summary(void);
@@ -1018,22 +1046,26 @@ enum pool_enable {
 	POOL_REJECTING,
 };
 
+/* Deepest merkle branch a stratum notify may carry, far beyond any real
+ * block since each level doubles the transaction count */
+#define STRATUM_MAX_MERKLES 64
+
+/* The current stratum job, held in binary form so that generating work from
+ * it is a matter of copying rather than decoding hex */
 struct stratum_work {
 	char *job_id;
-	char *prev_hash;
-	char *coinbase1;
-	char *coinbase2;
-	char **merkle;
-	char *bbversion;
-	char *nbit;
-	char *ntime;
+	size_t job_id_size;
+	char ntime[12];
+	unsigned char *coinbase;
+	size_t coinbase_size;
+	unsigned char merkle_bin[STRATUM_MAX_MERKLES][32];
+	unsigned char header_bin[128];
 	bool clean;
 
 	size_t cb1_len;
 	size_t cb2_len;
 	size_t cb_len;
 
-	size_t header_len;
 	int merkles;
 	double diff;
 };
@@ -1041,6 +1073,14 @@ struct stratum_work {
 #define RBUFSIZE 8192
 #define RECVSIZE (RBUFSIZE - 4)
 
+/* Hash of a GBT transaction, looked up by the txid bitcoind reports */
+struct gbt_txn {
+	unsigned char txid[32];
+	unsigned char hash[32];
+	bool seen;
+	UT_hash_handle hh;
+};
+
 struct pool {
 	int pool_no;
 	int prio;
@@ -1112,6 +1152,13 @@ struct pool {
 	SOCKETTYPE sock;
 	char *sockbuf;
 	size_t sockbuf_size;
+	size_t sockbuf_start; /* first byte not yet handed out as a line */
+	size_t sockbuf_end; /* one past the last byte received */
+	size_t sockbuf_scan; /* bytes before this have no \n in them */
+	char *sendbuf; /* share lines the socket has not taken yet */
+	size_t sendbuf_size;
+	size_t sendbuf_len;
+	size_t sendbuf_sent;
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	char *nonce1;
 	size_t n1_len;
@@ -1125,7 +1172,17 @@ struct pool {
 	struct stratum_work swork;
 	pthread_t stratum_thread;
 	pthread_mutex_t stratum_lock;
+	/* Stratum event loop state, see stratum_loop_thread */
+	SOCKETTYPE polled_sock;
+	bool stratum_polled;
+	bool stratum_queued;
+	bool stratum_parked;
+	int stratum_backoff;
+	struct timeval tv_stratum_rx;
+	struct timeval tv_stratum_retry;
 	int sshares; /* stratum shares submitted waiting on response */
+	int sshares_sent; /* of which actually sent, bounded by opt_stratum_window */
+	struct list_head sshare_pending; /* of which waiting to be sent */
 
 	/* GBT  variables */
 	bool has_gbt;
@@ -1142,6 +1199,9 @@ struct pool {
 	unsigned char *gbt_coinbase;
 	unsigned char *txn_hashes;
 	int gbt_txns;
+	unsigned char *gbt_merkle_bin;
+	int gbt_merkles;
+	struct gbt_txn *gbt_txn_cache;
 	int coinbase_len;
 	struct timeval tv_lastwork;
 };
@@ -1153,6 +1213,13 @@ struct pool {
 #define GETWORK_MODE_STRATUM 'S'
 #define GETWORK_MODE_GBT 'G'
 
+/* The queued work index key is the midstate followed by the header tail
+ * (merkle root tail, ntime, nbits) that queued drivers get back with a nonce */
+#define QUEUED_MIDSTATE_LEN 32
+#define QUEUED_TAIL_OFFSET 64
+#define QUEUED_TAIL_LEN 12
+#define QUEUED_KEY_LEN (QUEUED_MIDSTATE_LEN + QUEUED_TAIL_LEN)
+
 struct work {
 	unsigned char	data[128];
 	unsigned char	midstate[32];
@@ -1196,6 +1263,10 @@ struct work {
 	int		id;
 	UT_hash_handle	hh;
 
+	struct list_head qlist;
+	unsigned char	queued_key[QUEUED_KEY_LEN];
+	UT_hash_handle	qhh;
+
 	double		work_difficulty;
 
 	// Allow devices to identify work if multiple sub-devices
@@ -1330,5 +1401,7 @@ extern struct api_data *api_add_freq(struct api_data *root, char *name, double *
 extern struct api_data *api_add_volts(struct api_data *root, char *name, float *data, bool copy_data);
 extern struct api_data *api_add_hs(struct api_data *root, char *name, double *data, bool copy_data);
 extern struct api_data *api_add_diff(struct api_data *root, char *name, double *data, bool copy_data);
+extern int api_subscribers;
+extern void api_event(const char *event, struct api_data *root);
 
 #endif /* __MINER_H__ */
@@ -0,0 +1,602 @@
+#!/usr/bin/env python
+#
+# This program is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation; either version 3 of the License, or (at your option) any later
+# version.  See COPYING for more details.
+#
+# A local mock pool for end to end testing of cgminer without a real pool
+#
+# usAge: ./mockpool.py [options]
+#  OR	python mockpool.py [options]
+#
+#   serves stratum on --stratum-port and getwork/getblocktemplate on
+#   --http-port (0 disables either) from a deterministic fake chain built
+#   from --seed, so two runs with the same options hand out the same work
+#
+#   the stratum side can be made to misbehave on a schedule:
+#	--notify secs		send a new mining.notify every secs
+#	--clean-every n		every n'th notify is a new block with clean_jobs
+#	--diff d1,d2,...	share difficulty, cycled every --diff-every secs
+#	--reconnect-every secs	drop every connection, or with
+#				--reconnect-mode reconnect send client.reconnect
+#
+#   every share is checked against the work it was issued (job, merkle root,
+#   duplicates, difficulty) and the accept latency - the time from the work
+#   being handed out to the share arriving, plus the time taken to check it -
+#   is reported every --report secs and at exit (--duration or ^C)
+#
+# e.g. mock pool at difficulty 0.01, new block every 30 seconds:
+#	./mockpool.py --diff 0.01 --notify 5 --clean-every 6
+#	cgminer -o stratum+tcp://127.0.0.1:3333 -u x -p x
+#
+# and for getwork only (getblocktemplate returns an error):
+#	./mockpool.py --stratum-port 0 --no-gbt
+#	cgminer -o http://127.0.0.1:8332 -u x -p x
+
+import sys
+import time
+import json
+import socket
+import struct
+import hashlib
+import binascii
+import argparse
+import threading
+
+try:
+	import socketserver
+	from http.server import BaseHTTPRequestHandler, HTTPServer
+except ImportError:
+	import SocketServer as socketserver
+	from BaseHTTPServer import BaseHTTPRequestHandler, HTTPServer
+
+hexlify = lambda b: binascii.hexlify(b).decode('ascii')
+unhexlify = binascii.unhexlify
+
+DIFF1 = 0xffff * 2 ** 208
+NBITS = '1a44b9f2'
+VERSION = 2
+
+def dsha(b):
+	return hashlib.sha256(hashlib.sha256(b).digest()).digest()
+
+# Byte swap every 32 bit word, the stratum prevhash and getwork data order
+def swap4(b):
+	return b''.join([b[i:i + 4][::-1] for i in range(0, len(b), 4)])
+
+def hash_value(header):
+	return int(hexlify(dsha(header)[::-1]), 16)
+
+def diff_target(diff):
+	return int(DIFF1 / diff)
+
+def share_diff(header):
+	return DIFF1 / float(max(hash_value(header), 1))
+
+# The siblings of the coinbase, leaf 0, at each level of the tree
+def merkle_branch(txids):
+	branch = []
+	level = [None] + txids
+	while len(level) > 1:
+		branch.append(level[1])
+		if len(level) % 2:
+			level.append(level[-1])
+		level = [None] + [dsha(level[i] + level[i + 1])
+				for i in range(2, len(level), 2)]
+	return branch
+
+def merkle_root(coinbase, branch):
+	root = dsha(coinbase)
+	for h in branch:
+		root = dsha(root + h)
+	return root
+
+def log(msg):
+	sys.stdout.write('%s %s\n' % (time.strftime('%H:%M:%S'), msg))
+	sys.stdout.flush()
+
+# The coinbase is split around a 4 byte extranonce1 and the miner's nonce2 so
+# the same transaction serves stratum (cb1 + en1 + en2 + cb2) and gbt, where
+# cgminer appends its 4 bytes of nonce2 to the script at byte 41
+def coinbase_parts(height, n2size):
+	script = b'\x03' + struct.pack('<I', height)[:3] + b'/mockpool/'
+	prefix = (struct.pack('<I', 1) + b'\x01' + b'\x00' * 32 +
+			b'\xff\xff\xff\xff')
+	pkscript = b'\x76\xa9\x14' + hashlib.sha256(b'mockpool').digest()[:20] + b'\x88\xac'
+	suffix = (b'\xff\xff\xff\xff' + b'\x01' + struct.pack('<Q', 2500000000) +
+			struct.pack('B', len(pkscript)) + pkscript + b'\x00' * 4)
+	cb1 = prefix + struct.pack('B', len(script) + 4 + n2size) + script
+	gbt = prefix + struct.pack('B', len(script)) + script + suffix
+	return cb1, suffix, gbt
+
+class Block(object):
+	def __init__(self, seed, height, txns, n2size):
+		self.height = height
+		self.prevhash = dsha(('%s/%d/prev' % (seed, height)).encode())
+		self.ntime = 1500000000 + height * 600
+		self.txdata = [dsha(('%s/%d/tx%d' % (seed, height, i)).encode()) * 8
+				for i in range(txns)]
+		self.txids = [dsha(d) for d in self.txdata]
+		self.branch = merkle_branch(self.txids)
+		self.cb1, self.cb2, self.gbt_coinbase = coinbase_parts(height, n2size)
+
+class Stats(object):
+	def __init__(self):
+		self.lock = threading.Lock()
+		self.start = time.time()
+		self.accepted = 0
+		self.rejected = {}
+		self.best = 0.0
+		self.diff_accepted = 0.0
+		self.latency = []
+		self.check = []
+		self.jobs = 0
+		self.blocks = 0
+		self.connects = 0
+
+	def share(self, reason, latency, check, diff, sdiff):
+		with self.lock:
+			if reason is None:
+				self.accepted += 1
+				self.diff_accepted += diff
+				self.latency.append(latency)
+			else:
+				self.rejected[reason] = self.rejected.get(reason, 0) + 1
+			self.check.append(check)
+			self.best = max(self.best, sdiff)
+
+	def report(self, final=False):
+		with self.lock:
+			elapsed = max(time.time() - self.start, 0.001)
+			lat = sorted(self.latency)
+			rej = sum(self.rejected.values())
+			msg = ('%s %.0fs: A:%d R:%d (%s) %.2f shares/min, ~%.3f MH/s, '
+					'best %.3f, jobs %d, blocks %d, connects %d' %
+				('FINAL' if final else 'STATS', elapsed, self.accepted, rej,
+				', '.join(['%s %d' % r for r in sorted(self.rejected.items())]) or 'none',
+				(self.accepted + rej) * 60 / elapsed,
+				self.diff_accepted * 2 ** 32 / elapsed / 1e6, self.best,
+				self.jobs, self.blocks, self.connects))
+			if lat:
+				msg += ('\n\taccept latency ms: min %.1f avg %.1f p50 %.1f p95 %.1f max %.1f' %
+					(lat[0] * 1000, sum(lat) * 1000 / len(lat),
+					lat[len(lat) // 2] * 1000,
+					lat[min(len(lat) - 1, int(len(lat) * 0.95))] * 1000,
+					lat[-1] * 1000))
+			if self.check:
+				msg += ('\n\tshare check ms: avg %.3f max %.3f' %
+					(sum(self.check) * 1000 / len(self.check),
+					max(self.check) * 1000))
+		log(msg)
+
+class Pool(object):
+	def __init__(self, opts):
+		self.opts = opts
+		self.lock = threading.RLock()
+		self.changed = threading.Condition(self.lock)
+		self.stats = Stats()
+		self.diffs = [float(d) for d in opts.diff.split(',')]
+		self.diff_no = 0
+		self.height = 0
+		self.block = None
+		self.job_no = 0
+		self.jobs = {}
+		self.clients = []
+		self.client_no = 0
+		self.gbt_no = 0
+		self.templates = {}
+		self.getwork = {}
+		self.dupes = set()
+		self.new_block()
+
+	@property
+	def diff(self):
+		return self.diffs[self.diff_no]
+
+	def new_block(self):
+		with self.lock:
+			self.height += 1
+			self.block = Block(self.opts.seed, self.height, self.opts.txns,
+					self.opts.n2size)
+			self.stats.blocks += 1
+			self.dupes = set()
+			self.changed.notify_all()
+
+	# Stratum jobs only live in the current block, a clean notify drops them
+	def new_job(self, clean):
+		with self.lock:
+			if clean:
+				self.new_block()
+				self.jobs = {}
+			self.job_no += 1
+			job_id = '%x' % self.job_no
+			b = self.block
+			job = {'id': job_id, 'block': b, 'time': time.time(),
+				'ntime': b.ntime + self.job_no, 'clean': clean}
+			job['notify'] = [job_id, hexlify(swap4(b.prevhash)),
+				hexlify(b.cb1), hexlify(b.cb2),
+				[hexlify(h) for h in b.branch], '%08x' % VERSION,
+				NBITS, '%08x' % job['ntime'], clean]
+			self.jobs[job_id] = job
+			self.stats.jobs += 1
+			return job
+
+	def broadcast(self, method, params):
+		with self.lock:
+			clients = list(self.clients)
+		for c in clients:
+			c.send({'id': None, 'method': method, 'params': params})
+
+	def check(self, header, issued, diff, dupes, key):
+		start = time.time()
+		sdiff = share_diff(header)
+		if key in dupes:
+			reason = 'duplicate'
+		elif hash_value(header) > diff_target(diff):
+			reason = 'low-difficulty'
+		else:
+			dupes.add(key)
+			reason = None
+		now = time.time()
+		self.stats.share(reason, now - issued, now - start, diff, sdiff)
+		return reason
+
+	def scheduler(self):
+		opts = self.opts
+		now = time.time()
+		next_notify = now + opts.notify
+		next_diff = now + opts.diff_every if opts.diff_every else None
+		next_reconnect = now + opts.reconnect_every if opts.reconnect_every else None
+		next_report = now + opts.report
+		end = now + opts.duration if opts.duration else None
+		notifies = 0
+		while True:
+			time.sleep(0.05)
+			now = time.time()
+			if next_diff and now >= next_diff:
+				next_diff += opts.diff_every
+				with self.lock:
+					self.diff_no = (self.diff_no + 1) % len(self.diffs)
+				log('difficulty %g' % self.diff)
+				self.broadcast('mining.set_difficulty', [self.diff])
+			if now >= next_notify:
+				next_notify += opts.notify
+				notifies += 1
+				clean = opts.clean_every and not notifies % opts.clean_every
+				job = self.new_job(bool(clean))
+				if clean:
+					log('new block %d' % self.height)
+				self.broadcast('mining.notify', job['notify'])
+			if next_reconnect and now >= next_reconnect:
+				next_reconnect += opts.reconnect_every
+				with self.lock:
+					clients = list(self.clients)
+				log('%s %d clients' % ('reconnecting' if opts.reconnect_mode ==
+					'reconnect' else 'dropping', len(clients)))
+				for c in clients:
+					if opts.reconnect_mode == 'reconnect':
+						c.send({'id': None, 'method': 'client.reconnect', 'params': []})
+					c.close()
+			if now >= next_report:
+				next_report += opts.report
+				self.stats.report()
+			if end and now >= end:
+				return
+
+class StratumClient(socketserver.StreamRequestHandler):
+	def setup(self):
+		socketserver.StreamRequestHandler.setup(self)
+		pool = self.server.pool
+		self.pool = pool
+		self.send_lock = threading.Lock()
+		self.authorised = False
+		self.job_diff = {}
+		self.dupes = set()
+		with pool.lock:
+			pool.client_no += 1
+			self.en1 = struct.pack('>I', pool.client_no)
+			pool.stats.connects += 1
+		log('stratum connect %s en1 %s' % (self.client_address[0], hexlify(self.en1)))
+
+	def send(self, msg):
+		data = (json.dumps(msg) + '\n').encode()
+		with self.send_lock:
+			try:
+				self.wfile.write(data)
+				self.wfile.flush()
+			except (socket.error, ValueError):
+				pass
+		if msg.get('method') == 'mining.notify':
+			with self.pool.lock:
+				self.job_diff[msg['params'][0]] = self.pool.diff
+
+	def reply(self, msg_id, result, error=None):
+		self.send({'id': msg_id, 'result': result, 'error': error})
+
+	def close(self):
+		try:
+			self.request.shutdown(socket.SHUT_RDWR)
+		except socket.error:
+			pass
+
+	def handle(self):
+		pool = self.pool
+		while True:
+			try:
+				line = self.rfile.readline()
+			except socket.error:
+				break
+			if not line:
+				break
+			try:
+				msg = json.loads(line.decode())
+				method = msg.get('method')
+				params = msg.get('params') or []
+			except (ValueError, AttributeError):
+				log('bad json from %s: %r' % (self.client_address[0], line))
+				break
+			msg_id = msg.get('id')
+			if method == 'mining.subscribe':
+				self.reply(msg_id, [[['mining.notify', hexlify(self.en1)]],
+					hexlify(self.en1), pool.opts.n2size])
+			elif method == 'mining.authorize':
+				self.reply(msg_id, True)
+				if not self.authorised:
+					self.authorised = True
+					with pool.lock:
+						pool.clients.append(self)
+						job = pool.jobs.get('%x' % pool.job_no) or pool.new_job(False)
+					self.send({'id': None, 'method': 'mining.set_difficulty',
+						'params': [pool.diff]})
+					notify = list(job['notify'])
+					notify[-1] = True
+					self.send({'id': None, 'method': 'mining.notify', 'params': notify})
+			elif method == 'mining.submit':
+				self.submit(msg_id, params)
+			elif method == 'mining.extranonce.subscribe':
+				self.reply(msg_id, False)
+			else:
+				self.reply(msg_id, None, [20, 'Unsupported method', None])
+		with pool.lock:
+			if self in pool.clients:
+				pool.clients.remove(self)
+		log('stratum disconnect %s' % self.client_address[0])
+
+	def submit(self, msg_id, params):
+		pool = self.pool
+		if not self.authorised or len(params) < 5:
+			self.reply(msg_id, False, [24, 'Unauthorized worker', None])
+			return
+		worker, job_id, en2, ntime, nonce = params[:5]
+		with pool.lock:
+			job = pool.jobs.get(job_id)
+			diff = self.job_diff.get(job_id, pool.diff)
+		reason = None
+		if not job:
+			reason = 'stale'
+		elif len(en2) != pool.opts.n2size * 2 or len(ntime) != 8 or len(nonce) != 8:
+			reason = 'bad-format'
+		if reason:
+			pool.stats.share(reason, 0, 0, diff, 0)
+		else:
+			b = job['block']
+			cb = b.cb1 + self.en1 + unhexlify(en2) + b.cb2
+			header = (struct.pack('<I', VERSION) + b.prevhash +
+				merkle_root(cb, b.branch) + unhexlify(ntime)[::-1] +
+				unhexlify(NBITS)[::-1] + unhexlify(nonce)[::-1])
+			reason = pool.check(header, job['time'], diff, self.dupes,
+					(job_id, en2, ntime, nonce))
+		if reason:
+			log('reject %s job %s: %s' % (worker, job_id, reason))
+			self.reply(msg_id, False, [{'stale': 21, 'duplicate': 22,
+				'low-difficulty': 23}.get(reason, 20), reason, None])
+		else:
+			self.reply(msg_id, True)
+
+class Http(BaseHTTPRequestHandler):
+	protocol_version = 'HTTP/1.1'
+
+	def log_message(self, format, *args):
+		pass
+
+	def respond(self, msg_id, result, error=None):
+		body = json.dumps({'id': msg_id, 'result': result, 'error': error}).encode()
+		self.send_response(200)
+		self.send_header('Content-Type', 'application/json')
+		self.send_header('Content-Length', str(len(body)))
+		self.end_headers()
+		self.wfile.write(body)
+
+	# cgminer's curl sends the request chunked alongside a Content-Length
+	def body(self):
+		if 'chunked' not in (self.headers.get('Transfer-Encoding') or ''):
+			return self.rfile.read(int(self.headers['Content-Length']))
+		data = b''
+		while True:
+			size = int(self.rfile.readline().split(b';')[0], 16)
+			data += self.rfile.read(size)
+			self.rfile.readline()
+			if not size:
+				return data
+
+	def do_POST(self):
+		pool = self.server.pool
+		try:
+			req = json.loads(self.body().decode())
+			method = req.get('method')
+			params = req.get('params') or []
+		except (ValueError, TypeError, AttributeError):
+			self.send_error(400)
+			return
+		msg_id = req.get('id')
+		if method == 'getwork' and not params:
+			self.respond(msg_id, self.getwork())
+		elif method == 'getwork':
+			self.respond(msg_id, self.getwork_submit(params[0]) is None)
+		elif method == 'getblocktemplate' and not pool.opts.no_gbt:
+			self.respond(msg_id, self.template(params))
+		elif method == 'submitblock' and not pool.opts.no_gbt:
+			self.respond(msg_id, self.submitblock(params))
+		else:
+			self.respond(msg_id, None, {'code': -32601, 'message': 'Method not found'})
+
+	# Each getwork gets its own merkle root, which is how it is found again
+	def getwork(self):
+		pool = self.server.pool
+		with pool.lock:
+			pool.gbt_no += 1
+			b = pool.block
+			root = dsha(('%s/%d/getwork%d' % (pool.opts.seed, b.height,
+				pool.gbt_no)).encode())
+			pool.getwork[root] = (b, time.time(), pool.diff)
+			if len(pool.getwork) > 4096:
+				pool.getwork.pop(next(iter(pool.getwork)))
+			diff = pool.diff
+		header = (struct.pack('<I', VERSION) + b.prevhash + root +
+			struct.pack('<I', b.ntime) + unhexlify(NBITS)[::-1] + b'\x00' * 4)
+		padding = b'\x80' + b'\x00' * 45 + b'\x02\x80'
+		return {'data': hexlify(swap4(header + padding)),
+			'target': hexlify(unhexlify('%064x' % diff_target(diff))[::-1])}
+
+	def getwork_submit(self, data):
+		pool = self.server.pool
+		try:
+			header = swap4(unhexlify(data)[:80])
+		except (TypeError, binascii.Error):
+			header = b''
+		with pool.lock:
+			work = pool.getwork.get(header[36:68])
+			current = pool.block
+		if len(header) != 80 or not work:
+			reason = 'unknown-work'
+		elif work[0] is not current:
+			reason = 'stale'
+		else:
+			reason = pool.check(header, work[1], work[2],
+					pool.dupes, header)
+			if reason:
+				log('reject getwork: %s' % reason)
+			return reason
+		pool.stats.share(reason, 0, 0, pool.diff, 0)
+		log('reject getwork: %s' % reason)
+		return reason
+
+	# A longpollid naming the current block waits for the next one
+	def template(self, params):
+		pool = self.server.pool
+		lpid = params and isinstance(params[0], dict) and params[0].get('longpollid')
+		with pool.lock:
+			if lpid == '%d' % pool.height:
+				pool.changed.wait(60)
+			pool.gbt_no += 1
+			workid = '%x' % pool.gbt_no
+			b = pool.block
+			pool.templates[workid] = (b, time.time(), pool.diff)
+			if len(pool.templates) > 4096:
+				pool.templates.pop(next(iter(pool.templates)))
+			diff = pool.diff
+		return {'version': VERSION,
+			'previousblockhash': hexlify(b.prevhash[::-1]),
+			'transactions': [{'data': hexlify(d), 'hash': hexlify(h[::-1])}
+				for d, h in zip(b.txdata, b.txids)],
+			'coinbasetxn': {'data': hexlify(b.gbt_coinbase)},
+			'target': '%064x' % diff_target(diff),
+			'mutable': ['coinbase/append', 'submit/coinbase'],
+			'noncerange': '00000000ffffffff',
+			'curtime': b.ntime, 'bits': NBITS, 'height': b.height,
+			'longpollid': '%d' % b.height, 'expires': 120,
+			'submitold': False, 'workid': workid}
+
+	# cgminer submits the header, transaction count and coinbase only, the
+	# rest of the block is the transactions of the template named by workid
+	def submitblock(self, params):
+		pool = self.server.pool
+		workid = len(params) > 1 and isinstance(params[1], dict) and params[1].get('workid')
+		with pool.lock:
+			work = pool.templates.get(workid)
+			current = pool.block
+		try:
+			block = unhexlify(params[0])
+		except (TypeError, IndexError, binascii.Error):
+			block = b''
+		reason = None
+		if not work:
+			reason = 'unknown-work'
+		elif len(block) < 81:
+			reason = 'bad-format'
+		elif work[0] is not current:
+			reason = 'stale'
+		else:
+			b = work[0]
+			count, cb = struct.unpack('B', block[80:81])[0], block[81:]
+			if count == 0xfd:
+				count, cb = struct.unpack('<H', block[81:83])[0], block[83:]
+			elif count == 0xfe:
+				count, cb = struct.unpack('<I', block[81:85])[0], block[85:]
+			if count != len(b.txids) + 1:
+				reason = 'bad-txnmrklroot'
+			elif merkle_root(cb, b.branch) != block[36:68] or block[4:36] != b.prevhash:
+				reason = 'bad-txnmrklroot'
+		if reason:
+			pool.stats.share(reason, 0, 0, pool.diff, 0)
+		else:
+			reason = pool.check(block[:80], work[1], work[2],
+					pool.dupes, block[:80])
+		if reason:
+			log('reject submitblock %s: %s' % (workid, reason))
+		return reason
+
+class Server(socketserver.ThreadingMixIn, socketserver.TCPServer):
+	daemon_threads = True
+	allow_reuse_address = True
+
+class HttpServer(socketserver.ThreadingMixIn, HTTPServer):
+	daemon_threads = True
+	allow_reuse_address = True
+
+def main():
+	parser = argparse.ArgumentParser(description='Mock mining pool for testing cgminer')
+	parser.add_argument('--host', default='127.0.0.1')
+	parser.add_argument('--stratum-port', type=int, default=3333)
+	parser.add_argument('--http-port', type=int, default=8332)
+	parser.add_argument('--no-gbt', action='store_true',
+			help='only serve getwork over http')
+	parser.add_argument('--seed', default='cgminer')
+	parser.add_argument('--txns', type=int, default=16,
+			help='transactions in every block')
+	parser.add_argument('--n2size', type=int, default=4)
+	parser.add_argument('--diff', default='1',
+			help='share difficulty, or a comma separated list to cycle')
+	parser.add_argument('--diff-every', type=float, default=0)
+	parser.add_argument('--notify', type=float, default=30)
+	parser.add_argument('--clean-every', type=int, default=4)
+	parser.add_argument('--reconnect-every', type=float, default=0)
+	parser.add_argument('--reconnect-mode', choices=['drop', 'reconnect'],
+			default='drop')
+	parser.add_argument('--report', type=float, default=60)
+	parser.add_argument('--duration', type=float, default=0,
+			help='exit after this many seconds')
+	opts = parser.parse_args()
+
+	pool = Pool(opts)
+	servers = []
+	if opts.stratum_port:
+		servers.append(Server((opts.host, opts.stratum_port), StratumClient))
+	if opts.http_port:
+		servers.append(HttpServer((opts.host, opts.http_port), Http))
+	for s in servers:
+		s.pool = pool
+		t = threading.Thread(target=s.serve_forever)
+		t.daemon = True
+		t.start()
+	log('mock pool stratum %d http %d%s diff %s' % (opts.stratum_port,
+		opts.http_port, ' (getwork only)' if opts.no_gbt else '', opts.diff))
+	try:
+		pool.scheduler()
+	except KeyboardInterrupt:
+		pass
+	pool.stats.report(True)
+
+if __name__ == '__main__':
+	main()
@@ -32,6 +32,7 @@
 
 #include "findnonce.h"
 #include "ocl.h"
+#include "sha2.h"
 
 int opt_platform_id = -1;
 
@@ -205,6 +206,157 @@ void patch_opcodes(char *w, unsigned remaining)
 	applog(LOG_DEBUG, "Patched a total of %i BFI_INT instructions", patched);
 }
 
+/* Compiled kernels are cached in .bin files named after the kernel
+ * parameters plus part of a hash of everything that goes into the build.
+ * The file starts with this header so a stale, truncated or foreign binary
+ * is never handed to the driver. */
+#define BINCACHE_MAGIC "cgbin001"
+
+struct bincache_hdr {
+	char magic[8];
+	unsigned char key[32];
+	unsigned char hash[32];
+	uint64_t size;
+};
+
+static void bincache_str(sha2_context *ctx, const char *str)
+{
+	sha2_update(ctx, (const unsigned char *)str, strlen(str) + 1);
+}
+
+static void bincache_info(sha2_context *ctx, cl_platform_id platform, cl_device_id device,
+			  cl_uint param, bool devinfo)
+{
+	char buf[256];
+	cl_int status;
+
+	if (devinfo)
+		status = clGetDeviceInfo(device, param, sizeof(buf), buf, NULL);
+	else
+		status = clGetPlatformInfo(platform, param, sizeof(buf), buf, NULL);
+	if (status != CL_SUCCESS)
+		buf[0] = '\0';
+	buf[sizeof(buf) - 1] = '\0';
+	bincache_str(ctx, buf);
+}
+
+/* The key covers the kernel source, the compiler options, the platform and
+ * driver versions and the device, so any change to them builds afresh */
+static void bincache_key(unsigned char *key, cl_platform_id platform, cl_device_id device,
+			 const char *source, int pl, const char *options)
+{
+	char numbuf[16];
+	sha2_context ctx;
+
+	sha2_starts(&ctx);
+	sha2_update(&ctx, (const unsigned char *)source, pl);
+	bincache_str(&ctx, options);
+	bincache_info(&ctx, platform, device, CL_PLATFORM_VENDOR, false);
+	bincache_info(&ctx, platform, device, CL_PLATFORM_VERSION, false);
+	bincache_info(&ctx, platform, device, CL_DEVICE_NAME, true);
+	bincache_info(&ctx, platform, device, CL_DEVICE_VERSION, true);
+	bincache_info(&ctx, platform, device, CL_DRIVER_VERSION, true);
+	sprintf(numbuf, "l%d", (int)sizeof(long));
+	bincache_str(&ctx, numbuf);
+	sha2_finish(&ctx, key);
+}
+
+static bool bincache_load(const char *filename, const unsigned char *key,
+			  size_t *size, char **binary)
+{
+	struct bincache_hdr hdr;
+	unsigned char hash[32];
+	struct stat binary_stat;
+	char *buf;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		applog(LOG_DEBUG, "No binary found, generating from source");
+		return false;
+	}
+
+	if (fstat(fileno(f), &binary_stat) || fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, BINCACHE_MAGIC, sizeof(hdr.magic)) ||
+	    memcmp(hdr.key, key, sizeof(hdr.key)) || !hdr.size ||
+	    (uint64_t)binary_stat.st_size != sizeof(hdr) + hdr.size) {
+		applog(LOG_DEBUG, "Binary %s does not match, generating from source", filename);
+		fclose(f);
+		return false;
+	}
+
+	buf = malloc(hdr.size);
+	if (unlikely(!buf)) {
+		applog(LOG_ERR, "Unable to malloc binary");
+		fclose(f);
+		return false;
+	}
+	if (fread(buf, 1, hdr.size, f) != hdr.size) {
+		applog(LOG_ERR, "Unable to fread binaries");
+		fclose(f);
+		free(buf);
+		return false;
+	}
+	fclose(f);
+
+	sha2((unsigned char *)buf, hdr.size, hash);
+	if (memcmp(hash, hdr.hash, sizeof(hash))) {
+		applog(LOG_WARNING, "Binary %s is corrupt, generating from source", filename);
+		free(buf);
+		return false;
+	}
+
+	*size = hdr.size;
+	*binary = buf;
+	return true;
+}
+
+/* Written to a private temporary file and renamed into place, so threads
+ * racing on the same entry each produce a complete file and a reader only
+ * ever sees a complete one */
+static void bincache_save(const char *filename, const unsigned char *key,
+			  const char *binary, size_t size)
+{
+	static unsigned int seq;
+	struct bincache_hdr hdr;
+	char *tmpname;
+	FILE *f;
+
+	memcpy(hdr.magic, BINCACHE_MAGIC, sizeof(hdr.magic));
+	memcpy(hdr.key, key, sizeof(hdr.key));
+	sha2((unsigned char *)binary, size, hdr.hash);
+	hdr.size = size;
+
+	tmpname = alloca(strlen(filename) + 32);
+	sprintf(tmpname, "%s.%d.%u.tmp", filename, (int)getpid(),
+		__sync_fetch_and_add(&seq, 1));
+	f = fopen(tmpname, "wb");
+	if (!f) {
+		/* Not a fatal problem, just means we build it again next time */
+		applog(LOG_DEBUG, "Unable to create file %s", tmpname);
+		return;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fwrite(binary, 1, size, f) != size) {
+		applog(LOG_ERR, "Unable to fwrite to binaryfile");
+		fclose(f);
+		unlink(tmpname);
+		return;
+	}
+	if (fclose(f)) {
+		applog(LOG_ERR, "Unable to write binaryfile %s", tmpname);
+		unlink(tmpname);
+		return;
+	}
+#ifdef WIN32
+	/* rename won't replace an existing file */
+	unlink(filename);
+#endif
+	if (rename(tmpname, filename)) {
+		applog(LOG_DEBUG, "Unable to rename %s to %s", tmpname, filename);
+		unlink(tmpname);
+	}
+}
+
 _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 {
 	_clState *clState = calloc(1, sizeof(_clState));
@@ -218,6 +370,7 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	cl_uint numPlatforms;
 	cl_uint numDevices;
 	cl_int status;
+	int i;
 
 	status = clGetPlatformIDs(0, NULL, &numPlatforms);
 	if (status != CL_SUCCESS) {
@@ -350,6 +503,8 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	find = strstr(devoclver, ocl10);
 	if (!find)
 		clState->hasOpenCL11plus = true;
+	/* The compacted result buffer needs OpenCL 1.1 global atomics */
+	clState->compact = clState->hasOpenCL11plus;
 
 	status = clGetDeviceInfo(devices[gpu], CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, sizeof(cl_uint), (void *)&preferred_vwidth, NULL);
 	if (status != CL_SUCCESS) {
@@ -375,11 +530,12 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	/* Create binary filename based on parameters passed to opencl
 	 * compiler to ensure we only load a binary that matches what would
 	 * have otherwise created. The filename is:
-	 * name + kernelname +/- g(offset) + v + vectors + w + work_size + l + sizeof(long) + .bin
+	 * name + kernelname +/- g(offset) + v + vectors + w + work_size + l + sizeof(long) + - + key + .bin
 	 * For scrypt the filename is:
-	 * name + kernelname + g + lg + lookup_gap + tc + thread_concurrency + w + work_size + l + sizeof(long) + .bin
+	 * name + kernelname + g + lg + lookup_gap + tc + thread_concurrency + w + work_size + l + sizeof(long) + - + key + .bin
+	 * where key is the start of the bincache_key() hash in hex.
 	 */
-	char binaryfilename[255];
+	char binaryfilename[512];
 	char filename[255];
 	char numbuf[16];
 
@@ -501,7 +657,8 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	}
 #endif
 
-	FILE *binaryfile;
+	unsigned char binkey[32];
+	char *keystr;
 	size_t *binary_sizes;
 	char **binaries;
 	int pl;
@@ -525,79 +682,8 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 		return NULL;
 	}
 
-	strcat(binaryfilename, name);
-	if (clState->goffset)
-		strcat(binaryfilename, "g");
-	if (opt_scrypt) {
-#ifdef USE_SCRYPT
-		sprintf(numbuf, "lg%utc%u", cgpu->lookup_gap, (unsigned int)cgpu->thread_concurrency);
-		strcat(binaryfilename, numbuf);
-#endif
-	} else {
-		sprintf(numbuf, "v%d", clState->vwidth);
-		strcat(binaryfilename, numbuf);
-	}
-	sprintf(numbuf, "w%d", (int)clState->wsize);
-	strcat(binaryfilename, numbuf);
-	sprintf(numbuf, "l%d", (int)sizeof(long));
-	strcat(binaryfilename, numbuf);
-	strcat(binaryfilename, ".bin");
-
-	binaryfile = fopen(binaryfilename, "rb");
-	if (!binaryfile) {
-		applog(LOG_DEBUG, "No binary found, generating from source");
-	} else {
-		struct stat binary_stat;
-
-		if (unlikely(stat(binaryfilename, &binary_stat))) {
-			applog(LOG_DEBUG, "Unable to stat binary, generating from source");
-			fclose(binaryfile);
-			goto build;
-		}
-		if (!binary_stat.st_size)
-			goto build;
-
-		binary_sizes[slot] = binary_stat.st_size;
-		binaries[slot] = (char *)calloc(binary_sizes[slot], 1);
-		if (unlikely(!binaries[slot])) {
-			applog(LOG_ERR, "Unable to calloc binaries");
-			fclose(binaryfile);
-			return NULL;
-		}
-
-		if (fread(binaries[slot], 1, binary_sizes[slot], binaryfile) != binary_sizes[slot]) {
-			applog(LOG_ERR, "Unable to fread binaries");
-			fclose(binaryfile);
-			free(binaries[slot]);
-			goto build;
-		}
-
-		clState->program = clCreateProgramWithBinary(clState->context, 1, &devices[gpu], &binary_sizes[slot], (const unsigned char **)binaries, &status, NULL);
-		if (status != CL_SUCCESS) {
-			applog(LOG_ERR, "Error %d: Loading Binary into cl_program (clCreateProgramWithBinary)", status);
-			fclose(binaryfile);
-			free(binaries[slot]);
-			goto build;
-		}
-
-		fclose(binaryfile);
-		applog(LOG_DEBUG, "Loaded binary image %s", binaryfilename);
-
-		goto built;
-	}
-
-	/////////////////////////////////////////////////////////////////
-	// Load CL file, build CL program object, create CL kernel object
-	/////////////////////////////////////////////////////////////////
-
-build:
-	clState->program = clCreateProgramWithSource(clState->context, 1, (const char **)&source, sourceSize, &status);
-	if (status != CL_SUCCESS) {
-		applog(LOG_ERR, "Error %d: Loading Binary into cl_program (clCreateProgramWithSource)", status);
-		return NULL;
-	}
-
-	/* create a cl program executable for all the devices specified */
+	/* The compiler options are part of the binary cache key so they're
+	 * worked out before looking for a binary */
 	char *CompilerOptions = calloc(1, 256);
 
 #ifdef USE_SCRYPT
@@ -646,9 +732,64 @@ build:
 	if (!clState->hasOpenCL11plus)
 		strcat(CompilerOptions, " -D OCL1");
 
+	if (clState->compact) {
+		sprintf(numbuf, "%d", MAXNONCES);
+		strcat(CompilerOptions, " -D COMPACT -D MAXNONCES=");
+		strcat(CompilerOptions, numbuf);
+	}
+
 	applog(LOG_DEBUG, "CompilerOptions: %s", CompilerOptions);
+
+	strcat(binaryfilename, name);
+	if (clState->goffset)
+		strcat(binaryfilename, "g");
+	if (opt_scrypt) {
+#ifdef USE_SCRYPT
+		sprintf(numbuf, "lg%utc%u", cgpu->lookup_gap, (unsigned int)cgpu->thread_concurrency);
+		strcat(binaryfilename, numbuf);
+#endif
+	} else {
+		sprintf(numbuf, "v%d", clState->vwidth);
+		strcat(binaryfilename, numbuf);
+	}
+	sprintf(numbuf, "w%d", (int)clState->wsize);
+	strcat(binaryfilename, numbuf);
+	sprintf(numbuf, "l%d", (int)sizeof(long));
+	strcat(binaryfilename, numbuf);
+
+	bincache_key(binkey, platform, devices[gpu], source, pl, CompilerOptions);
+	keystr = bin2hex(binkey, 8);
+	strcat(binaryfilename, "-");
+	strcat(binaryfilename, keystr);
+	free(keystr);
+	strcat(binaryfilename, ".bin");
+
+	if (bincache_load(binaryfilename, binkey, &binary_sizes[slot], &binaries[slot])) {
+		clState->program = clCreateProgramWithBinary(clState->context, 1, &devices[gpu], &binary_sizes[slot], (const unsigned char **)binaries, &status, NULL);
+		if (status != CL_SUCCESS) {
+			applog(LOG_ERR, "Error %d: Loading Binary into cl_program (clCreateProgramWithBinary)", status);
+			free(binaries[slot]);
+			binaries[slot] = NULL;
+			goto build;
+		}
+
+		applog(LOG_DEBUG, "Loaded binary image %s", binaryfilename);
+
+		goto built;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// Load CL file, build CL program object, create CL kernel object
+	/////////////////////////////////////////////////////////////////
+
+build:
+	clState->program = clCreateProgramWithSource(clState->context, 1, (const char **)&source, sourceSize, &status);
+	if (status != CL_SUCCESS) {
+		applog(LOG_ERR, "Error %d: Loading Binary into cl_program (clCreateProgramWithSource)", status);
+		return NULL;
+	}
+
 	status = clBuildProgram(clState->program, 1, &devices[gpu], CompilerOptions , NULL, NULL);
-	free(CompilerOptions);
 
 	if (status != CL_SUCCESS) {
 		applog(LOG_ERR, "Error %d: Building Program (clBuildProgram)", status);
@@ -745,21 +886,11 @@ build:
 		prog_built = false;
 	}
 
-	free(source);
-
 	/* Save the binary to be loaded next time */
-	binaryfile = fopen(binaryfilename, "wb");
-	if (!binaryfile) {
-		/* Not a fatal problem, just means we build it again next time */
-		applog(LOG_DEBUG, "Unable to create file %s", binaryfilename);
-	} else {
-		if (unlikely(fwrite(binaries[slot], 1, binary_sizes[slot], binaryfile) != binary_sizes[slot])) {
-			applog(LOG_ERR, "Unable to fwrite to binaryfile");
-			return NULL;
-		}
-		fclose(binaryfile);
-	}
+	bincache_save(binaryfilename, binkey, binaries[slot], binary_sizes[slot]);
 built:
+	free(source);
+	free(CompilerOptions);
 	if (binaries[slot])
 		free(binaries[slot]);
 	free(binaries);
@@ -821,11 +952,15 @@ built:
 		}
 	}
 #endif
-	clState->outputBuffer = clCreateBuffer(clState->context, CL_MEM_WRITE_ONLY, BUFFERSIZE, NULL, &status);
-	if (status != CL_SUCCESS) {
-		applog(LOG_ERR, "Error %d: clCreateBuffer (outputBuffer)", status);
-		return NULL;
+	for (i = 0; i < OPENCL_PIPELINE; i++) {
+		clState->outputBuffers[i] = clCreateBuffer(clState->context, CL_MEM_READ_WRITE,
+							   clState->compact ? COMPACT_BUFFERSIZE : BUFFERSIZE, NULL, &status);
+		if (status != CL_SUCCESS) {
+			applog(LOG_ERR, "Error %d: clCreateBuffer (outputBuffer)", status);
+			return NULL;
+		}
 	}
+	clState->outputBuffer = clState->outputBuffers[0];
 
 	return clState;
 }
@@ -13,12 +13,16 @@
 
 #include "miner.h"
 
+/* Output buffers per thread for --gpu-pipeline */
+#define OPENCL_PIPELINE 2
+
 typedef struct {
 	cl_context context;
 	cl_kernel kernel;
 	cl_command_queue commandQueue;
 	cl_program program;
 	cl_mem outputBuffer;
+	cl_mem outputBuffers[OPENCL_PIPELINE];
 #ifdef USE_SCRYPT
 	cl_mem CLbuffer0;
 	cl_mem padbuffer8;
@@ -27,6 +31,7 @@ typedef struct {
 #endif
 	bool hasBitAlign;
 	bool hasOpenCL11plus;
+	bool compact;
 	bool goffset;
 	cl_uint vwidth;
 	size_t max_work_size;
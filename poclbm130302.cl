@@ -1365,8 +1365,17 @@ Vals[2]+=Vals[0];
 Vals[2]+=(rotr(Vals[1],6)^rotr(Vals[1],11)^rotr(Vals[1],25));
 Vals[2]+=ch(Vals[1],Vals[4],Vals[3]);
 
+#ifdef COMPACT
+/* output[0] counts every nonce found, the first MAXNONCES of them follow */
+#define SETFOUND(Xnonce) do { \
+		uint found_slot = atomic_inc(&output[0]); \
+		if (found_slot < MAXNONCES) \
+			output[found_slot + 1] = Xnonce; \
+	} while (0)
+#else
 #define FOUND (0x0F)
 #define SETFOUND(Xnonce) output[output[FOUND]++] = Xnonce
+#endif
 
 #if defined(VECTORS2) || defined(VECTORS4)
 	if (any(Vals[2] == x136032edU)) {
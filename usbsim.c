@@ -0,0 +1,592 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Virtual USB devices (--usb-sim)
+ *
+ * Each virtual device sits behind _usb_read(), _usb_write() and
+ * _usb_transfer() in place of a libusb handle and answers the driver's
+ * commands the way the real device protocol does, so the unmodified
+ * driver can be run without the hardware.
+ *
+ * Work completes in the time the configured hashrate would take and
+ * returns nonces at the configured rate, but the nonces are random so
+ * they will not pass verification and each one counts as a HW error.
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "miner.h"
+#include "usbsim.h"
+
+// Most virtual devices allowed, addresses are a uint8_t
+#define USBSIM_MAX 255
+
+#define USBSIM_OUTSIZ 1024
+#define USBSIM_FPGAS 4
+
+// Most nonces in a single BFL work status reply
+#define USBSIM_MAXNONCES 16
+
+// On average one difficulty 1 nonce is found in this many hashes
+#define USBSIM_DIFF1 4294967296.0
+
+struct usbsim_job {
+	bool active;
+	struct timeval start;
+	uint32_t first;
+	double range;
+	double rate;
+	// Offset into the range of the next nonce to be found
+	double next;
+};
+
+struct usbsim_proto;
+
+struct usbsim {
+	struct usbsim *next;
+	const struct usbsim_proto *proto;
+	int address;
+	bool claimed;
+	bool gone;
+
+	double mhs;
+	double nonces;
+	int latency;
+	int jitter;
+	int errors;
+	int nodev;
+	double temp;
+	int fpgas;
+
+	pthread_mutex_t lock;
+	unsigned int seed;
+	struct timeval created;
+
+	// The reply data the device has waiting to be read
+	unsigned char out[USBSIM_OUTSIZ];
+	size_t outlen;
+
+	// BFL expects the work block next, after a ZDX or ZPX
+	bool want_work;
+	bool want_range;
+
+	int clock[USBSIM_FPGAS];
+	struct usbsim_job job[USBSIM_FPGAS];
+};
+
+struct usbsim_proto {
+	const char *name;
+	double mhs;
+	int fpgas;
+	void (*write)(struct usbsim *sim, unsigned char *buf, size_t len);
+};
+
+static struct usbsim *sims;
+
+static void sim_reply(struct usbsim *sim, const void *data, size_t len)
+{
+	if (len > USBSIM_OUTSIZ - sim->outlen)
+		len = USBSIM_OUTSIZ - sim->outlen;
+
+	memcpy(sim->out + sim->outlen, data, len);
+	sim->outlen += len;
+}
+
+// Hashes until the next nonce is found
+static double sim_gap(struct usbsim *sim)
+{
+	double u;
+
+	if (sim->nonces <= 0)
+		return HUGE_VAL;
+
+	u = ((double)rand_r(&sim->seed) + 1.0) / ((double)RAND_MAX + 2.0);
+
+	return -log(u) * USBSIM_DIFF1 / sim->nonces;
+}
+
+static void sim_job_start(struct usbsim *sim, struct usbsim_job *job, uint32_t first, double range, double rate)
+{
+	cgtime(&job->start);
+	job->first = first;
+	job->range = range;
+	job->rate = rate;
+	job->next = sim_gap(sim);
+	job->active = true;
+}
+
+// Hashes done so far on the job
+static double sim_job_done(struct usbsim_job *job)
+{
+	struct timeval now;
+	double done;
+
+	cgtime(&now);
+	done = tdiff(&now, &job->start) * job->rate;
+
+	return done < job->range ? done : job->range;
+}
+
+/*
+ * BitFORCE - text commands over an FTDI chip
+ * ZDX and ZPX are answered "OK" and the next write is the work block,
+ * ZFX is "BUSY" until the work completes, then gives the result once
+ */
+static void bfl_write(struct usbsim *sim, unsigned char *buf, size_t len)
+{
+	struct usbsim_job *job = &(sim->job[0]);
+	char reply[USBSIM_OUTSIZ];
+	uint32_t first, last;
+	size_t expect;
+	double range;
+	int count, off;
+
+	if (sim->want_work) {
+		sim->want_work = false;
+		expect = sim->want_range ? 68 : 60;
+		if (len != expect || memcmp(buf, ">>>>>>>>", 8) || memcmp(buf + len - 8, ">>>>>>>>", 8)) {
+			sim_reply(sim, "ERR:INVALID DATA\n", 17);
+			return;
+		}
+
+		if (sim->want_range) {
+			memcpy(&first, buf + 52, 4);
+			memcpy(&last, buf + 56, 4);
+			first = be32toh(first);
+			last = be32toh(last);
+			range = (double)(last - first) + 1;
+		} else {
+			first = 0;
+			range = USBSIM_DIFF1;
+		}
+
+		sim_job_start(sim, job, first, range, sim->mhs * 1000000.0);
+		sim_reply(sim, "OK\n", 3);
+		return;
+	}
+
+	if (len < 3)
+		return;
+
+	if (!memcmp(buf, "ZGX", 3)) {
+		off = sprintf(reply, ">>>ID: BitFORCE SHA256 SIM %d>>>\n", sim->address);
+		sim_reply(sim, reply, off);
+	} else if (!memcmp(buf, "ZLX", 3)) {
+		off = sprintf(reply, "TEMP:%.1f\n", sim->temp);
+		sim_reply(sim, reply, off);
+	} else if (!memcmp(buf, "ZMX", 3)) {
+		// Flashing the LED has no reply
+	} else if (!memcmp(buf, "ZDX", 3) || !memcmp(buf, "ZPX", 3)) {
+		if (job->active && sim_job_done(job) < job->range)
+			sim_reply(sim, "BUSY\n", 5);
+		else {
+			sim->want_work = true;
+			sim->want_range = (buf[1] == 'P');
+			sim_reply(sim, "OK\n", 3);
+		}
+	} else if (!memcmp(buf, "ZFX", 3)) {
+		if (!job->active)
+			sim_reply(sim, "IDLE\n", 5);
+		else if (sim_job_done(job) < job->range)
+			sim_reply(sim, "BUSY\n", 5);
+		else {
+			off = 0;
+			count = 0;
+			while (job->next < job->range && count < USBSIM_MAXNONCES) {
+				off += sprintf(reply + off, "%s%08X",
+						count ? "," : "NONCE-FOUND:",
+						job->first + (uint32_t)(job->next));
+				job->next += sim_gap(sim);
+				count++;
+			}
+			if (count)
+				off += sprintf(reply + off, "\n");
+			else
+				off = sprintf(reply, "NO-NONCE\n");
+			sim_reply(sim, reply, off);
+			job->active = false;
+		}
+	} else
+		sim_reply(sim, "ERR:UNKNOWN COMMAND\n", 20);
+}
+
+/*
+ * ModMiner Quad - binary commands, the 2nd byte is the FPGA number
+ * Every FPGA reports itself as already programmed so there is never
+ * a bitstream upload and it runs at the clock it was set to
+ */
+#define MMQ_USER_ID "\2\4$B"
+
+static void mmq_write(struct usbsim *sim, unsigned char *buf, size_t len)
+{
+	struct usbsim_job *job;
+	unsigned char reply[4];
+	uint32_t nonce;
+	int fpga, raw;
+
+	if (len < 1)
+		return;
+
+	fpga = 0;
+	if (len > 1 && buf[0] != '\x00') {
+		fpga = buf[1];
+		// A real MMQ ignores commands for an FPGA it doesn't have
+		if (fpga >= sim->fpgas)
+			return;
+	}
+	job = &(sim->job[fpga]);
+
+	switch (buf[0]) {
+		case '\x00': // ping
+			break;
+		case '\x01': // version
+			sim_reply(sim, "ModMiner Quad SIM", 17);
+			break;
+		case '\x02': // FPGA count
+			reply[0] = sim->fpgas;
+			sim_reply(sim, reply, 1);
+			break;
+		case '\x03': // ID code
+			memset(reply, 0, 4);
+			sim_reply(sim, reply, 4);
+			break;
+		case '\x04': // user code
+			sim_reply(sim, MMQ_USER_ID, 4);
+			break;
+		case '\x06': // set clock
+			if (len < 3)
+				break;
+			sim->clock[fpga] = buf[2];
+			reply[0] = 1;
+			sim_reply(sim, reply, 1);
+			break;
+		case '\x07': // read clock
+			reply[0] = sim->clock[fpga];
+			sim_reply(sim, reply, 1);
+			break;
+		case '\x08': // send work
+			if (len < 46)
+				break;
+			sim_job_start(sim, job, 0, USBSIM_DIFF1,
+					sim->mhs * 1000000.0 * sim->clock[fpga] / 200.0);
+			reply[0] = 1;
+			sim_reply(sim, reply, 1);
+			break;
+		case '\x09': // check work
+			nonce = 0xffffffff;
+			if (job->active && job->next < sim_job_done(job)) {
+				nonce = (uint32_t)(job->next);
+				job->next += sim_gap(sim);
+			}
+			sim_reply(sim, &nonce, 4);
+			break;
+		case '\x0a': // 1 byte temperature
+			reply[0] = (unsigned char)(sim->temp);
+			sim_reply(sim, reply, 1);
+			break;
+		case '\x0d': // 2 byte temperature in 1/128 C
+			raw = (int)(sim->temp * 128.0);
+			reply[0] = raw & 0xff;
+			reply[1] = (raw >> 8) & 0xff;
+			sim_reply(sim, reply, 2);
+			break;
+		default:
+			break;
+	}
+}
+
+static const struct usbsim_proto protos[] = {
+	{ "BFL",	830.0,	1,		bfl_write },
+	{ "MMQ",	200.0,	USBSIM_FPGAS,	mmq_write },
+	{ NULL,		0,	0,		NULL }
+};
+
+// Must be called with sim->lock held
+static bool sim_gone(struct usbsim *sim)
+{
+	struct timeval now;
+
+	if (!sim->gone && sim->nodev > 0) {
+		cgtime(&now);
+		if (tdiff(&now, &sim->created) >= sim->nodev) {
+			applog(LOG_WARNING, "USB sim %s %d:%d unplugged",
+				sim->proto->name, USBSIM_BUS, sim->address);
+			sim->gone = true;
+		}
+	}
+
+	return sim->gone;
+}
+
+static void sim_delay(struct usbsim *sim)
+{
+	int ms = sim->latency;
+
+	if (sim->jitter) {
+		mutex_lock(&sim->lock);
+		ms += rand_r(&sim->seed) % (sim->jitter + 1);
+		mutex_unlock(&sim->lock);
+	}
+
+	if (ms > 0)
+		nmsleep(ms);
+}
+
+int usbsim_read(struct usbsim *sim, char *buf, size_t bufsiz, int *processed, unsigned int timeout, const char *end)
+{
+	unsigned char *found;
+	size_t got, endlen;
+	int err;
+
+	sim_delay(sim);
+
+	mutex_lock(&sim->lock);
+	if (sim_gone(sim)) {
+		mutex_unlock(&sim->lock);
+		*buf = '\0';
+		*processed = 0;
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	// Injected error - the reply is lost
+	if (sim->errors && (rand_r(&sim->seed) % 1000) < (unsigned int)(sim->errors))
+		sim->outlen = 0;
+
+	got = 0;
+	err = LIBUSB_SUCCESS;
+	if (sim->outlen) {
+		got = sim->outlen < bufsiz ? sim->outlen : bufsiz;
+		if (end) {
+			endlen = strlen(end);
+			found = memmem(sim->out, got, end, endlen);
+			if (found)
+				got = found - sim->out + endlen;
+			else if (got < bufsiz)
+				err = LIBUSB_ERROR_TIMEOUT;
+		}
+		memcpy(buf, sim->out, got);
+		sim->outlen -= got;
+		memmove(sim->out, sim->out + got, sim->outlen);
+	} else
+		err = LIBUSB_ERROR_TIMEOUT;
+	mutex_unlock(&sim->lock);
+
+	// Nothing more will arrive so just take as long as the device would
+	if (err == LIBUSB_ERROR_TIMEOUT)
+		nmsleep(timeout);
+
+	if (got < bufsiz)
+		buf[got] = '\0';
+	*processed = got;
+
+	return err;
+}
+
+int usbsim_write(struct usbsim *sim, char *buf, size_t bufsiz, int *processed)
+{
+	sim_delay(sim);
+
+	mutex_lock(&sim->lock);
+	if (sim_gone(sim)) {
+		mutex_unlock(&sim->lock);
+		*processed = 0;
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	sim->proto->write(sim, (unsigned char *)buf, bufsiz);
+	mutex_unlock(&sim->lock);
+
+	*processed = bufsiz;
+
+	return LIBUSB_SUCCESS;
+}
+
+int usbsim_transfer(struct usbsim *sim, uint8_t request_type, uint8_t bRequest, uint16_t wValue, __maybe_unused uint16_t wIndex)
+{
+	sim_delay(sim);
+
+	mutex_lock(&sim->lock);
+	if (sim_gone(sim)) {
+		mutex_unlock(&sim->lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	// An FTDI reset or RX purge throws away any unread reply
+	if (request_type == FTDI_TYPE_OUT && bRequest == FTDI_REQUEST_RESET &&
+	    (wValue == FTDI_VALUE_RESET || wValue == FTDI_VALUE_PURGE_RX)) {
+		sim->outlen = 0;
+		sim->want_work = false;
+	}
+	mutex_unlock(&sim->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+struct usbsim *usbsim_next(struct usbsim *sim)
+{
+	return sim ? sim->next : sims;
+}
+
+// Virtual devices are passed to the driver detect functions as their dev
+struct usbsim *usbsim_find(struct libusb_device *dev)
+{
+	struct usbsim *sim;
+
+	for (sim = sims; sim; sim = sim->next)
+		if ((struct libusb_device *)sim == dev)
+			return sim;
+
+	return NULL;
+}
+
+const char *usbsim_name(struct usbsim *sim)
+{
+	return sim->proto->name;
+}
+
+int usbsim_address(struct usbsim *sim)
+{
+	return sim->address;
+}
+
+bool usbsim_available(struct usbsim *sim)
+{
+	bool ret;
+
+	mutex_lock(&sim->lock);
+	ret = !sim->claimed && !sim_gone(sim);
+	mutex_unlock(&sim->lock);
+
+	return ret;
+}
+
+void usbsim_claim(struct usbsim *sim, bool claim)
+{
+	mutex_lock(&sim->lock);
+	sim->claimed = claim;
+	mutex_unlock(&sim->lock);
+}
+
+static void sim_option(struct usbsim *sim, char *opt)
+{
+	char *eq;
+
+	eq = strchr(opt, '=');
+	if (!eq)
+		quit(1, "Invalid --usb-sim option '%s' missing '='", opt);
+	*(eq++) = '\0';
+
+	if (strcasecmp(opt, "mhs") == 0)
+		sim->mhs = atof(eq);
+	else if (strcasecmp(opt, "nonces") == 0)
+		sim->nonces = atof(eq);
+	else if (strcasecmp(opt, "lat") == 0)
+		sim->latency = atoi(eq);
+	else if (strcasecmp(opt, "jitter") == 0)
+		sim->jitter = atoi(eq);
+	else if (strcasecmp(opt, "err") == 0)
+		sim->errors = atoi(eq);
+	else if (strcasecmp(opt, "nodev") == 0)
+		sim->nodev = atoi(eq);
+	else if (strcasecmp(opt, "temp") == 0)
+		sim->temp = atof(eq);
+	else if (strcasecmp(opt, "fpgas") == 0)
+		sim->fpgas = atoi(eq);
+	else if (strcasecmp(opt, "seed") == 0)
+		sim->seed = (unsigned int)atoi(eq);
+	else
+		quit(1, "Invalid --usb-sim unknown option '%s'", opt);
+}
+
+/*
+ * --usb-sim DRV[:count][:opt=val]...[,DRV...]
+ * e.g. --usb-sim BFL:10:mhs=830:lat=2,MMQ:2:fpgas=4:err=5
+ */
+void usbsim_initialise(void)
+{
+	struct usbsim template, *sim, **last;
+	const struct usbsim_proto *proto;
+	char *fre, *ptr, *comma, *colon, *opt;
+	int address = 0;
+	int count, i, j;
+
+	if (!opt_usb_sim || !*opt_usb_sim)
+		return;
+
+	last = &sims;
+	fre = ptr = strdup(opt_usb_sim);
+	do {
+		comma = strchr(ptr, ',');
+		if (comma)
+			*(comma++) = '\0';
+
+		colon = strchr(ptr, ':');
+		if (colon)
+			*(colon++) = '\0';
+
+		for (proto = protos; proto->name; proto++)
+			if (strcasecmp(ptr, proto->name) == 0)
+				break;
+		if (!proto->name)
+			quit(1, "Invalid --usb-sim unknown DRV='%s'", ptr);
+
+		memset(&template, 0, sizeof(template));
+		template.proto = proto;
+		template.mhs = proto->mhs;
+		template.nonces = 1.0;
+		template.temp = 40.0;
+		template.fpgas = proto->fpgas;
+		template.seed = 0;
+
+		count = 1;
+		while (colon) {
+			opt = colon;
+			colon = strchr(opt, ':');
+			if (colon)
+				*(colon++) = '\0';
+			if (isdigit(*opt) && !strchr(opt, '='))
+				count = atoi(opt);
+			else
+				sim_option(&template, opt);
+		}
+
+		if (count < 1 || address + count > USBSIM_MAX)
+			quit(1, "Invalid --usb-sim count %d, at most %d devices", count, USBSIM_MAX);
+		if (template.fpgas < 1 || template.fpgas > proto->fpgas)
+			quit(1, "Invalid --usb-sim fpgas for %s must be 1 to %d", proto->name, proto->fpgas);
+
+		for (i = 0; i < count; i++) {
+			sim = malloc(sizeof(*sim));
+			if (unlikely(!sim))
+				quit(1, "Failed to malloc usbsim");
+			memcpy(sim, &template, sizeof(*sim));
+			sim->address = ++address;
+			// The same seed gives each device its own repeatable sequence
+			sim->seed += sim->address;
+			cgtime(&sim->created);
+			for (j = 0; j < USBSIM_FPGAS; j++)
+				sim->clock[j] = 200;
+			mutex_init(&sim->lock);
+			*last = sim;
+			last = &(sim->next);
+
+			applog(LOG_DEBUG, "USB sim %s %d:%d added",
+				proto->name, USBSIM_BUS, sim->address);
+		}
+
+		ptr = comma;
+	} while (ptr);
+	free(fre);
+}
@@ -0,0 +1,32 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef USBSIM_H
+#define USBSIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Virtual devices report this bus number, real USB buses start at 1
+#define USBSIM_BUS 0
+
+struct usbsim;
+struct libusb_device;
+
+void usbsim_initialise(void);
+struct usbsim *usbsim_next(struct usbsim *sim);
+struct usbsim *usbsim_find(struct libusb_device *dev);
+const char *usbsim_name(struct usbsim *sim);
+int usbsim_address(struct usbsim *sim);
+bool usbsim_available(struct usbsim *sim);
+void usbsim_claim(struct usbsim *sim, bool claim);
+int usbsim_read(struct usbsim *sim, char *buf, size_t bufsiz, int *processed, unsigned int timeout, const char *end);
+int usbsim_write(struct usbsim *sim, char *buf, size_t bufsiz, int *processed);
+int usbsim_transfer(struct usbsim *sim, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex);
+
+#endif
@@ -16,6 +16,7 @@
 #include "logging.h"
 #include "miner.h"
 #include "usbutils.h"
+#include "usbsim.h"
 
 #define NODEV(err) ((err) == LIBUSB_ERROR_NO_DEVICE || \
 			(err) == LIBUSB_ERROR_PIPE || \
@@ -231,9 +232,17 @@ struct cg_usb_stats_item {
 #define CMD_TIMEOUT 1
 #define CMD_ERROR 2
 
+/* Latency histogram of successful transfers
+ * Bucket N holds delays below 2^N microseconds, the last bucket holds
+ * everything slower, so 24 buckets cover up to ~8.4s */
+#define USB_HIST_BUCKETS 24
+
 struct cg_usb_stats_details {
 	int seq;
 	struct cg_usb_stats_item item[CMD_ERROR+1];
+	// Updated with atomics so the API can read them while they change
+	uint64_t hist[USB_HIST_BUCKETS];
+	uint64_t bytes;
 };
 
 struct cg_usb_stats {
@@ -663,6 +672,11 @@ void usb_all(int level)
 	char *buf;
 	size_t len, off;
 
+	if (usb_unavailable) {
+		applog(LOG_ERR, "USB all: libusb is unavailable");
+		return;
+	}
+
 	count = libusb_get_device_list(NULL, &list);
 	if (count < 0) {
 		applog(LOG_ERR, "USB all: failed, err %d%s", (int)count, usberrstr((int)count));
@@ -1033,6 +1047,295 @@ static void cgminer_usb_unlock(struct device_drv *drv, libusb_device *dev)
 	cgminer_usb_unlock_bd(drv, libusb_get_bus_number(dev), libusb_get_device_address(dev));
 }
 
+/*
+ * Asynchronous reads (--usb-async)
+ *
+ * Rather than each device thread sleeping in libusb_bulk_transfer() for
+ * every read, the default IN endpoint of a device has USB_ASYNC_XFERS bulk
+ * transfers kept submitted at all times. Their completions are handled by
+ * the single usb_event_thread() and appended to a per device ring buffer,
+ * then the transfer is resubmitted. _usb_read() then only waits on the
+ * ring, so a read costs a cond wait and a memcpy instead of a round trip.
+ * Writes and control transfers stay synchronous.
+ */
+#define USB_ASYNC_XFERS 4
+#define USB_ASYNC_XFERSIZE 512
+#define USB_ASYNC_RING 16384
+#define USB_ASYNC_MASK (USB_ASYNC_RING - 1)
+
+// How long usb_async_stop() waits for cancelled transfers to come back
+#define USB_ASYNC_STOP_MS 2000
+
+struct usb_async {
+	int ep;
+	bool ftdi;
+	uint16_t packetsize;
+	struct libusb_transfer *xfer[USB_ASYNC_XFERS];
+	unsigned char buf[USB_ASYNC_XFERS][USB_ASYNC_XFERSIZE];
+	int inflight;
+	bool stopping;
+	int err;
+	uint64_t dropped;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// head and tail are free running, the used size is head - tail
+	unsigned int head;
+	unsigned int tail;
+	unsigned char ring[USB_ASYNC_RING];
+};
+
+static pthread_t usb_event_pth;
+static volatile bool usb_event_run;
+
+static void *usb_event_thread(void __maybe_unused *userdata)
+{
+	struct timeval tv;
+
+	RenameThread("usbevents");
+
+	while (usb_event_run) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+	}
+
+	return NULL;
+}
+
+static void usb_event_start(void)
+{
+	usb_event_run = true;
+	if (unlikely(pthread_create(&usb_event_pth, NULL, usb_event_thread, NULL)))
+		quit(1, "Failed to create USB event thread");
+}
+
+static void usb_event_stop(void)
+{
+	if (!usb_event_run)
+		return;
+
+	usb_event_run = false;
+	pthread_join(usb_event_pth, NULL);
+}
+
+static int usb_async_status(enum libusb_transfer_status status)
+{
+	switch (status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return LIBUSB_SUCCESS;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_STALL:
+			return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return LIBUSB_ERROR_OVERFLOW;
+		default:
+			return LIBUSB_ERROR_IO;
+	}
+}
+
+// Must be called with async->lock held
+static void usb_async_put(struct usb_async *async, unsigned char *data, int len)
+{
+	unsigned int space, pos;
+	int chunk, copy, drop;
+
+	while (len > 0) {
+		chunk = len;
+		if (async->ftdi) {
+			// each packet of a transfer starts with 2 bytes of FTDI status
+			if (chunk > async->packetsize)
+				chunk = async->packetsize;
+			copy = chunk < 2 ? chunk : 2;
+			data += copy;
+			len -= copy;
+			chunk -= copy;
+		}
+
+		space = USB_ASYNC_RING - (async->head - async->tail);
+		drop = 0;
+		if ((unsigned int)chunk > space) {
+			drop = chunk - space;
+			async->dropped += drop;
+		}
+
+		chunk -= drop;
+		while (chunk > 0) {
+			pos = async->head & USB_ASYNC_MASK;
+			copy = USB_ASYNC_RING - pos;
+			if (copy > chunk)
+				copy = chunk;
+			memcpy(async->ring + pos, data, copy);
+			async->head += copy;
+			data += copy;
+			len -= copy;
+			chunk -= copy;
+		}
+
+		data += drop;
+		len -= drop;
+	}
+}
+
+static void LIBUSB_CALL usb_async_cb(struct libusb_transfer *xfer)
+{
+	struct usb_async *async = xfer->user_data;
+	bool resubmit;
+	int err;
+
+	mutex_lock(&async->lock);
+
+	err = usb_async_status(xfer->status);
+	if (err == LIBUSB_SUCCESS)
+		usb_async_put(async, xfer->buffer, xfer->actual_length);
+	else if (!async->stopping)
+		async->err = err;
+
+	/* A lost device stays lost, any other error is handed to the next
+	 * reader once and the transfer goes straight back to the device */
+	resubmit = !async->stopping && !NODEV(async->err);
+	if (resubmit) {
+		err = libusb_submit_transfer(xfer);
+		if (err) {
+			async->err = err;
+			resubmit = false;
+		}
+	}
+
+	if (!resubmit)
+		async->inflight--;
+
+	pthread_cond_broadcast(&async->cond);
+	mutex_unlock(&async->lock);
+}
+
+static void usb_async_free(struct usb_async *async)
+{
+	int i;
+
+	for (i = 0; i < USB_ASYNC_XFERS; i++)
+		if (async->xfer[i])
+			libusb_free_transfer(async->xfer[i]);
+
+	pthread_cond_destroy(&async->cond);
+	pthread_mutex_destroy(&async->lock);
+	free(async);
+}
+
+static void usb_async_stop(struct cg_usb_device *cgusb)
+{
+	struct usb_async *async = cgusb->async;
+	struct timeval now, then, tdiff;
+	struct timespec abstime;
+	int i;
+
+	if (!async)
+		return;
+
+	cgusb->async = NULL;
+
+	tdiff.tv_sec = USB_ASYNC_STOP_MS / 1000;
+	tdiff.tv_usec = (USB_ASYNC_STOP_MS % 1000) * 1000;
+	cgtime(&now);
+	timeradd(&now, &tdiff, &then);
+	abstime.tv_sec = then.tv_sec;
+	abstime.tv_nsec = then.tv_usec * 1000;
+
+	mutex_lock(&async->lock);
+	async->stopping = true;
+	for (i = 0; i < USB_ASYNC_XFERS; i++)
+		libusb_cancel_transfer(async->xfer[i]);
+	while (async->inflight > 0) {
+		if (pthread_cond_timedwait(&async->cond, &async->lock, &abstime))
+			break;
+	}
+	i = async->inflight;
+	mutex_unlock(&async->lock);
+
+	/* If a transfer never came back, libusb still owns its buffer so the
+	 * whole block must be leaked rather than freed under it */
+	if (i > 0) {
+		applog(LOG_WARNING, "USB async stop left %d transfers outstanding", i);
+		return;
+	}
+
+	usb_async_free(async);
+}
+
+static bool usb_async_start(struct cgpu_info *cgpu, int ep, bool ftdi)
+{
+	struct cg_usb_device *usbdev = cgpu->usbdev;
+	struct usb_async *async;
+	int err, i;
+
+	usbdev->noasync = true;
+
+	if (!usb_event_run)
+		return false;
+
+	async = calloc(1, sizeof(*async));
+	if (unlikely(!async))
+		quit(1, "Failed to calloc usb_async");
+
+	async->ep = ep;
+	async->ftdi = ftdi;
+	async->packetsize = usbdev->found->eps[ep].wMaxPacketSize;
+	if (async->packetsize < 2 || async->packetsize > USB_ASYNC_XFERSIZE)
+		async->packetsize = USB_ASYNC_XFERSIZE;
+	mutex_init(&async->lock);
+	if (unlikely(pthread_cond_init(&async->cond, NULL)))
+		quit(1, "Failed to pthread_cond_init usb_async");
+
+	for (i = 0; i < USB_ASYNC_XFERS; i++) {
+		async->xfer[i] = libusb_alloc_transfer(0);
+		if (unlikely(!async->xfer[i]))
+			quit(1, "Failed to libusb_alloc_transfer");
+		libusb_fill_bulk_transfer(async->xfer[i], usbdev->handle,
+				usbdev->found->eps[ep].ep, async->buf[i],
+				USB_ASYNC_XFERSIZE, usb_async_cb, async, 0);
+	}
+
+	mutex_lock(&async->lock);
+	for (i = 0; i < USB_ASYNC_XFERS; i++) {
+		err = libusb_submit_transfer(async->xfer[i]);
+		if (err)
+			break;
+		async->inflight++;
+	}
+	mutex_unlock(&async->lock);
+
+	usbdev->async = async;
+
+	if (i < USB_ASYNC_XFERS) {
+		applog(LOG_DEBUG, "%s%i: USB async submit failed, err %d, using sync reads",
+			cgpu->drv->name, cgpu->device_id, err);
+		usb_async_stop(usbdev);
+		return false;
+	}
+
+	usbdev->noasync = false;
+
+	applog(LOG_DEBUG, "%s%i: USB async reads started on ep 0x%02x",
+		cgpu->drv->name, cgpu->device_id, usbdev->found->eps[ep].ep);
+
+	return true;
+}
+
+// Discard anything already buffered, e.g. after an FTDI RX purge
+static void usb_async_flush(struct cg_usb_device *usbdev)
+{
+	struct usb_async *async = usbdev->async;
+
+	if (!async)
+		return;
+
+	mutex_lock(&async->lock);
+	async->tail = async->head;
+	mutex_unlock(&async->lock);
+}
+
 static struct cg_usb_device *free_cgusb(struct cg_usb_device *cgusb)
 {
 	if (cgusb->serial_string && cgusb->serial_string != BLANK)
@@ -1059,6 +1362,12 @@ void usb_uninit(struct cgpu_info *cgpu)
 	//  if release_cgpu() was called due to a USB NODEV(err)
 	if (!cgpu->usbdev)
 		return;
+	if (cgpu->usbdev->sim) {
+		usbsim_claim(cgpu->usbdev->sim, false);
+		cgpu->usbdev = free_cgusb(cgpu->usbdev);
+		return;
+	}
+	usb_async_stop(cgpu->usbdev);
 	libusb_release_interface(cgpu->usbdev->handle, cgpu->usbdev->found->interface);
 	libusb_close(cgpu->usbdev->handle);
 	cgpu->usbdev = free_cgusb(cgpu->usbdev);
@@ -1068,12 +1377,15 @@ static void release_cgpu(struct cgpu_info *cgpu)
 {
 	struct cg_usb_device *cgusb = cgpu->usbdev;
 	struct cgpu_info *lookcgpu;
+	bool sim;
 	int i;
 
 	// It has already been done
 	if (cgpu->usbinfo.nodev)
 		return;
 
+	sim = (cgusb && cgusb->sim);
+
 	total_count--;
 	drv_count[cgpu->drv->drv_id].count--;
 
@@ -1099,7 +1411,56 @@ static void release_cgpu(struct cgpu_info *cgpu)
 
 	usb_uninit(cgpu);
 
-	cgminer_usb_unlock_bd(cgpu->drv, cgpu->usbinfo.bus_number, cgpu->usbinfo.device_address);
+	// Virtual devices are never locked
+	if (!sim)
+		cgminer_usb_unlock_bd(cgpu->drv, cgpu->usbinfo.bus_number, cgpu->usbinfo.device_address);
+}
+
+static bool usb_init_sim(struct cgpu_info *cgpu, struct usbsim *sim, struct usb_find_devices *found)
+{
+	struct cg_usb_device *cgusb;
+	char name[STRBUFLEN+1];
+	int i;
+
+	cgpu->usbinfo.bus_number = USBSIM_BUS;
+	cgpu->usbinfo.device_address = usbsim_address(sim);
+
+	cgusb = calloc(1, sizeof(*cgusb));
+	if (unlikely(!cgusb))
+		quit(1, "Failed to calloc cgusb");
+	cgusb->found = found;
+	cgusb->sim = sim;
+	cgusb->noasync = true;
+	cgusb->descriptor = calloc(1, sizeof(*(cgusb->descriptor)));
+	cgusb->descriptor->idVendor = found->idVendor;
+	cgusb->descriptor->idProduct = found->idProduct;
+	cgusb->usbver = 0x0200;
+
+	for (i = 0; i < found->epcount; i++) {
+		found->eps[i].found = true;
+		found->eps[i].wMaxPacketSize = found->eps[i].size;
+	}
+
+	sprintf(name, "%s SIM", found->name);
+	cgusb->prod_string = strdup(name);
+	cgusb->manuf_string = (char *)BLANK;
+	sprintf(name, "SIM%d", usbsim_address(sim));
+	cgusb->serial_string = strdup(name);
+
+	applog(LOG_DEBUG, "USB init %s virtual device %d:%d",
+		found->name, USBSIM_BUS, usbsim_address(sim));
+
+	usbsim_claim(sim, true);
+
+	cgpu->usbdev = cgusb;
+
+	if (strcmp(cgpu->drv->name, found->name)) {
+		if (!cgpu->drv->copy)
+			cgpu->drv = copy_drv(cgpu->drv);
+		cgpu->drv->name = (char *)(found->name);
+	}
+
+	return true;
 }
 
 bool usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct usb_find_devices *found)
@@ -1110,8 +1471,13 @@ bool usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct usb_find
 	const struct libusb_endpoint_descriptor *epdesc;
 	unsigned char strbuf[STRBUFLEN+1];
 	char devstr[STRBUFLEN+1];
+	struct usbsim *sim;
 	int err, i, j, k;
 
+	sim = usbsim_find(dev);
+	if (sim)
+		return usb_init_sim(cgpu, sim, found);
+
 	cgpu->usbinfo.bus_number = libusb_get_bus_number(dev);
 	cgpu->usbinfo.device_address = libusb_get_device_address(dev);
 
@@ -1214,6 +1580,7 @@ bool usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct usb_find
 					&&  epdesc->wMaxPacketSize >= found->eps[k].size
 					&&  epdesc->bEndpointAddress == found->eps[k].ep) {
 						found->eps[k].found = true;
+						found->eps[k].wMaxPacketSize = epdesc->wMaxPacketSize;
 						break;
 					}
 				}
@@ -1308,9 +1675,15 @@ static bool usb_check_device(struct device_drv *drv, struct libusb_device *dev,
 {
 	struct libusb_device_descriptor desc;
 	int bus_number, device_address;
+	struct usbsim *sim;
 	int err, i;
 	bool ok;
 
+	// Virtual devices match on name and ignore the --usb bus:dev list
+	sim = usbsim_find(dev);
+	if (sim)
+		return (strcmp(usbsim_name(sim), look->name) == 0);
+
 	err = libusb_get_device_descriptor(dev, &desc);
 	if (err) {
 		applog(LOG_DEBUG, "USB check device: Failed to get descriptor, err %d", err);
@@ -1405,6 +1778,32 @@ static struct usb_find_devices *usb_check(__maybe_unused struct device_drv *drv,
 	return NULL;
 }
 
+static void usb_detect_sim(struct device_drv *drv, bool (*device_detect)(struct libusb_device *, struct usb_find_devices *))
+{
+	struct usb_find_devices *found;
+	struct usbsim *sim;
+
+	for (sim = usbsim_next(NULL); sim; sim = usbsim_next(sim)) {
+		if (total_count >= total_limit)
+			break;
+
+		if (drv_count[drv->drv_id].count >= drv_count[drv->drv_id].limit)
+			break;
+
+		if (!usbsim_available(sim))
+			continue;
+
+		// The driver passes it back to usb_init() which knows it's virtual
+		found = usb_check(drv, (struct libusb_device *)sim);
+		if (found != NULL) {
+			if (device_detect((struct libusb_device *)sim, found)) {
+				total_count++;
+				drv_count[drv->drv_id].count++;
+			}
+		}
+	}
+}
+
 void usb_detect(struct device_drv *drv, bool (*device_detect)(struct libusb_device *, struct usb_find_devices *))
 {
 	libusb_device **list;
@@ -1425,6 +1824,11 @@ void usb_detect(struct device_drv *drv, bool (*device_detect)(struct libusb_devi
 		return;
 	}
 
+	usb_detect_sim(drv, device_detect);
+
+	if (usb_unavailable)
+		return;
+
 	count = libusb_get_device_list(NULL, &list);
 	if (count < 0) {
 		applog(LOG_DEBUG, "USB scan devices: failed, err %d", count);
@@ -1469,10 +1873,10 @@ void usb_detect(struct device_drv *drv, bool (*device_detect)(struct libusb_devi
 #define DO_USB_STATS 1
 
 #if DO_USB_STATS
-#define USB_STATS(sgpu, sta, fin, err, cmd, seq) stats(cgpu, sta, fin, err, cmd, seq)
+#define USB_STATS(sgpu, sta, fin, err, cmd, seq, bytes) stats(cgpu, sta, fin, err, cmd, seq, bytes)
 #define STATS_TIMEVAL(tv) cgtime(tv)
 #else
-#define USB_STATS(sgpu, sta, fin, err, cmd, seq)
+#define USB_STATS(sgpu, sta, fin, err, cmd, seq, bytes)
 #define STATS_TIMEVAL(tv)
 #endif
 
@@ -1480,14 +1884,45 @@ void usb_detect(struct device_drv *drv, bool (*device_detect)(struct libusb_devi
 // however that would require the stat() function to also lock and release
 // a mutex every time a usb read or write is called which would slow
 // things down more
+#if DO_USB_STATS
+/* The delay, in seconds, below which permille/1000 of the histogram falls
+ * This is the upper bound of the bucket it lands in, except for the last
+ * bucket which is open ended so its lower bound is used */
+static double hist_percentile(uint64_t *hist, uint64_t total, int permille)
+{
+	uint64_t want, sum = 0;
+	int i;
+
+	if (total == 0)
+		return 0;
+
+	want = (total * permille + 999) / 1000;
+	for (i = 0; i < USB_HIST_BUCKETS - 1; i++) {
+		sum += hist[i];
+		if (sum >= want)
+			break;
+	}
+
+	if (i == USB_HIST_BUCKETS - 1)
+		i--;
+
+	return (double)((uint64_t)1 << i) / 1000000.0;
+}
+#endif
+
 struct api_data *api_usb_stats(__maybe_unused int *count)
 {
 #if DO_USB_STATS
 	struct cg_usb_stats_details *details;
 	struct cg_usb_stats *sta;
 	struct api_data *root = NULL;
+	uint64_t hist[USB_HIST_BUCKETS];
+	uint64_t total, bytes;
+	char histbuf[USB_HIST_BUCKETS * 21 + 1];
+	double delay, rate, pc;
 	int device;
 	int cmdseq;
+	int i, len;
 
 	if (next_stat == 0)
 		return NULL;
@@ -1548,6 +1983,32 @@ struct api_data *api_usb_stats(__maybe_unused int *count)
 		root = api_add_timeval(root, "Last Error",
 					&(details->item[CMD_ERROR].last), true);
 
+		// A consistent snapshot of each counter, not of the whole set
+		total = 0;
+		len = 0;
+		for (i = 0; i < USB_HIST_BUCKETS; i++) {
+			hist[i] = __sync_fetch_and_add(&(details->hist[i]), 0);
+			total += hist[i];
+			len += sprintf(histbuf + len, "%s%"PRIu64,
+					i ? "," : "", hist[i]);
+		}
+		bytes = __sync_fetch_and_add(&(details->bytes), 0);
+
+		delay = details->item[CMD_CMD].total_delay +
+			details->item[CMD_TIMEOUT].total_delay +
+			details->item[CMD_ERROR].total_delay;
+		rate = delay > 0 ? (double)bytes / delay : 0;
+
+		root = api_add_uint64(root, "Bytes", &bytes, true);
+		root = api_add_double(root, "Bytes/s", &rate, true);
+		pc = hist_percentile(hist, total, 500);
+		root = api_add_double(root, "P50 Delay", &pc, true);
+		pc = hist_percentile(hist, total, 900);
+		root = api_add_double(root, "P90 Delay", &pc, true);
+		pc = hist_percentile(hist, total, 990);
+		root = api_add_double(root, "P99 Delay", &pc, true);
+		root = api_add_string(root, "Delay Histogram", histbuf, true);
+
 		return root;
 	}
 #endif
@@ -1585,7 +2046,25 @@ void update_usb_stats(__maybe_unused struct cgpu_info *cgpu)
 }
 
 #if DO_USB_STATS
-static void stats(struct cgpu_info *cgpu, struct timeval *tv_start, struct timeval *tv_finish, int err, enum usb_cmds cmd, int seq)
+static int hist_bucket(struct timeval *tv_start, struct timeval *tv_finish)
+{
+	struct timeval tv;
+	uint64_t us;
+	int bucket;
+
+	timersub(tv_finish, tv_start, &tv);
+	if (tv.tv_sec < 0)
+		return 0;
+
+	us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	for (bucket = 0; bucket < USB_HIST_BUCKETS - 1; bucket++)
+		if (us < ((uint64_t)1 << bucket))
+			break;
+
+	return bucket;
+}
+
+static void stats(struct cgpu_info *cgpu, struct timeval *tv_start, struct timeval *tv_finish, int err, enum usb_cmds cmd, int seq, int bytes)
 {
 	struct cg_usb_stats_details *details;
 	double diff;
@@ -1622,6 +2101,11 @@ static void stats(struct cgpu_info *cgpu, struct timeval *tv_start, struct timev
 	details->item[item].total_delay += diff;
 	memcpy(&(details->item[item].last), tv_start, sizeof(*tv_start));
 	details->item[item].count++;
+
+	if (item == CMD_CMD)
+		__sync_fetch_and_add(&(details->hist[hist_bucket(tv_start, tv_finish)]), 1);
+	if (bytes > 0)
+		__sync_fetch_and_add(&(details->bytes), (uint64_t)bytes);
 }
 
 static void rejected_inc(struct cgpu_info *cgpu)
@@ -1640,6 +2124,124 @@ static void rejected_inc(struct cgpu_info *cgpu)
 
 #define USB_MAX_READ 8192
 
+// Copy len bytes from off bytes into the ring without consuming them
+static void usb_async_peek(struct usb_async *async, unsigned int off, unsigned char *dst, unsigned int len)
+{
+	unsigned int pos, copy;
+
+	while (len > 0) {
+		pos = (async->tail + off) & USB_ASYNC_MASK;
+		copy = USB_ASYNC_RING - pos;
+		if (copy > len)
+			copy = len;
+		memcpy(dst, async->ring + pos, copy);
+		dst += copy;
+		off += copy;
+		len -= copy;
+	}
+}
+
+/* Same semantics as the sync path of _usb_read() except that with an END
+ * the data past END is left in the ring for the next read */
+static int usb_async_read(struct cgpu_info *cgpu, char *buf, size_t bufsiz, int *processed, unsigned int timeout, const char *end, enum usb_cmds cmd)
+{
+	struct usb_async *async = cgpu->usbdev->async;
+#if DO_USB_STATS
+	struct timeval tv_start, tv_finish;
+#endif
+	struct timeval now, then, tdiff;
+	struct timespec abstime;
+	unsigned char usbbuf[USB_MAX_READ+1];
+	unsigned int used, have, got, from;
+	uint64_t dropped;
+	char *found;
+	int endlen, err, rc;
+
+	endlen = end ? strlen(end) : 0;
+
+	tdiff.tv_sec = timeout / 1000;
+	tdiff.tv_usec = (timeout % 1000) * 1000;
+	cgtime(&now);
+	timeradd(&now, &tdiff, &then);
+	abstime.tv_sec = then.tv_sec;
+	abstime.tv_nsec = then.tv_usec * 1000;
+
+	STATS_TIMEVAL(&tv_start);
+	err = LIBUSB_SUCCESS;
+	have = from = got = 0;
+	rc = 0;
+	mutex_lock(&async->lock);
+	while (42) {
+		used = async->head - async->tail;
+		if (used > bufsiz)
+			used = bufsiz;
+		if (used > have) {
+			usb_async_peek(async, have, usbbuf + have, used - have);
+			// must allow END to have been chopped in 2 transfers
+			if (endlen && have >= (unsigned int)(endlen - 1))
+				from = have - (endlen - 1);
+			have = used;
+			usbbuf[have] = '\0';
+		}
+
+		if (have) {
+			if (!end) {
+				got = have;
+				break;
+			}
+			found = strstr((char *)usbbuf + from, end);
+			if (found) {
+				got = (unsigned char *)found - usbbuf + endlen;
+				break;
+			}
+			if (have == bufsiz) {
+				got = have;
+				break;
+			}
+		}
+
+		if (async->err) {
+			err = async->err;
+			if (!NODEV(err))
+				async->err = LIBUSB_SUCCESS;
+			got = have;
+			break;
+		}
+
+		// Every transfer has died so nothing more will ever arrive
+		if (!async->inflight) {
+			err = LIBUSB_ERROR_OTHER;
+			got = have;
+			break;
+		}
+
+		if (rc == ETIMEDOUT) {
+			err = LIBUSB_ERROR_TIMEOUT;
+			got = have;
+			break;
+		}
+
+		rc = pthread_cond_timedwait(&async->cond, &async->lock, &abstime);
+	}
+	async->tail += got;
+	dropped = async->dropped;
+	async->dropped = 0;
+	mutex_unlock(&async->lock);
+	STATS_TIMEVAL(&tv_finish);
+	USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, SEQ0, got);
+
+	if (unlikely(dropped)) {
+		applog(LOG_WARNING, "%s%i: USB async buffer full, dropped %"PRIu64" bytes",
+			cgpu->drv->name, cgpu->device_id, dropped);
+	}
+
+	usbbuf[got] = '\0';
+	*processed = got;
+	memcpy(buf, (const char *)usbbuf, (got < bufsiz) ? got + 1 : bufsiz);
+
+	return err;
+}
+
 int _usb_read(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *processed, unsigned int timeout, const char *end, enum usb_cmds cmd, bool ftdi)
 {
 	struct cg_usb_device *usbdev = cgpu->usbdev;
@@ -1673,6 +2275,30 @@ int _usb_read(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *pro
 	if (timeout == DEVTIMEOUT)
 		timeout = usbdev->found->timeout;
 
+	if (usbdev->sim) {
+		STATS_TIMEVAL(&tv_start);
+		err = usbsim_read(usbdev->sim, buf, bufsiz, processed, timeout, end);
+		STATS_TIMEVAL(&tv_finish);
+		USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, SEQ0, *processed);
+
+		if (NODEV(err))
+			release_cgpu(cgpu);
+
+		return err;
+	}
+
+	if (opt_usb_async && ep == DEFAULT_EP_IN && !usbdev->async && !usbdev->noasync)
+		usb_async_start(cgpu, ep, ftdi);
+
+	if (usbdev->async && usbdev->async->ep == ep) {
+		err = usb_async_read(cgpu, buf, bufsiz, processed, timeout, end, cmd);
+
+		if (NODEV(err))
+			release_cgpu(cgpu);
+
+		return err;
+	}
+
 	if (end == NULL) {
 		if (ftdi)
 			usbbufread = bufsiz + 2;
@@ -1684,7 +2310,7 @@ int _usb_read(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *pro
 				usbdev->found->eps[ep].ep,
 				usbbuf, usbbufread, &got, timeout);
 		STATS_TIMEVAL(&tv_finish);
-		USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, SEQ0);
+		USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, SEQ0, got);
 		usbbuf[got] = '\0';
 
 		if (ftdi) {
@@ -1725,7 +2351,7 @@ int _usb_read(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *pro
 				usbdev->found->eps[ep].ep,
 				ptr, usbbufread, &got, timeout);
 		cgtime(&tv_finish);
-		USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, first ? SEQ0 : SEQ1);
+		USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, first ? SEQ0 : SEQ1, got);
 		ptr[got] = '\0';
 
 		if (ftdi) {
@@ -1802,13 +2428,16 @@ int _usb_write(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *pr
 
 	sent = 0;
 	STATS_TIMEVAL(&tv_start);
-	err = libusb_bulk_transfer(usbdev->handle,
-			usbdev->found->eps[ep].ep,
-			(unsigned char *)buf,
-			bufsiz, &sent,
-			timeout == DEVTIMEOUT ? usbdev->found->timeout : timeout);
+	if (usbdev->sim)
+		err = usbsim_write(usbdev->sim, buf, bufsiz, &sent);
+	else
+		err = libusb_bulk_transfer(usbdev->handle,
+				usbdev->found->eps[ep].ep,
+				(unsigned char *)buf,
+				bufsiz, &sent,
+				timeout == DEVTIMEOUT ? usbdev->found->timeout : timeout);
 	STATS_TIMEVAL(&tv_finish);
-	USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, SEQ0);
+	USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, SEQ0, sent);
 
 	*processed = sent;
 
@@ -1834,11 +2463,19 @@ int _usb_transfer(struct cgpu_info *cgpu, uint8_t request_type, uint8_t bRequest
 	}
 
 	STATS_TIMEVAL(&tv_start);
-	err = libusb_control_transfer(usbdev->handle, request_type,
-		bRequest, wValue, wIndex, NULL, 0,
-		timeout == DEVTIMEOUT ? usbdev->found->timeout : timeout);
+	if (usbdev->sim)
+		err = usbsim_transfer(usbdev->sim, request_type, bRequest, wValue, wIndex);
+	else
+		err = libusb_control_transfer(usbdev->handle, request_type,
+			bRequest, wValue, wIndex, NULL, 0,
+			timeout == DEVTIMEOUT ? usbdev->found->timeout : timeout);
 	STATS_TIMEVAL(&tv_finish);
-	USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, SEQ0);
+	USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, SEQ0, 0);
+
+	// Anything already read ahead was purged along with the device FIFO
+	if (err >= 0 && request_type == FTDI_TYPE_OUT && bRequest == FTDI_REQUEST_RESET &&
+	    (wValue == FTDI_VALUE_RESET || wValue == FTDI_VALUE_PURGE_RX))
+		usb_async_flush(usbdev);
 
 	if (NODEV(err))
 		release_cgpu(cgpu);
@@ -1868,6 +2505,8 @@ void usb_cleanup()
 				break;
 		}
 	}
+
+	usb_event_stop();
 }
 
 void usb_initialise()
@@ -1983,4 +2622,9 @@ void usb_initialise()
 			free(fre);
 		}
 	}
+
+	usbsim_initialise();
+
+	if (opt_usb_async && !usb_unavailable)
+		usb_event_start();
 }
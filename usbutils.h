@@ -48,6 +48,7 @@ struct usb_endpoints {
 	uint16_t size;
 	unsigned char ep;
 	bool found;
+	uint16_t wMaxPacketSize;
 };
 
 struct usb_find_devices {
@@ -63,6 +64,9 @@ struct usb_find_devices {
 	struct usb_endpoints *eps;
 };
 
+struct usb_async;
+struct usbsim;
+
 struct cg_usb_device {
 	struct usb_find_devices *found;
 	libusb_device_handle *handle;
@@ -75,6 +79,9 @@ struct cg_usb_device {
 	char *serial_string;
 	unsigned char fwVersion;	// ??
 	unsigned char interfaceVersion;	// ??
+	struct usb_async *async;
+	bool noasync;
+	struct usbsim *sim;
 };
 
 struct cg_usb_info {
@@ -942,6 +942,29 @@ enum send_ret {
 	SEND_INACTIVE
 };
 
+/* Write what the socket takes now of the lines stratum_send_queued left in
+ * sendbuf, without waiting. Must be called under stratum lock */
+static enum send_ret __stratum_send_buffered(struct pool *pool)
+{
+	ssize_t sent;
+
+	while (pool->sendbuf_sent < pool->sendbuf_len) {
+		sent = send(pool->sock, pool->sendbuf + pool->sendbuf_sent,
+			    pool->sendbuf_len - pool->sendbuf_sent, 0);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return SEND_OK;
+			pool->sendbuf_len = pool->sendbuf_sent = 0;
+			return SEND_SENDFAIL;
+		}
+		pool->sendbuf_sent += sent;
+		pool->cgminer_pool_stats.bytes_sent += sent;
+		pool->cgminer_pool_stats.net_bytes_sent += sent;
+	}
+	pool->sendbuf_len = pool->sendbuf_sent = 0;
+	return SEND_OK;
+}
+
 /* Send a single command across a socket, appending \n to it. This should all
  * be done under stratum lock except when first establishing the socket */
 static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
@@ -952,6 +975,20 @@ static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
 	strcat(s, "\n");
 	len++;
 
+	/* Finish any partly sent share line first so this one can't land in
+	 * the middle of it */
+	while (pool->sendbuf_sent < pool->sendbuf_len) {
+		struct timeval timeout = {1, 0};
+		fd_set wd;
+
+		FD_ZERO(&wd);
+		FD_SET(sock, &wd);
+		if (select(sock + 1, NULL, &wd, NULL, &timeout) < 1)
+			return SEND_SELECTFAIL;
+		if (__stratum_send_buffered(pool) != SEND_OK)
+			return SEND_SENDFAIL;
+	}
+
 	while (len > 0 ) {
 		struct timeval timeout = {1, 0};
 		ssize_t sent;
@@ -1007,6 +1044,42 @@ bool stratum_send(struct pool *pool, char *s, ssize_t len)
 	return (ret == SEND_OK);
 }
 
+/* Queue lines, each already ending in \n, to go out after any the socket
+ * has not taken yet, and send as much as it takes now without waiting. The
+ * rest goes with the next call, so a stalled pool can't hold up the caller.
+ * Called with no lines just to push out what is left. Returns false if the
+ * connection is down or failed, dropping anything unsent. */
+bool stratum_send_queued(struct pool *pool, const char *s, size_t len)
+{
+	enum send_ret ret = SEND_INACTIVE;
+
+	if (opt_protocol && len)
+		applog(LOG_DEBUG, "SEND: %.*s", (int)len - 1, s);
+
+	mutex_lock(&pool->stratum_lock);
+	if (!pool->stratum_active)
+		goto out;
+
+	if (len) {
+		if (pool->sendbuf_len + len > pool->sendbuf_size) {
+			pool->sendbuf = realloc(pool->sendbuf, pool->sendbuf_len + len);
+			if (unlikely(!pool->sendbuf))
+				quit(1, "Failed to realloc sendbuf in stratum_send_queued");
+			pool->sendbuf_size = pool->sendbuf_len + len;
+		}
+		memcpy(pool->sendbuf + pool->sendbuf_len, s, len);
+		pool->sendbuf_len += len;
+		pool->cgminer_pool_stats.times_sent++;
+	}
+	ret = __stratum_send_buffered(pool);
+out:
+	mutex_unlock(&pool->stratum_lock);
+
+	if (ret == SEND_SENDFAIL)
+		applog(LOG_DEBUG, "Failed to send queued lines to pool %d", pool->pool_no);
+	return (ret == SEND_OK);
+}
+
 static bool socket_full(struct pool *pool, bool wait)
 {
 	SOCKETTYPE sock = pool->sock;
@@ -1028,7 +1101,7 @@ static bool socket_full(struct pool *pool, bool wait)
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-	if (strlen(pool->sockbuf))
+	if (pool->sockbuf_end > pool->sockbuf_start)
 		return true;
 
 	return (socket_full(pool, false));
@@ -1036,7 +1109,7 @@ bool sock_full(struct pool *pool)
 
 static void clear_sockbuf(struct pool *pool)
 {
-	strcpy(pool->sockbuf, "");
+	pool->sockbuf_start = pool->sockbuf_end = pool->sockbuf_scan = 0;
 }
 
 static void clear_sock(struct pool *pool)
@@ -1045,48 +1118,139 @@ static void clear_sock(struct pool *pool)
 
 	mutex_lock(&pool->stratum_lock);
 	do {
-		n = recv(pool->sock, pool->sockbuf, RECVSIZE, 0);
+		n = recv(pool->sock, pool->sockbuf, pool->sockbuf_size, 0);
 	} while (n > 0);
 	mutex_unlock(&pool->stratum_lock);
 
 	clear_sockbuf(pool);
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
-static void recalloc_sock(struct pool *pool, size_t len)
+/* Make sure there are at least RECVSIZE free bytes at the end of the pool
+ * sockbuf. Lines already handed out are dropped by sliding the partial line
+ * left over down to the start of the buffer, and the buffer is only grown,
+ * in multiples of RBUFSIZE, when a single line does not fit. Each byte is
+ * therefore moved at most a constant number of times on average no matter
+ * how long the lines or how bursty the socket. */
+static void recalloc_sock(struct pool *pool)
 {
-	size_t old, new;
+	size_t used, new;
 
-	old = strlen(pool->sockbuf);
-	new = old + len + 1;
-	if (new < pool->sockbuf_size)
+	if (pool->sockbuf_size - pool->sockbuf_end >= RECVSIZE)
 		return;
+
+	used = pool->sockbuf_end - pool->sockbuf_start;
+	if (pool->sockbuf_start) {
+		memmove(pool->sockbuf, pool->sockbuf + pool->sockbuf_start, used);
+		pool->sockbuf_scan -= pool->sockbuf_start;
+		pool->sockbuf_end = used;
+		pool->sockbuf_start = 0;
+		if (pool->sockbuf_size - used >= RECVSIZE)
+			return;
+	}
+
+	new = pool->sockbuf_size * 2;
+	if (new < used + RBUFSIZE)
+		new = used + RBUFSIZE;
 	new = new + (RBUFSIZE - (new % RBUFSIZE));
 	// Avoid potentially recursive locking
 	// applog(LOG_DEBUG, "Recallocing pool sockbuf to %d", new);
 	pool->sockbuf = realloc(pool->sockbuf, new);
 	if (!pool->sockbuf)
 		quit(1, "Failed to realloc pool sockbuf in recalloc_sock");
-	memset(pool->sockbuf + old, 0, new - old);
 	pool->sockbuf_size = new;
 }
 
+/* Look for a \n only in the bytes that arrived since the last scan */
+static char *sockbuf_eol(struct pool *pool)
+{
+	char *eol;
+
+	eol = memchr(pool->sockbuf + pool->sockbuf_scan, '\n',
+		     pool->sockbuf_end - pool->sockbuf_scan);
+	if (!eol)
+		pool->sockbuf_scan = pool->sockbuf_end;
+	return eol;
+}
+
 enum recv_ret {
 	RECV_OK,
 	RECV_CLOSED,
 	RECV_RECVFAIL
 };
 
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
+/* Receive whatever is waiting on the socket onto the end of the sockbuf.
+ * Must be called under stratum_lock */
+static enum recv_ret __recv_sock(struct pool *pool)
+{
+	ssize_t n;
+
+	recalloc_sock(pool);
+	n = recv(pool->sock, pool->sockbuf + pool->sockbuf_end,
+		 pool->sockbuf_size - pool->sockbuf_end, 0);
+	if (!n)
+		return RECV_CLOSED;
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return RECV_RECVFAIL;
+		n = 0;
+	}
+	pool->sockbuf_end += n;
+	return RECV_OK;
+}
+
+static void recv_ret_log(enum recv_ret ret)
+{
+	switch (ret) {
+		default:
+		case RECV_OK:
+			break;
+		case RECV_CLOSED:
+			applog(LOG_DEBUG, "Socket closed waiting in recv_line");
+			break;
+		case RECV_RECVFAIL:
+			applog(LOG_DEBUG, "Failed to recv sock in recv_line");
+			break;
+	}
+}
+
+/* Hand out the next complete, non blank line already in the sockbuf, \0
+ * terminated in place, or NULL if there is none yet */
+static char *sockbuf_line(struct pool *pool)
+{
+	char *eol, *sret;
+	ssize_t len;
+
+	do {
+		eol = sockbuf_eol(pool);
+		if (!eol)
+			return NULL;
+		*eol = '\0';
+		sret = pool->sockbuf + pool->sockbuf_start;
+		len = eol - sret;
+
+		pool->sockbuf_start = pool->sockbuf_scan = eol + 1 - pool->sockbuf;
+		if (pool->sockbuf_start == pool->sockbuf_end)
+			clear_sockbuf(pool);
+	} while (!len);
+
+	pool->cgminer_pool_stats.times_received++;
+	pool->cgminer_pool_stats.bytes_received += len;
+	pool->cgminer_pool_stats.net_bytes_received += len;
+	if (opt_protocol)
+		applog(LOG_DEBUG, "RECVD: %s", sret);
+	return sret;
+}
+
+/* Reads from the socket until a full \n terminated line is buffered and
+ * returns it \0 terminated in place. The line is a view into the pool
+ * sockbuf and must not be freed; it is only valid until the next call that
+ * reads from or clears this pool's socket. */
 char *recv_line(struct pool *pool)
 {
-	ssize_t len, buflen;
-	char *tok, *sret = NULL;
+	char *sret;
 
-	if (!strstr(pool->sockbuf, "\n")) {
+	sret = sockbuf_line(pool);
+	if (!sret) {
 		enum recv_ret ret = RECV_OK;
 		struct timeval rstart, now;
 
@@ -1098,67 +1262,46 @@ char *recv_line(struct pool *pool)
 
 		mutex_lock(&pool->stratum_lock);
 		do {
-			char s[RBUFSIZE];
-			size_t slen;
-			ssize_t n;
-
-			memset(s, 0, RBUFSIZE);
-			n = recv(pool->sock, s, RECVSIZE, 0);
-			if (!n) {
-				ret = RECV_CLOSED;
+			ret = __recv_sock(pool);
+			if (ret != RECV_OK)
 				break;
-			}
-			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-				ret = RECV_RECVFAIL;
-				break;
-			}
-			slen = strlen(s);
-			recalloc_sock(pool, slen);
-			strcat(pool->sockbuf, s);
+			sret = sockbuf_line(pool);
 			cgtime(&now);
-		} while (tdiff(&now, &rstart) < 60 && !strstr(pool->sockbuf, "\n"));
+		} while (tdiff(&now, &rstart) < 60 && !sret);
 		mutex_unlock(&pool->stratum_lock);
 
-		switch (ret) {
-			default:
-			case RECV_OK:
-				break;
-			case RECV_CLOSED:
-				applog(LOG_DEBUG, "Socket closed waiting in recv_line");
-				break;
-			case RECV_RECVFAIL:
-				applog(LOG_DEBUG, "Failed to recv sock in recv_line");
-				break;
-		}
+		recv_ret_log(ret);
 	}
 
-	buflen = strlen(pool->sockbuf);
-	tok = strtok(pool->sockbuf, "\n");
-	if (!tok) {
+	if (!sret)
 		applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
-		goto out;
-	}
-	sret = strdup(tok);
-	len = strlen(sret);
-
-	/* Copy what's left in the buffer after the \n, including the
-	 * terminating \0 */
-	if (buflen > len + 1)
-		memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-	else
-		strcpy(pool->sockbuf, "");
-
-	pool->cgminer_pool_stats.times_received++;
-	pool->cgminer_pool_stats.bytes_received += len;
-	pool->cgminer_pool_stats.net_bytes_received += len;
 out:
 	if (!sret)
 		clear_sock(pool);
-	else if (opt_protocol)
-		applog(LOG_DEBUG, "RECVD: %s", sret);
 	return sret;
 }
 
+/* Non blocking counterparts of recv_line for callers that already know the
+ * socket is readable: recv_sock does a single receive into the sockbuf and
+ * returns false if the connection has gone, and buffered_line then hands out
+ * each complete line received so far with the same lifetime as recv_line. */
+bool recv_sock(struct pool *pool)
+{
+	enum recv_ret ret;
+
+	mutex_lock(&pool->stratum_lock);
+	ret = __recv_sock(pool);
+	mutex_unlock(&pool->stratum_lock);
+
+	recv_ret_log(ret);
+	return (ret == RECV_OK);
+}
+
+char *buffered_line(struct pool *pool)
+{
+	return sockbuf_line(pool);
+}
+
 /* Extracts a string value from a json array with error checking. To be used
  * when the value of the string returned is only examined and not to be stored.
  * See json_array_string below */
@@ -1189,86 +1332,94 @@ static char *json_array_string(json_t *val, unsigned int entry)
 	return NULL;
 }
 
-static bool parse_notify(struct pool *pool, json_t *val)
+static bool valid_hex(const char *s, size_t len)
 {
-	char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit, *ntime;
-	bool clean, ret = false;
-	int merkles, i;
-	json_t *arr;
+	while (len--) {
+		if (!isxdigit((unsigned char)*s++))
+			return false;
+	}
+	return true;
+}
 
-	arr = json_array_get(val, 4);
-	if (!arr || !json_is_array(arr))
-		goto out;
+/* Copies src into the malloced buffer at *buf, only growing it when src
+ * does not fit so that repeatedly storing similar strings allocates nothing */
+static void buf_strcpy(char **buf, size_t *size, const char *src)
+{
+	size_t len = strlen(src) + 1;
 
-	merkles = json_array_size(arr);
+	if (len > *size) {
+		*buf = realloc(*buf, len);
+		if (unlikely(!*buf))
+			quit(1, "Failed to realloc in buf_strcpy");
+		*size = len;
+	}
+	memcpy(*buf, src, len);
+}
 
-	job_id = json_array_string(val, 0);
-	prev_hash = json_array_string(val, 1);
-	coinbase1 = json_array_string(val, 2);
-	coinbase2 = json_array_string(val, 3);
-	bbversion = json_array_string(val, 5);
-	nbit = json_array_string(val, 6);
-	ntime = json_array_string(val, 7);
-	clean = json_is_true(json_array_get(val, 8));
-
-	if (!job_id || !prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime) {
-		/* Annoying but we must not leak memory */
-		if (job_id)
-			free(job_id);
-		if (prev_hash)
-			free(prev_hash);
-		if (coinbase1)
-			free(coinbase1);
-		if (coinbase2)
-			free(coinbase2);
-		if (bbversion)
-			free(bbversion);
-		if (nbit)
-			free(nbit);
-		if (ntime)
-			free(ntime);
-		goto out;
+/* Checks a notify's hex fields and stores them in binary form in the pool's
+ * stratum work template. The strings are not referenced once it returns. */
+static bool store_notify(struct pool *pool, const char *job_id, const char *prev_hash,
+			 const char *coinbase1, const char *coinbase2, const char **merkle,
+			 int merkles, const char *bbversion, const char *nbit,
+			 const char *ntime, bool clean)
+{
+	struct stratum_work *swork = &pool->swork;
+	size_t cb1_len, cb2_len;
+	int i;
+
+	cb1_len = strlen(coinbase1);
+	cb2_len = strlen(coinbase2);
+	if (strlen(prev_hash) != 64 || !valid_hex(prev_hash, 64) ||
+	    strlen(bbversion) != 8 || !valid_hex(bbversion, 8) ||
+	    strlen(nbit) != 8 || !valid_hex(nbit, 8) ||
+	    strlen(ntime) != 8 || !valid_hex(ntime, 8) ||
+	    cb1_len % 2 || !valid_hex(coinbase1, cb1_len) ||
+	    cb2_len % 2 || !valid_hex(coinbase2, cb2_len)) {
+		applog(LOG_INFO, "Malformed stratum notify from pool %d", pool->pool_no);
+		return false;
+	}
+	for (i = 0; i < merkles; i++) {
+		if (strlen(merkle[i]) != 64 || !valid_hex(merkle[i], 64)) {
+			applog(LOG_INFO, "Malformed stratum merkle from pool %d", pool->pool_no);
+			return false;
+		}
 	}
+	cb1_len /= 2;
+	cb2_len /= 2;
 
 	cg_wlock(&pool->data_lock);
-	free(pool->swork.job_id);
-	free(pool->swork.prev_hash);
-	free(pool->swork.coinbase1);
-	free(pool->swork.coinbase2);
-	free(pool->swork.bbversion);
-	free(pool->swork.nbit);
-	free(pool->swork.ntime);
-	pool->swork.job_id = job_id;
-	pool->swork.prev_hash = prev_hash;
-	pool->swork.coinbase1 = coinbase1;
-	pool->swork.cb1_len = strlen(coinbase1) / 2;
-	pool->swork.coinbase2 = coinbase2;
-	pool->swork.cb2_len = strlen(coinbase2) / 2;
-	pool->swork.bbversion = bbversion;
-	pool->swork.nbit = nbit;
-	pool->swork.ntime = ntime;
-	pool->swork.clean = clean;
-	pool->swork.cb_len = pool->swork.cb1_len + pool->n1_len + pool->n2size + pool->swork.cb2_len;
-
-	for (i = 0; i < pool->swork.merkles; i++)
-		free(pool->swork.merkle[i]);
-	if (merkles) {
-		pool->swork.merkle = realloc(pool->swork.merkle, sizeof(char *) * merkles + 1);
-		for (i = 0; i < merkles; i++)
-			pool->swork.merkle[i] = json_array_string(arr, i);
+	buf_strcpy(&swork->job_id, &swork->job_id_size, job_id);
+	strcpy(swork->ntime, ntime);
+
+	/* The coinbase template holds coinbase1 followed by coinbase2, the
+	 * nonces are filled in between them for each work item */
+	if (cb1_len + cb2_len > swork->coinbase_size) {
+		swork->coinbase = realloc(swork->coinbase, cb1_len + cb2_len);
+		if (unlikely(!swork->coinbase))
+			quit(1, "Failed to realloc coinbase in store_notify");
+		swork->coinbase_size = cb1_len + cb2_len;
 	}
-	pool->swork.merkles = merkles;
+	hex2bin(swork->coinbase, coinbase1, cb1_len);
+	hex2bin(swork->coinbase + cb1_len, coinbase2, cb2_len);
+	swork->cb1_len = cb1_len;
+	swork->cb2_len = cb2_len;
+	swork->cb_len = cb1_len + pool->n1_len + pool->n2size + cb2_len;
+
+	for (i = 0; i < merkles; i++)
+		hex2bin(swork->merkle_bin[i], merkle[i], 32);
+	swork->merkles = merkles;
+
+	/* Header with the merkle root and nonce left zeroed */
+	memset(swork->header_bin, 0, 80);
+	hex2bin(swork->header_bin, bbversion, 4);
+	hex2bin(swork->header_bin + 4, prev_hash, 32);
+	hex2bin(swork->header_bin + 4 + 32 + 32, ntime, 4);
+	hex2bin(swork->header_bin + 4 + 32 + 32 + 4, nbit, 4);
+	hex2bin(swork->header_bin + 80, workpadding, 48);
+
+	swork->clean = clean;
 	if (clean)
 		pool->nonce2 = 0;
-	pool->swork.header_len = strlen(pool->swork.bbversion) +
-				 strlen(pool->swork.prev_hash) +
-				 strlen(pool->swork.ntime) +
-				 strlen(pool->swork.nbit) +
-	/* merkle_hash */	 32 +
-	/* nonce */		 8 +
-	/* workpadding */	 96;
-	pool->swork.header_len = pool->swork.header_len * 2 + 1;
-	align_len(&pool->swork.header_len);
 	cg_wunlock(&pool->data_lock);
 
 	if (opt_protocol) {
@@ -1277,7 +1428,7 @@ static bool parse_notify(struct pool *pool, json_t *val)
 		applog(LOG_DEBUG, "coinbase1: %s", coinbase1);
 		applog(LOG_DEBUG, "coinbase2: %s", coinbase2);
 		for (i = 0; i < merkles; i++)
-			applog(LOG_DEBUG, "merkle%d: %s", i, pool->swork.merkle[i]);
+			applog(LOG_DEBUG, "merkle%d: %s", i, merkle[i]);
 		applog(LOG_DEBUG, "bbversion: %s", bbversion);
 		applog(LOG_DEBUG, "nbit: %s", nbit);
 		applog(LOG_DEBUG, "ntime: %s", ntime);
@@ -1287,16 +1438,46 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	/* A notify message is the closest stratum gets to a getwork */
 	pool->getwork_requested++;
 	total_getworks++;
-	ret = true;
-out:
-	return ret;
+	return true;
 }
 
-static bool parse_diff(struct pool *pool, json_t *val)
+static bool parse_notify(struct pool *pool, json_t *val)
 {
-	double diff;
+	const char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit, *ntime;
+	const char *merkle[STRATUM_MAX_MERKLES];
+	int merkles, i;
+	json_t *arr;
+
+	arr = json_array_get(val, 4);
+	if (!arr || !json_is_array(arr))
+		return false;
+
+	merkles = json_array_size(arr);
+	if (merkles > STRATUM_MAX_MERKLES)
+		return false;
+	for (i = 0; i < merkles; i++) {
+		merkle[i] = __json_array_string(arr, i);
+		if (!merkle[i])
+			return false;
+	}
+
+	job_id = __json_array_string(val, 0);
+	prev_hash = __json_array_string(val, 1);
+	coinbase1 = __json_array_string(val, 2);
+	coinbase2 = __json_array_string(val, 3);
+	bbversion = __json_array_string(val, 5);
+	nbit = __json_array_string(val, 6);
+	ntime = __json_array_string(val, 7);
+
+	if (!job_id || !prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime)
+		return false;
+
+	return store_notify(pool, job_id, prev_hash, coinbase1, coinbase2, merkle, merkles,
+			    bbversion, nbit, ntime, json_is_true(json_array_get(val, 8)));
+}
 
-	diff = json_number_value(json_array_get(val, 0));
+static bool store_diff(struct pool *pool, double diff)
+{
 	if (diff == 0)
 		return false;
 
@@ -1309,6 +1490,311 @@ static bool parse_diff(struct pool *pool, json_t *val)
 	return true;
 }
 
+static bool parse_diff(struct pool *pool, json_t *val)
+{
+	return store_diff(pool, json_number_value(json_array_get(val, 0)));
+}
+
+/* The overwhelming majority of stratum traffic is mining.notify,
+ * mining.set_difficulty and accepted mining.submit responses, all of fixed
+ * shape. These are picked apart in place in the receive buffer without
+ * building a jansson tree; anything the scanner is not sure of is left to
+ * jansson. A span is the text of one json value within the line. */
+struct json_span {
+	char *start;
+	char *end;
+};
+
+static char *json_skip_ws(char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return p;
+}
+
+/* p points at an opening quote, returns one past the closing quote */
+static char *json_skip_string(char *p)
+{
+	for (p++; *p; p++) {
+		if (*p == '"')
+			return p + 1;
+		if (*p == '\\' && !*++p)
+			break;
+	}
+	return NULL;
+}
+
+static bool json_literal_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '-' || c == '+' || c == '.';
+}
+
+/* Returns one past the end of the value starting at p. Nested values are only
+ * skipped over, not validated, as their contents are never used directly. */
+static char *json_skip_value(char *p)
+{
+	int depth = 0;
+
+	do {
+		p = json_skip_ws(p);
+		switch (*p) {
+			case '"':
+				p = json_skip_string(p);
+				if (!p)
+					return NULL;
+				break;
+			case '{':
+			case '[':
+				depth++;
+				p++;
+				break;
+			case '}':
+			case ']':
+				if (!depth--)
+					return NULL;
+				p++;
+				break;
+			case ',':
+			case ':':
+				if (!depth)
+					return NULL;
+				p++;
+				break;
+			default:
+				if (!json_literal_char(*p))
+					return NULL;
+				while (json_literal_char(*p))
+					p++;
+				break;
+		}
+	} while (depth);
+
+	return p;
+}
+
+/* Finds the values of the named members of the top level object in s. Members
+ * that are absent are left with a NULL start. */
+static bool json_scan_object(char *s, const char **keys, struct json_span *vals, int count)
+{
+	char *p = json_skip_ws(s);
+	int i;
+
+	for (i = 0; i < count; i++)
+		vals[i].start = NULL;
+	if (*p++ != '{')
+		return false;
+	p = json_skip_ws(p);
+	if (*p == '}')
+		return !*json_skip_ws(p + 1);
+
+	while (42) {
+		char *key, *end, *val;
+		size_t len;
+
+		if (*p != '"')
+			return false;
+		key = p + 1;
+		end = json_skip_string(p);
+		if (!end)
+			return false;
+		len = end - 1 - key;
+		p = json_skip_ws(end);
+		if (*p++ != ':')
+			return false;
+		val = json_skip_ws(p);
+		p = json_skip_value(val);
+		if (!p)
+			return false;
+		for (i = 0; i < count; i++) {
+			if (strlen(keys[i]) == len && !memcmp(keys[i], key, len)) {
+				vals[i].start = val;
+				vals[i].end = p;
+			}
+		}
+		p = json_skip_ws(p);
+		if (*p == '}')
+			break;
+		if (*p++ != ',')
+			return false;
+		p = json_skip_ws(p);
+	}
+
+	return !*json_skip_ws(p + 1);
+}
+
+/* Splits the array in span into its elements, returning how many there are or
+ * -1 if it is not an array or has more than max elements */
+static int json_scan_array(const struct json_span *span, struct json_span *elems, int max)
+{
+	char *p = span->start;
+	int n = 0;
+
+	if (*p++ != '[')
+		return -1;
+	p = json_skip_ws(p);
+	if (*p == ']')
+		return 0;
+
+	while (42) {
+		if (n == max)
+			return -1;
+		elems[n].start = p;
+		p = json_skip_value(p);
+		if (!p)
+			return -1;
+		elems[n++].end = p;
+		p = json_skip_ws(p);
+		if (*p == ']')
+			break;
+		if (*p++ != ',')
+			return -1;
+		p = json_skip_ws(p);
+	}
+
+	return n;
+}
+
+static bool json_span_is(const struct json_span *span, const char *literal)
+{
+	size_t len = strlen(literal);
+
+	return span->start && (size_t)(span->end - span->start) == len &&
+	       !memcmp(span->start, literal, len);
+}
+
+/* Whether span is a string free of escapes, and so usable in place */
+static bool json_span_plain(const struct json_span *span)
+{
+	return span->end - span->start >= 2 && *span->start == '"' &&
+	       span->end[-1] == '"' &&
+	       !memchr(span->start + 1, '\\', span->end - span->start - 2);
+}
+
+/* Turns a plain string span into a C string by overwriting its closing quote.
+ * This alters the line, so json_span_uncstr() must put it back before the
+ * line can be handed to jansson or logged. */
+static const char *json_span_cstr(const struct json_span *span)
+{
+	span->end[-1] = '\0';
+	return span->start + 1;
+}
+
+static void json_span_uncstr(const struct json_span *span)
+{
+	span->end[-1] = '"';
+}
+
+enum fast_parse {
+	FAST_UNHANDLED,
+	FAST_FAIL,
+	FAST_OK,
+};
+
+static enum fast_parse fast_parse_notify(struct pool *pool, const struct json_span *params)
+{
+	struct json_span p[10], m[STRATUM_MAX_MERKLES];
+	const char *merkle[STRATUM_MAX_MERKLES];
+	int merkles, i;
+	bool clean, ret;
+
+	if (json_scan_array(params, p, 10) != 9)
+		return FAST_UNHANDLED;
+	for (i = 0; i < 8; i++) {
+		if (i != 4 && !json_span_plain(&p[i]))
+			return FAST_UNHANDLED;
+	}
+	merkles = json_scan_array(&p[4], m, STRATUM_MAX_MERKLES);
+	if (merkles < 0)
+		return FAST_UNHANDLED;
+	for (i = 0; i < merkles; i++) {
+		if (!json_span_plain(&m[i]))
+			return FAST_UNHANDLED;
+	}
+	if (json_span_is(&p[8], "true"))
+		clean = true;
+	else if (json_span_is(&p[8], "false"))
+		clean = false;
+	else
+		return FAST_UNHANDLED;
+
+	for (i = 0; i < merkles; i++)
+		merkle[i] = json_span_cstr(&m[i]);
+	ret = store_notify(pool, json_span_cstr(&p[0]), json_span_cstr(&p[1]),
+			   json_span_cstr(&p[2]), json_span_cstr(&p[3]), merkle, merkles,
+			   json_span_cstr(&p[5]), json_span_cstr(&p[6]),
+			   json_span_cstr(&p[7]), clean);
+
+	/* Leave the line as it arrived for the caller to log or reparse */
+	for (i = 0; i < merkles; i++)
+		json_span_uncstr(&m[i]);
+	for (i = 0; i < 8; i++) {
+		if (i != 4)
+			json_span_uncstr(&p[i]);
+	}
+	return ret ? FAST_OK : FAST_FAIL;
+}
+
+static enum fast_parse fast_parse_diff(struct pool *pool, const struct json_span *params)
+{
+	struct json_span p[2];
+	char *end;
+	double diff;
+
+	if (json_scan_array(params, p, 2) != 1)
+		return FAST_UNHANDLED;
+	if (!isdigit((unsigned char)*p[0].start) && *p[0].start != '-')
+		return FAST_UNHANDLED;
+	diff = strtod(p[0].start, &end);
+	if (end != p[0].end)
+		return FAST_UNHANDLED;
+	return store_diff(pool, diff) ? FAST_OK : FAST_UNHANDLED;
+}
+
+static enum fast_parse fast_parse_method(struct pool *pool, char *s)
+{
+	static const char *keys[] = { "method", "params", "error" };
+	struct json_span vals[3];
+
+	if (!json_scan_object(s, keys, vals, 3))
+		return FAST_UNHANDLED;
+	if (!vals[0].start || !vals[1].start ||
+	    (vals[2].start && !json_span_is(&vals[2], "null")))
+		return FAST_UNHANDLED;
+
+	if (json_span_is(&vals[0], "\"mining.notify\"")) {
+		enum fast_parse ret = fast_parse_notify(pool, &vals[1]);
+
+		if (ret != FAST_UNHANDLED)
+			pool->stratum_notify = ret == FAST_OK;
+		return ret;
+	}
+	if (json_span_is(&vals[0], "\"mining.set_difficulty\""))
+		return fast_parse_diff(pool, &vals[1]);
+	return FAST_UNHANDLED;
+}
+
+/* Recognises a plain {"id": n, "result": true, "error": null} response,
+ * returning its id. Anything else, notably rejects which carry a reason, is
+ * left for jansson. */
+bool stratum_result_accepted(char *s, int *id)
+{
+	static const char *keys[] = { "id", "result", "error" };
+	struct json_span vals[3];
+	char *end;
+	long val;
+
+	if (!json_scan_object(s, keys, vals, 3))
+		return false;
+	if (!vals[0].start || !json_span_is(&vals[1], "true") ||
+	    (vals[2].start && !json_span_is(&vals[2], "null")))
+		return false;
+	val = strtol(vals[0].start, &end, 10);
+	if (end != vals[0].end || end == vals[0].start)
+		return false;
+	*id = val;
+	return true;
+}
+
 static bool parse_reconnect(struct pool *pool, json_t *val)
 {
 	char *url, *port, address[256];
@@ -1375,6 +1861,15 @@ bool parse_method(struct pool *pool, char *s)
 	if (!s)
 		goto out;
 
+	switch (fast_parse_method(pool, s)) {
+		case FAST_OK:
+			return true;
+		case FAST_FAIL:
+			return false;
+		case FAST_UNHANDLED:
+			break;
+	}
+
 	val = JSON_LOADS(s, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
@@ -1419,7 +1914,10 @@ bool parse_method(struct pool *pool, char *s)
 		goto out;
 	}
 
-	if (!strncasecmp(buf, "client.reconnect", 16) && parse_reconnect(pool, params)) {
+	/* The line s was received into is reused by the reconnect so it is
+	 * consumed here whether or not the reconnect succeeds */
+	if (!strncasecmp(buf, "client.reconnect", 16)) {
+		parse_reconnect(pool, params);
 		ret = true;
 		goto out;
 	}
@@ -1458,14 +1956,11 @@ bool auth_stratum(struct pool *pool)
 		sret = recv_line(pool);
 		if (!sret)
 			goto out;
-		if (parse_method(pool, sret))
-			free(sret);
-		else
+		if (!parse_method(pool, sret))
 			break;
 	}
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
@@ -1510,6 +2005,8 @@ static bool setup_stratum_curl(struct pool *pool)
 		CLOSESOCKET(pool->sock);
 #endif
 	}
+	/* Half a line would only garble the new session */
+	pool->sendbuf_len = pool->sendbuf_sent = 0;
 	pool->stratum_curl = curl_easy_init();
 	if (unlikely(!pool->stratum_curl))
 		quit(1, "Failed to curl_easy_init in initiate_stratum");
@@ -1608,6 +2105,7 @@ void suspend_stratum(struct pool *pool)
 #endif
 	}
 	pool->stratum_curl = NULL;
+	pool->sendbuf_len = pool->sendbuf_sent = 0;
 	mutex_unlock(&pool->stratum_lock);
 }
 
@@ -1655,7 +2153,6 @@ resend:
 	recvd = true;
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -1690,7 +2187,7 @@ resend:
 		goto out;
 	}
 	n2size = json_integer_value(json_array_get(res_val, 2));
-	if (!n2size) {
+	if (n2size < 1) {
 		applog(LOG_INFO, "Failed to get n2size in initiate_stratum");
 		free(sessionid);
 		free(nonce1);
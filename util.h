@@ -59,9 +59,13 @@ void copy_time(struct timeval *dest, const struct timeval *src);
 double us_tdiff(struct timeval *end, struct timeval *start);
 double tdiff(struct timeval *end, struct timeval *start);
 bool stratum_send(struct pool *pool, char *s, ssize_t len);
+bool stratum_send_queued(struct pool *pool, const char *s, size_t len);
 bool sock_full(struct pool *pool);
 char *recv_line(struct pool *pool);
+bool recv_sock(struct pool *pool);
+char *buffered_line(struct pool *pool);
 bool parse_method(struct pool *pool, char *s);
+bool stratum_result_accepted(char *s, int *id);
 bool extract_sockaddr(struct pool *pool, char *url);
 bool auth_stratum(struct pool *pool);
 bool initiate_stratum(struct pool *pool);